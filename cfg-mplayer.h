@@ -251,6 +251,8 @@ extern int    mf_w;
 extern int    mf_h;
 extern double mf_fps;
 extern char * mf_type;
+extern int    mf_prefetch;
+extern int    mf_threads;
 extern m_obj_list_t vf_obj_list;
 
 const m_option_t mfopts_conf[]={
@@ -258,6 +260,8 @@ const m_option_t mfopts_conf[]={
     {"h", &mf_h, CONF_TYPE_INT, 0, 0, 0, NULL},
     {"fps", &mf_fps, CONF_TYPE_DOUBLE, 0, 0, 0, NULL},
     {"type", &mf_type, CONF_TYPE_STRING, 0, 0, 0, NULL},
+    {"prefetch", &mf_prefetch, CONF_TYPE_INT, CONF_RANGE, 0, 256, NULL},
+    {"threads", &mf_threads, CONF_TYPE_INT, CONF_RANGE, 1, 64, NULL},
     {NULL, NULL, 0, 0, 0, 0, NULL}
 };
 
@@ -397,9 +401,15 @@ const m_option_t common_opts[] = {
     {"nocache", &stream_cache_size, CONF_TYPE_FLAG, 0, 1, 0, NULL},
     OPT_FLOATRANGE("cache-min", stream_cache_min_percent, 0, 0, 99),
     OPT_FLOATRANGE("cache-seek-min", stream_cache_seek_min_percent, 0, 0, 99),
+    OPT_STRING("cache-disk", stream_cache_disk_dir, 0),
+    OPT_MAKE_FLAGS("cache-disk-keep", stream_cache_disk_keep, 0),
+    OPT_INTRANGE("cache-disk-max", stream_cache_disk_max, 0, 0, 1048576),
+    OPT_INTRANGE("timeshift", timeshift_size, 0, 0, 1048576),
+    OPT_STRING("timeshift-dir", timeshift_dir, 0),
 #else
     {"cache", "MPlayer was compiled without cache2 support.\n", CONF_TYPE_PRINT, CONF_NOCFG, 0, 0, NULL},
 #endif /* CONFIG_STREAM_CACHE */
+    OPT_MAKE_FLAGS("mmap", stream_mmap, 0),
     {"cdrom-device", &cdrom_device, CONF_TYPE_STRING, 0, 0, 0, NULL},
 #ifdef CONFIG_DVDREAD
     {"dvd-device", &dvd_device,  CONF_TYPE_STRING, 0, 0, 0, NULL},
@@ -532,6 +542,16 @@ const m_option_t common_opts[] = {
     OPT_STRING("audio-demuxer", audio_demuxer_name, 0),
     OPT_STRING("sub-demuxer", sub_demuxer_name, 0),
     OPT_MAKE_FLAGS("extbased", extension_parsing, 0),
+    OPT_MAKE_FLAGS("demuxer-thread", demuxer_thread, 0),
+    OPT_INTRANGE("demuxer-readahead", demuxer_readahead, 0, 1, 131072),
+    OPT_FLOATRANGE("demuxer-max-seconds", demuxer_max_seconds, 0, 1, 86400),
+    OPT_INTRANGE("demuxer-max-kbytes", demuxer_max_kbytes, 0, 1024, 4194304),
+    OPT_INTRANGE("demuxer-probesize", demuxer_probesize, 0, 0, 65536),
+    OPT_MAKE_FLAGS("mkv-index-cache", mkv_index_cache, 0),
+    OPT_MAKE_FLAGS("mkv-background-index", mkv_background_index, 0),
+    OPT_FLOATRANGE("seek-tolerance", seek_tolerance, 0, 0, 60),
+    // old name from when only the MPEG demuxers used it
+    OPT_FLOATRANGE("mpeg-seek-tolerance", seek_tolerance, 0, 0, 60),
 
     {"mf", (void *) mfopts_conf, CONF_TYPE_SUBCONFIG, 0,0,0, NULL},
 #ifdef CONFIG_RADIO
@@ -619,6 +639,11 @@ const m_option_t common_opts[] = {
 
     // draw by slices or whole frame (useful with libmpeg2/libavcodec)
     OPT_MAKE_FLAGS("slices", vd_use_slices, 0),
+    // decode in a separate thread
+    OPT_MAKE_FLAGS("decode-thread", decode_thread, 0),
+    OPT_INTRANGE("decode-queue", decode_queue, 0, 1, 64),
+    // lower decoding quality when video falls behind, up to this level
+    OPT_INTRANGE("decode-degrade", decode_degrade, 0, 0, 3),
     {"field-dominance", &field_dominance, CONF_TYPE_INT, CONF_RANGE, -1, 1, NULL},
 
     {"lavdopts", (void *) lavc_decode_opts_conf, CONF_TYPE_SUBCONFIG, 0, 0, 0, NULL},
@@ -862,6 +887,10 @@ const m_option_t mplayer_opts[]={
 
     OPT_FLAG_ON("benchmark", benchmark, 0),
 
+    // write a contact sheet of keyframes instead of playing
+    OPT_INTRANGE("thumbnails", thumbnails, 0, 0, 1000),
+    OPT_INTRANGE("thumbnail-width", thumbnail_width, 0, 16, 4096),
+
     // dump some stream out instead of playing the file
     OPT_STRING("dumpfile", stream_dump_name, 0),
     {"dumpaudio", &stream_dump_type, CONF_TYPE_FLAG, 0, 0, 1, NULL},
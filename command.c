@@ -60,6 +60,7 @@
 #include "stream/pvr.h"
 #ifdef CONFIG_DVBIN
 #include "stream/dvbin.h"
+#include "stream/timeshift.h"
 #endif
 #ifdef CONFIG_DVDREAD
 #include "stream/stream_dvd.h"
@@ -412,6 +413,40 @@ static int mp_property_stream_time_pos(m_option_t *prop, int action,
 }
 
 
+/// Data queued by the demuxers in bytes (RO)
+static int mp_property_demuxer_queue_bytes(m_option_t *prop, int action,
+                                           void *arg, MPContext *mpctx)
+{
+    struct demux_queue_state state;
+    if (!mpctx->demuxer)
+        return M_PROPERTY_UNAVAILABLE;
+    switch (action) {
+    case M_PROPERTY_GET:
+        if (!arg)
+            return M_PROPERTY_ERROR;
+        demux_get_queue_state(mpctx->demuxer, &state);
+        *(off_t *) arg = strcmp(prop->name, "demuxer_queue_bytes") ?
+                         state.peak_bytes : state.bytes;
+        return M_PROPERTY_OK;
+    }
+    return M_PROPERTY_NOT_IMPLEMENTED;
+}
+
+/// Duration of the data queued by the demuxer in seconds (RO)
+static int mp_property_demuxer_queue_duration(m_option_t *prop, int action,
+                                              void *arg, MPContext *mpctx)
+{
+    struct demux_queue_state state;
+    if (!mpctx->demuxer)
+        return M_PROPERTY_UNAVAILABLE;
+    demux_get_queue_state(mpctx->demuxer, &state);
+    double duration = strcmp(prop->name, "demuxer_queue_duration") ?
+                      state.peak_duration : state.duration;
+    if (duration < 0)
+        return M_PROPERTY_UNAVAILABLE;
+    return m_property_time_ro(prop, action, arg, duration);
+}
+
 /// Media length in seconds (RO)
 static int mp_property_length(m_option_t *prop, int action, void *arg,
                               MPContext *mpctx)
@@ -641,6 +676,7 @@ static int mp_property_metadata(m_option_t *prop, int action, void *arg,
     case M_PROPERTY_GET:
         if (!arg)
             return M_PROPERTY_ERROR;
+        demux_info_load(mpctx->demuxer);
         *(char ***)arg = mpctx->demuxer->info;
         return M_PROPERTY_OK;
     case M_PROPERTY_KEY_ACTION:
@@ -1020,10 +1056,15 @@ static int mp_property_video(m_option_t *prop, int action, void *arg,
             tmp = *((int *) arg);
         else
             tmp = -1;
+        // keep the decoding thread away from the packets being freed
+        if (mpctx->sh_video)
+            video_thread_pause(mpctx->sh_video);
         int new_id = demuxer_switch_video(mpctx->d_video->demuxer, tmp);
         if (new_id != current_id)
             uninit_player(mpctx, INITIALIZED_VCODEC |
                           (opts->fixed_vo && new_id >= 0 ? 0 : INITIALIZED_VO));
+        else if (mpctx->sh_video)
+            video_thread_unpause(mpctx->sh_video);
         if (new_id != current_id && new_id >= 0) {
             sh_video_t *sh2;
             sh2 = mpctx->d_video->demuxer->v_streams[mpctx->d_video->id];
@@ -1355,6 +1396,29 @@ static int mp_property_border(m_option_t *prop, int action, void *arg,
                                &vo_border, mpctx);
 }
 
+/// Decoding quality degradation level (RW)
+static int mp_property_decode_degrade(m_option_t *prop, int action,
+                                      void *arg, MPContext *mpctx)
+{
+    if (!mpctx->sh_video)
+        return M_PROPERTY_UNAVAILABLE;
+
+    switch (action) {
+    case M_PROPERTY_SET:
+    case M_PROPERTY_STEP_UP:
+    case M_PROPERTY_STEP_DOWN: {
+        int level = mpctx->decode_degrade;
+        int r = m_property_int_range(prop, action, arg, &level);
+        if (r == M_PROPERTY_OK)
+            set_decode_degrade(mpctx, level);
+        return r;
+    }
+    default:
+        return m_property_int_range(prop, action, arg,
+                                    &mpctx->decode_degrade);
+    }
+}
+
 /// Framedropping state (RW)
 static int mp_property_framedropping(m_option_t *prop, int action,
                                      void *arg, MPContext *mpctx)
@@ -1694,6 +1758,8 @@ static int mp_property_sub(m_option_t *prop, int action, void *arg,
     vobsub_id = -1;
     opts->sub_id = -1;
     if (d_sub) {
+        // the demuxer thread must not see a half-switched subtitle stream
+        demux_pause(d_sub->demuxer);
         if (d_sub->id > -2)
             reset_spu = 1;
         d_sub->id = -2;
@@ -1758,7 +1824,10 @@ static int mp_property_sub(m_option_t *prop, int action, void *arg,
         d_sub->sh = NULL;
     }
 #endif
+    if (d_sub)
+        demux_unpause(d_sub->demuxer);
 
+    add_embedded_fonts(mpctx);
     update_subtitles(mpctx, 0, true);
 
     return M_PROPERTY_OK;
@@ -2259,6 +2328,14 @@ static const m_option_t mp_properties[] = {
       M_OPT_MIN, 0, 0, NULL },
     { "stream_time_pos", mp_property_stream_time_pos, CONF_TYPE_TIME,
       M_OPT_MIN, 0, 0, NULL },
+    { "demuxer_queue_bytes", mp_property_demuxer_queue_bytes,
+      CONF_TYPE_POSITION, M_OPT_MIN, 0, 0, NULL },
+    { "demuxer_queue_peak_bytes", mp_property_demuxer_queue_bytes,
+      CONF_TYPE_POSITION, M_OPT_MIN, 0, 0, NULL },
+    { "demuxer_queue_duration", mp_property_demuxer_queue_duration,
+      CONF_TYPE_TIME, M_OPT_MIN, 0, 0, NULL },
+    { "demuxer_queue_peak_duration", mp_property_demuxer_queue_duration,
+      CONF_TYPE_TIME, M_OPT_MIN, 0, 0, NULL },
     { "length", mp_property_length, CONF_TYPE_TIME,
       M_OPT_MIN, 0, 0, NULL },
     { "percent_pos", mp_property_percent_pos, CONF_TYPE_INT,
@@ -2323,6 +2400,8 @@ static const m_option_t mp_properties[] = {
       M_OPT_RANGE, 0, 1, NULL },
     { "framedropping", mp_property_framedropping, CONF_TYPE_INT,
       M_OPT_RANGE, 0, 2, NULL },
+    { "decode_degrade", mp_property_decode_degrade, CONF_TYPE_INT,
+      M_OPT_RANGE, 0, 3, NULL },
     { "gamma", mp_property_gamma, CONF_TYPE_INT,
       M_OPT_RANGE, -100, 100, .offset = offsetof(struct MPOpts, vo_gamma_gamma)},
     { "brightness", mp_property_gamma, CONF_TYPE_INT,
@@ -2475,6 +2554,7 @@ static struct property_osd_display {
     { "rootwin", 0, -1, _("Rootwin: %s") },
     { "border", 0, -1, _("Border: %s") },
     { "framedropping", 0, -1, _("Framedropping: %s") },
+    { "decode_degrade", 0, -1, _("Decoding quality degradation: %s") },
     { "deinterlace", 0, -1, _("Deinterlace: %s") },
     { "colormatrix", 0, -1, _("YUV colormatrix: %s") },
     { "colormatrix_input_range", 0, -1, _("YUV input range: %s") },
@@ -3249,6 +3329,9 @@ void run_command(MPContext *mpctx, mp_cmd_t *cmd)
                 dir = DVB_CHANNEL_LOWER;
 
 
+            // the time-shift thread must not read while the fds change,
+            // it is started again with an empty ring on reopening
+            timeshift_uninit(mpctx->stream);
             if (dvb_step_channel(mpctx->stream, dir)) {
                 mpctx->stop_play = PT_NEXT_ENTRY;
                 mpctx->dvbin_reopen = 1;
@@ -3282,6 +3365,7 @@ void run_command(MPContext *mpctx, mp_cmd_t *cmd)
         if (mpctx->stream->type == STREAMTYPE_DVB) {
             mpctx->last_dvb_step = 1;
 
+            timeshift_uninit(mpctx->stream);
             if (dvb_set_channel(mpctx->stream, cmd->args[1].v.i,
                                 cmd->args[0].v.i)) {
                 mpctx->stop_play = PT_NEXT_ENTRY;
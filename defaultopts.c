@@ -28,6 +28,7 @@ void set_default_mplayer_options(struct MPOpts *opts)
         .chapter_merge_threshold = 100,
         .stream_cache_min_percent = 20.0,
         .stream_cache_seek_min_percent = 50.0,
+        .stream_cache_disk_max = 4096,
         .chapterrange = {-1, -1},
         .edition_id = -1,
         .user_correct_pts = -1,
@@ -40,6 +41,11 @@ void set_default_mplayer_options(struct MPOpts *opts)
         .video_id = -1,
         .sub_id = -1,
         .extension_parsing = 1,
+        .demuxer_readahead = 1024,
+        .demuxer_max_seconds = 120,
+        .demuxer_max_kbytes = 393216,
+        .demuxer_probesize = 256,
+        .seek_tolerance = 0.5,
         .audio_output_channels = 2,
         .audio_output_format = -1,  // AF_FORMAT_UNKNOWN
         .playback_speed = 1.,
@@ -47,6 +53,8 @@ void set_default_mplayer_options(struct MPOpts *opts)
         .movie_aspect = -1.,
         .flip = -1,
         .vd_use_slices = 1,
+        .decode_queue = 4,
+        .thumbnail_width = 256,
         .sub_auto = 1,
 #ifdef CONFIG_ASS
         .ass_enabled = 1,
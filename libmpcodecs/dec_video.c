@@ -22,7 +22,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "talloc.h"
 
 #include "mp_msg.h"
 
@@ -55,6 +61,353 @@ int field_dominance = -1;
 
 int divx_quality = 0;
 
+#ifdef HAVE_PTHREADS
+/* With -decode-thread, a separate thread takes video packets from the
+ * demuxer thread's queue, decodes them and queues copies of the decoded
+ * frames, so that decoding overlaps with filtering, display and audio.
+ * Filters and VOs are not thread-safe and stay in the main thread: the
+ * decoder gets private export images instead of filter chain buffers, and
+ * its VO configuration requests are run by the main thread once all frames
+ * decoded before them have been taken. Everything else touching the decoder
+ * parks the thread with video_thread_pause() first. */
+struct video_frame {
+    struct mp_image *mpi;
+    double pts;
+};
+
+struct video_thread {
+    pthread_t thread;
+    pthread_mutex_t lock;    // protects the fields below
+    pthread_cond_t wakeup;   // wakes the decoding thread
+    pthread_cond_t done;     // signaled after each decode and config request
+    struct video_frame *frames; // ring buffer of decoded frames
+    int max_frames;
+    int first_frame;
+    int num_frames;
+    struct mp_image *current; // frame last returned by video_thread_read()
+    struct mp_image *export_mpi; // decoder output, used by the thread only
+    int pause;               // number of video_thread_pause() calls in effect
+    bool busy;               // inside the decoder
+    bool eof;
+    bool quit;
+    // VO configuration request from the decoder, run by the main thread
+    bool config_pending;
+    bool configuring;        // the main thread is running it right now
+    int config_w, config_h;
+    const unsigned int *config_outfmts;
+    unsigned int config_preferred_outfmt;
+    int config_result;
+};
+
+bool in_video_thread(sh_video_t *sh_video)
+{
+    struct video_thread *t = sh_video->thread;
+    return t && pthread_equal(pthread_self(), t->thread);
+}
+
+static struct mp_image *copy_frame(struct mp_image *mpi)
+{
+    struct mp_image *dmpi;
+    if (mpi->buffer) {
+        // decoded into a pool buffer, which the decoder will not reuse
+        dmpi = mp_image_new_ref(mpi);
+        dmpi->qscale = NULL;
+    } else {
+        dmpi = new_mp_image(mpi->width, mpi->height);
+        mp_image_setfmt(dmpi, mpi->imgfmt);
+        // 8 bit palettized output from libavcodec
+        if (!(mpi->flags & MP_IMGFLAG_PLANAR) && mpi->planes[1])
+            dmpi->flags |= MP_IMGFLAG_RGB_PALETTE;
+        mp_image_alloc_planes(dmpi);
+        dmpi->w = mpi->w;
+        dmpi->h = mpi->h;
+        copy_mpi(dmpi, mpi);
+        if (dmpi->flags & MP_IMGFLAG_RGB_PALETTE)
+            memcpy(dmpi->planes[1], mpi->planes[1], 1024);
+    }
+    if (mpi->qscale && mpi->qstride) {
+        dmpi->qstride = mpi->qstride;
+        dmpi->qscale = talloc_memdup(dmpi, mpi->qscale,
+                                     mpi->qstride * ((mpi->h + 15) >> 4));
+    }
+    dmpi->qscale_type = mpi->qscale_type;
+    dmpi->pict_type = mpi->pict_type;
+    dmpi->fields = mpi->fields;
+    return dmpi;
+}
+
+// Called with the lock held.
+static void flush_frames(struct video_thread *t)
+{
+    for (; t->num_frames; t->num_frames--) {
+        free_mp_image(t->frames[t->first_frame].mpi);
+        t->first_frame = (t->first_frame + 1) % t->max_frames;
+    }
+}
+
+// Run the decoder's VO configuration request. Called with the lock held.
+static void run_config(sh_video_t *sh_video, struct video_thread *t)
+{
+    int w = t->config_w, h = t->config_h;
+    const unsigned int *outfmts = t->config_outfmts;
+    unsigned int preferred_outfmt = t->config_preferred_outfmt;
+    t->configuring = true;
+    pthread_mutex_unlock(&t->lock);
+    int res = mpcodecs_config_vo2(sh_video, w, h, outfmts, preferred_outfmt);
+    pthread_mutex_lock(&t->lock);
+    t->configuring = false;
+    t->config_pending = false;
+    t->config_result = res;
+    pthread_cond_broadcast(&t->wakeup);
+}
+
+static void *video_thread(void *arg)
+{
+    sh_video_t *sh_video = arg;
+    struct video_thread *t = sh_video->thread;
+    pthread_mutex_lock(&t->lock);
+    while (!t->quit) {
+        if (t->pause || t->eof || t->num_frames == t->max_frames) {
+            pthread_cond_wait(&t->wakeup, &t->lock);
+            continue;
+        }
+        t->busy = true;
+        pthread_mutex_unlock(&t->lock);
+        struct demux_packet *pkt;
+        do {
+            // packets with size 0 do not correspond to frames
+            pkt = ds_get_packet2(sh_video->ds, false);
+        } while (pkt && !pkt->len);
+        void *decoded_frame = decode_video(sh_video, pkt,
+                                           pkt ? pkt->buffer : NULL,
+                                           pkt ? pkt->len : 0, 0,
+                                           pkt ? pkt->pts : MP_NOPTS_VALUE);
+        struct video_frame frame = {0};
+        if (decoded_frame) {
+            frame.mpi = copy_frame(decoded_frame);
+            frame.pts = determine_frame_pts(sh_video);
+        }
+        pthread_mutex_lock(&t->lock);
+        t->busy = false;
+        if (frame.mpi) {
+            int i = (t->first_frame + t->num_frames) % t->max_frames;
+            t->frames[i] = frame;
+            t->num_frames++;
+        } else if (!pkt)
+            t->eof = true;
+        pthread_cond_broadcast(&t->done);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+void start_video_thread(sh_video_t *sh_video)
+{
+    struct MPOpts *opts = sh_video->opts;
+    const struct vd_functions *vd = sh_video->vd_driver;
+    // packets must come from the demuxer thread, which is started later
+    // than the decoder for the first video stream of a file
+    if (!opts->decode_thread || sh_video->thread || !sh_video->initialized
+        || !sh_video->ds->demuxer->thread)
+        return;
+    if (!opts->correct_pts || !vd->decode2
+        || vd->control(sh_video, VDCTRL_QUERY_DECODE_THREAD, NULL)
+           != CONTROL_TRUE) {
+        mp_msg(MSGT_DECVIDEO, MSGL_V, "VDec: not using a decoding thread "
+               "with this decoder\n");
+        return;
+    }
+    struct video_thread *t = talloc_zero(NULL, struct video_thread);
+    t->max_frames = opts->decode_queue;
+    t->frames = talloc_array(t, struct video_frame, t->max_frames);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wakeup, NULL);
+    pthread_cond_init(&t->done, NULL);
+    // hold the lock so that the thread sees t->thread set
+    pthread_mutex_lock(&t->lock);
+    sh_video->thread = t;
+    if (pthread_create(&t->thread, NULL, video_thread, sh_video)) {
+        pthread_mutex_unlock(&t->lock);
+        mp_msg(MSGT_DECVIDEO, MSGL_ERR, "Starting decoding thread failed.\n");
+        sh_video->thread = NULL;
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->wakeup);
+        pthread_cond_destroy(&t->done);
+        talloc_free(t);
+        return;
+    }
+    // the thread waits for the lock, so it can't be decoding yet
+    vd->control(sh_video, VDCTRL_START_DECODE_THREAD, NULL);
+    pthread_mutex_unlock(&t->lock);
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "VDec: started decoding thread\n");
+}
+
+void stop_video_thread(sh_video_t *sh_video)
+{
+    struct video_thread *t = sh_video->thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->quit = true;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    sh_video->thread = NULL;
+    flush_frames(t);
+    free_mp_image(t->current);
+    free_mp_image(t->export_mpi);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->wakeup);
+    pthread_cond_destroy(&t->done);
+    talloc_free(t);
+}
+
+void video_thread_pause(sh_video_t *sh_video)
+{
+    struct video_thread *t = sh_video->thread;
+    if (!t || in_video_thread(sh_video))
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->pause++;
+    // While the main thread runs a config request the decoder is blocked
+    // anyway. A pending request is run right away, dropping the frames
+    // decoded before it, as they will not fit the new configuration.
+    while (t->busy && !t->configuring) {
+        if (t->config_pending) {
+            flush_frames(t);
+            run_config(sh_video, t);
+        } else
+            pthread_cond_wait(&t->done, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void video_thread_unpause(sh_video_t *sh_video)
+{
+    struct video_thread *t = sh_video->thread;
+    if (!t || in_video_thread(sh_video))
+        return;
+    pthread_mutex_lock(&t->lock);
+    if (!--t->pause)
+        pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void video_thread_flush(sh_video_t *sh_video)
+{
+    struct video_thread *t = sh_video->thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    flush_frames(t);
+    t->eof = false;
+    pthread_mutex_unlock(&t->lock);
+}
+
+struct mp_image *video_thread_read(sh_video_t *sh_video, double *pts)
+{
+    struct video_thread *t = sh_video->thread;
+    struct mp_image *mpi = NULL;
+    pthread_mutex_lock(&t->lock);
+    free_mp_image(t->current);
+    while (1) {
+        if (t->num_frames) {
+            struct video_frame *frame = &t->frames[t->first_frame];
+            mpi = frame->mpi;
+            *pts = frame->pts;
+            t->first_frame = (t->first_frame + 1) % t->max_frames;
+            t->num_frames--;
+            pthread_cond_broadcast(&t->wakeup);
+            break;
+        }
+        if (t->config_pending && !t->configuring)
+            run_config(sh_video, t);
+        else if (t->eof || t->pause)
+            break;
+        else
+            pthread_cond_wait(&t->done, &t->lock);
+    }
+    // stays valid until the next call, like decoder output without threading
+    t->current = mpi;
+    pthread_mutex_unlock(&t->lock);
+    return mpi;
+}
+
+int video_thread_config_vo(sh_video_t *sh_video, int w, int h,
+                           const unsigned int *outfmts,
+                           unsigned int preferred_outfmt)
+{
+    struct video_thread *t = sh_video->thread;
+    pthread_mutex_lock(&t->lock);
+    t->config_w = w;
+    t->config_h = h;
+    t->config_outfmts = outfmts;
+    t->config_preferred_outfmt = preferred_outfmt;
+    t->config_pending = true;
+    pthread_cond_broadcast(&t->done);
+    while (t->config_pending && !t->quit)
+        pthread_cond_wait(&t->wakeup, &t->lock);
+    int res = t->config_pending ? 0 : t->config_result;
+    t->config_pending = false;
+    pthread_mutex_unlock(&t->lock);
+    return res;
+}
+
+struct mp_image *video_thread_get_image(sh_video_t *sh_video, int mp_imgtype,
+                                        int mp_imgflag, int w, int h)
+{
+    struct video_thread *t = sh_video->thread;
+    if (mp_imgtype != MP_IMGTYPE_EXPORT) {
+        mp_msg(MSGT_DECVIDEO, MSGL_ERR, "VDec: decoding thread can only "
+               "export images\n");
+        return NULL;
+    }
+    struct mp_image *mpi = t->export_mpi;
+    if (!mpi || mpi->imgfmt != sh_video->outfmt || mpi->width != w
+        || mpi->height != h) {
+        free_mp_image(mpi);
+        mpi = t->export_mpi = new_mp_image(w, h);
+        mp_image_setfmt(mpi, sh_video->outfmt);
+    }
+    mpi->type = mp_imgtype;
+    mpi->flags &= MP_IMGFLAGMASK_COLORS;
+    mpi->flags |= mp_imgflag & MP_IMGFLAGMASK_RESTRICTIONS;
+    mpi->w = sh_video->disp_w;
+    mpi->h = sh_video->disp_h;
+    return mpi;
+}
+#else
+struct video_thread;
+bool in_video_thread(sh_video_t *sh_video)
+{
+    return false;
+}
+
+void start_video_thread(sh_video_t *sh_video) {}
+void stop_video_thread(sh_video_t *sh_video) {}
+void video_thread_pause(sh_video_t *sh_video) {}
+void video_thread_unpause(sh_video_t *sh_video) {}
+static void video_thread_flush(sh_video_t *sh_video) {}
+
+struct mp_image *video_thread_read(sh_video_t *sh_video, double *pts)
+{
+    return NULL;
+}
+
+int video_thread_config_vo(sh_video_t *sh_video, int w, int h,
+                           const unsigned int *outfmts,
+                           unsigned int preferred_outfmt)
+{
+    return 0;
+}
+
+struct mp_image *video_thread_get_image(sh_video_t *sh_video, int mp_imgtype,
+                                        int mp_imgflag, int w, int h)
+{
+    return NULL;
+}
+#endif
+
 int get_video_quality_max(sh_video_t *sh_video)
 {
     vf_instance_t *vf = sh_video->vfilter;
@@ -67,7 +420,9 @@ int get_video_quality_max(sh_video_t *sh_video)
     }
     const struct vd_functions *vd = sh_video->vd_driver;
     if (vd) {
+        video_thread_pause(sh_video);
         int ret = vd->control(sh_video, VDCTRL_QUERY_MAX_PP_LEVEL, NULL);
+        video_thread_unpause(sh_video);
         if (ret > 0) {
             mp_tmsg(MSGT_DECVIDEO, MSGL_INFO, "[PP] Using codec's postprocessing, max q = %d.\n", ret);
             return ret;
@@ -85,8 +440,33 @@ void set_video_quality(sh_video_t *sh_video, int quality)
             return;             // success
     }
     const struct vd_functions *vd = sh_video->vd_driver;
-    if (vd)
+    if (vd) {
+        video_thread_pause(sh_video);
         vd->control(sh_video, VDCTRL_SET_PP_LEVEL, (void *) (&quality));
+        video_thread_unpause(sh_video);
+    }
+}
+
+void set_video_display_size(sh_video_t *sh_video, int w, int h)
+{
+    const struct vd_functions *vd = sh_video->vd_driver;
+    int size[2] = {w, h};
+    if (!vd)
+        return;
+    video_thread_pause(sh_video);
+    vd->control(sh_video, VDCTRL_SET_DISPLAY_SIZE, size);
+    video_thread_unpause(sh_video);
+}
+
+bool set_video_degrade(sh_video_t *sh_video, int level)
+{
+    const struct vd_functions *vd = sh_video->vd_driver;
+    if (!vd)
+        return false;
+    video_thread_pause(sh_video);
+    int ret = vd->control(sh_video, VDCTRL_SET_DEGRADE, &level);
+    video_thread_unpause(sh_video);
+    return ret == CONTROL_TRUE;
 }
 
 int set_video_colors(sh_video_t *sh_video, const char *item, int value)
@@ -105,10 +485,14 @@ int set_video_colors(sh_video_t *sh_video, const char *item, int value)
     }
     /* try software control */
     const struct vd_functions *vd = sh_video->vd_driver;
-    if (vd &&
-        vd->control(sh_video, VDCTRL_SET_EQUALIZER, (void *)item, value)
-            == CONTROL_OK)
-        return 1;
+    if (vd) {
+        video_thread_pause(sh_video);
+        int ret = vd->control(sh_video, VDCTRL_SET_EQUALIZER, (void *)item,
+                              value);
+        video_thread_unpause(sh_video);
+        if (ret == CONTROL_OK)
+            return 1;
+    }
     mp_tmsg(MSGT_DECVIDEO, MSGL_V, "Video attribute '%s' is not supported by selected vo & vd.\n",
            item);
     return 0;
@@ -131,8 +515,13 @@ int get_video_colors(sh_video_t *sh_video, const char *item, int *value)
     }
     /* try software control */
     const struct vd_functions *vd = sh_video->vd_driver;
-    if (vd)
-        return vd->control(sh_video, VDCTRL_GET_EQUALIZER, (void *)item, value);
+    if (vd) {
+        video_thread_pause(sh_video);
+        int ret = vd->control(sh_video, VDCTRL_GET_EQUALIZER, (void *)item,
+                              value);
+        video_thread_unpause(sh_video);
+        return ret;
+    }
     return 0;
 }
 
@@ -198,17 +587,23 @@ int set_rectangle(sh_video_t *sh_video, int param, int value)
 void resync_video_stream(sh_video_t *sh_video)
 {
     const struct vd_functions *vd = sh_video->vd_driver;
+    video_thread_pause(sh_video);
     if (vd)
         vd->control(sh_video, VDCTRL_RESYNC_STREAM, NULL);
+    video_thread_flush(sh_video);
+    sh_video->num_buffered_pts = 0;
     sh_video->prev_codec_reordered_pts = MP_NOPTS_VALUE;
     sh_video->prev_sorted_pts = MP_NOPTS_VALUE;
+    video_thread_unpause(sh_video);
 }
 
 void video_reset_aspect(struct sh_video *sh_video)
 {
+    video_thread_pause(sh_video);
     int r = sh_video->vd_driver->control(sh_video, VDCTRL_RESET_ASPECT, NULL);
     if (r != true)
         mpcodecs_config_vo(sh_video, sh_video->disp_w, sh_video->disp_h, 0);
+    video_thread_unpause(sh_video);
 }
 
 int get_current_video_decoder_lag(sh_video_t *sh_video)
@@ -227,8 +622,10 @@ void uninit_video(sh_video_t *sh_video)
     if (!sh_video->initialized)
         return;
     mp_tmsg(MSGT_DECVIDEO, MSGL_V, "Uninit video: %s\n", sh_video->codec->drv);
+    stop_video_thread(sh_video);
     sh_video->vd_driver->uninit(sh_video);
     vf_uninit_filter_chain(sh_video->vfilter);
+    mp_image_pool_flush();
     sh_video->initialized = 0;
 }
 
@@ -493,6 +890,36 @@ void *decode_video(sh_video_t *sh_video, struct demux_packet *packet,
     return mpi;
 }
 
+double determine_frame_pts(sh_video_t *sh_video)
+{
+    struct MPOpts *opts = sh_video->opts;
+
+    if (opts->user_pts_assoc_mode)
+        sh_video->pts_assoc_mode = opts->user_pts_assoc_mode;
+    else if (sh_video->pts_assoc_mode == 0) {
+        if (sh_video->ds->demuxer->timestamp_type == TIMESTAMP_TYPE_PTS
+            && sh_video->codec_reordered_pts != MP_NOPTS_VALUE)
+            sh_video->pts_assoc_mode = 1;
+        else
+            sh_video->pts_assoc_mode = 2;
+    } else {
+        int probcount1 = sh_video->num_reordered_pts_problems;
+        int probcount2 = sh_video->num_sorted_pts_problems;
+        if (sh_video->pts_assoc_mode == 2) {
+            int tmp = probcount1;
+            probcount1 = probcount2;
+            probcount2 = tmp;
+        }
+        if (probcount1 >= probcount2 * 1.5 + 2) {
+            sh_video->pts_assoc_mode = 3 - sh_video->pts_assoc_mode;
+            mp_msg(MSGT_CPLAYER, MSGL_V, "Switching to pts association mode "
+                   "%d.\n", sh_video->pts_assoc_mode);
+        }
+    }
+    return sh_video->pts_assoc_mode == 1 ?
+           sh_video->codec_reordered_pts : sh_video->sorted_pts;
+}
+
 int filter_video(sh_video_t *sh_video, void *frame, double pts)
 {
     mp_image_t *mpi = frame;
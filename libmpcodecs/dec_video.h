@@ -33,10 +33,27 @@ struct demux_packet;
 void *decode_video(sh_video_t *sh_video, struct demux_packet *packet,
                    unsigned char *start, int in_size, int drop_frame,
                    double pts);
+double determine_frame_pts(sh_video_t *sh_video);
 int filter_video(sh_video_t *sh_video, void *frame, double pts);
 
+// decoding in a separate thread (-decode-thread)
+void start_video_thread(sh_video_t *sh_video);
+void stop_video_thread(sh_video_t *sh_video);
+void video_thread_pause(sh_video_t *sh_video);
+void video_thread_unpause(sh_video_t *sh_video);
+struct mp_image *video_thread_read(sh_video_t *sh_video, double *pts);
+// decoder callbacks running in the thread, see vd.c
+bool in_video_thread(sh_video_t *sh_video);
+int video_thread_config_vo(sh_video_t *sh_video, int w, int h,
+                           const unsigned int *outfmts,
+                           unsigned int preferred_outfmt);
+struct mp_image *video_thread_get_image(sh_video_t *sh_video, int mp_imgtype,
+                                        int mp_imgflag, int w, int h);
+
 int get_video_quality_max(sh_video_t *sh_video);
 void set_video_quality(sh_video_t *sh_video, int quality);
+bool set_video_degrade(sh_video_t *sh_video, int level);
+void set_video_display_size(sh_video_t *sh_video, int w, int h);
 
 int get_video_colors(sh_video_t *sh_video, const char *item, int *value);
 int set_video_colors(sh_video_t *sh_video, const char *item, int value);
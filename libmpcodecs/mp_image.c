@@ -21,8 +21,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "talloc.h"
+#include "mp_msg.h"
 
 #include "libmpcodecs/img_format.h"
 #include "libmpcodecs/mp_image.h"
@@ -30,15 +36,128 @@
 #include "libvo/fastmemcpy.h"
 #include "libavutil/mem.h"
 
+/* Plane memory of allocated images comes from a pool of refcounted
+ * buffers. The same image sizes are allocated over and over, by filters
+ * after every reconfiguration and by the decoder for every frame, so freed
+ * buffers are kept for reuse instead of going back to the system. Several
+ * images can share one buffer, see mp_image_new_ref(). Decoder threads
+ * allocate and free images too, so the pool is locked. */
+
+#define IMAGE_POOL_MAX_CACHED (64 * 1024 * 1024) // limit for unused buffers
+
+struct mp_image_buffer {
+    struct mp_image_buffer *next; // on the free list
+    int refcount;
+    size_t size;
+    unsigned char *data;
+};
+
+static struct image_pool {
+    struct mp_image_buffer *free_buffers; // most recently freed first
+    int64_t cached_bytes;
+    unsigned hits, misses;
+} image_pool;
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t image_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void image_pool_lock(void)   { pthread_mutex_lock(&image_pool_mutex); }
+static void image_pool_unlock(void) { pthread_mutex_unlock(&image_pool_mutex); }
+#else
+static void image_pool_lock(void)   {}
+static void image_pool_unlock(void) {}
+#endif
+
+static void free_buffer(struct mp_image_buffer *buf)
+{
+    av_free(buf->data);
+    free(buf);
+}
+
+static struct mp_image_buffer *get_buffer(size_t size)
+{
+    struct image_pool *pool = &image_pool;
+    image_pool_lock();
+    struct mp_image_buffer **p = &pool->free_buffers;
+    while (*p && (*p)->size != size)
+        p = &(*p)->next;
+    struct mp_image_buffer *buf = *p;
+    if (buf) {
+        *p = buf->next;
+        pool->cached_bytes -= size;
+        pool->hits++;
+    } else
+        pool->misses++;
+    image_pool_unlock();
+    if (!buf) {
+        buf = malloc(sizeof(*buf));
+        if (!buf || !(buf->data = av_malloc(size)))
+            abort(); //out of memory
+        buf->size = size;
+    }
+    buf->next = NULL;
+    buf->refcount = 1;
+    return buf;
+}
+
+// Called with the lock held.
+static void unref_buffer(struct mp_image_buffer *buf)
+{
+    struct image_pool *pool = &image_pool;
+    if (--buf->refcount)
+        return;
+    buf->next = pool->free_buffers;
+    pool->free_buffers = buf;
+    pool->cached_bytes += buf->size;
+    // drop the buffers unused for the longest time, e.g. of an old size
+    while (pool->cached_bytes > IMAGE_POOL_MAX_CACHED) {
+        struct mp_image_buffer **p = &pool->free_buffers;
+        while ((*p)->next)
+            p = &(*p)->next;
+        pool->cached_bytes -= (*p)->size;
+        free_buffer(*p);
+        *p = NULL;
+    }
+}
+
+void mp_image_set_buffer(mp_image_t *mpi, struct mp_image_buffer *buf)
+{
+    if (buf == mpi->buffer)
+        return;
+    image_pool_lock();
+    if (buf)
+        buf->refcount++;
+    if (mpi->buffer)
+        unref_buffer(mpi->buffer);
+    image_pool_unlock();
+    mpi->buffer = buf;
+}
+
+void mp_image_pool_flush(void)
+{
+    struct image_pool *pool = &image_pool;
+    image_pool_lock();
+    if (pool->hits || pool->misses)
+        mp_msg(MSGT_DECVIDEO, MSGL_V, "mp_image: buffer pool: %u hits, "
+               "%u misses, %"PRId64" KB cached\n", pool->hits, pool->misses,
+               pool->cached_bytes / 1024);
+    while (pool->free_buffers) {
+        struct mp_image_buffer *buf = pool->free_buffers;
+        pool->free_buffers = buf->next;
+        free_buffer(buf);
+    }
+    *pool = (struct image_pool){0};
+    image_pool_unlock();
+}
+
 void mp_image_alloc_planes(mp_image_t *mpi) {
+  mp_image_set_buffer(mpi, NULL);
   // IF09 - allocate space for 4. plane delta info - unused
   if (mpi->imgfmt == IMGFMT_IF09) {
-    mpi->planes[0]=av_malloc(mpi->bpp*mpi->width*(mpi->height+2)/8+
-                            mpi->chroma_width*mpi->chroma_height);
+    mpi->buffer=get_buffer(mpi->bpp*mpi->width*(mpi->height+2)/8+
+                           mpi->chroma_width*mpi->chroma_height);
   } else
-    mpi->planes[0]=av_malloc(mpi->bpp*mpi->width*(mpi->height+2)/8);
-  if (!mpi->planes[0])
-    abort(); //out of memory
+    mpi->buffer=get_buffer(mpi->bpp*mpi->width*(mpi->height+2)/8);
+  mpi->planes[0]=mpi->buffer->data;
   if (mpi->flags&MP_IMGFLAG_PLANAR) {
     int bpp = IMGFMT_IS_YUVP16(mpi->imgfmt)? 2 : 1;
     // YV12/I420/YVU9/IF09. feel free to add other planar formats here...
@@ -82,11 +201,12 @@ mp_image_t* alloc_mpi(int w, int h, unsigned long int fmt) {
 
 void copy_mpi(mp_image_t *dmpi, mp_image_t *mpi) {
   if(mpi->flags&MP_IMGFLAG_PLANAR){
-    memcpy_pic(dmpi->planes[0],mpi->planes[0], mpi->w, mpi->h,
+    int bpp = IMGFMT_IS_YUVP16(mpi->imgfmt)? 2 : 1;
+    memcpy_pic(dmpi->planes[0],mpi->planes[0], bpp*mpi->w, mpi->h,
 	       dmpi->stride[0],mpi->stride[0]);
-    memcpy_pic(dmpi->planes[1],mpi->planes[1], mpi->chroma_width, mpi->chroma_height,
+    memcpy_pic(dmpi->planes[1],mpi->planes[1], bpp*mpi->chroma_width, mpi->chroma_height,
 	       dmpi->stride[1],mpi->stride[1]);
-    memcpy_pic(dmpi->planes[2], mpi->planes[2], mpi->chroma_width, mpi->chroma_height,
+    memcpy_pic(dmpi->planes[2], mpi->planes[2], bpp*mpi->chroma_width, mpi->chroma_height,
 	       dmpi->stride[2],mpi->stride[2]);
   } else {
     memcpy_pic(dmpi->planes[0],mpi->planes[0],
@@ -190,12 +310,11 @@ static int mp_image_destructor(void *ptr)
 {
     mp_image_t *mpi = ptr;
 
-    if(mpi->flags&MP_IMGFLAG_ALLOCATED){
-        /* because we allocate the whole image at once */
-        av_free(mpi->planes[0]);
-        if (mpi->flags & MP_IMGFLAG_RGB_PALETTE)
-            av_free(mpi->planes[1]);
-    }
+    /* because we allocate the whole image at once */
+    mp_image_set_buffer(mpi, NULL);
+    if ((mpi->flags & MP_IMGFLAG_ALLOCATED) &&
+        (mpi->flags & MP_IMGFLAG_RGB_PALETTE))
+        av_free(mpi->planes[1]);
 
     return 0;
 }
@@ -212,3 +331,16 @@ void free_mp_image(mp_image_t* mpi){
     talloc_free(mpi);
 }
 
+mp_image_t *mp_image_new_ref(mp_image_t *mpi)
+{
+    mp_image_t *new = new_mp_image(mpi->width, mpi->height);
+    *new = *mpi;
+    // the palette is not refcounted
+    new->flags &= ~(MP_IMGFLAG_ALLOCATED | MP_IMGFLAG_RGB_PALETTE);
+    new->priv = NULL;
+    new->usage_count = 0;
+    new->buffer = NULL;
+    mp_image_set_buffer(new, mpi->buffer);
+    return new;
+}
+
@@ -120,6 +120,8 @@ typedef struct mp_image {
     int usage_count;
     /* for private use by filter or vo driver (to store buffer id or dmpi) */
     void* priv;
+    /* refcounted memory holding the planes, NULL if not from the pool */
+    struct mp_image_buffer *buffer;
 } mp_image_t;
 
 void mp_image_setfmt(mp_image_t* mpi,unsigned int out_fmt);
@@ -130,4 +132,11 @@ mp_image_t* alloc_mpi(int w, int h, unsigned long int fmt);
 void mp_image_alloc_planes(mp_image_t *mpi);
 void copy_mpi(mp_image_t *dmpi, mp_image_t *mpi);
 
+// make mpi hold a reference to buf (may be NULL) instead of its old buffer
+void mp_image_set_buffer(mp_image_t *mpi, struct mp_image_buffer *buf);
+// new image sharing the planes of mpi, which must have a buffer
+mp_image_t *mp_image_new_ref(mp_image_t *mpi);
+// free the unused buffers cached by the pool
+void mp_image_pool_flush(void);
+
 #endif /* MPLAYER_MP_IMAGE_H */
@@ -120,6 +120,9 @@ int mpcodecs_config_vo2(sh_video_t *sh, int w, int h,
     int palette = 0;
     int vocfg_flags = 0;
 
+    if (in_video_thread(sh))
+        return video_thread_config_vo(sh, w, h, outfmts, preferred_outfmt);
+
     if (w)
         sh->disp_w = w;
     if (h)
@@ -273,14 +276,15 @@ int mpcodecs_config_vo2(sh_video_t *sh, int w, int h,
             if (!screen_size_y)
                 screen_size_y = 1;
             if (screen_size_x <= 8)
-                screen_size_x *= sh->disp_w;
+                screen_size_x *= sh->disp_w << sh->lowres;
             if (screen_size_y <= 8)
-                screen_size_y *= sh->disp_h;
+                screen_size_y *= sh->disp_h << sh->lowres;
         }
     } else {
         // check source format aspect, calculate prescale ::atmos
-        screen_size_x = sh->disp_w;
-        screen_size_y = sh->disp_h;
+        // (the display size does not change with the decoder's lowres level)
+        screen_size_x = sh->disp_w << sh->lowres;
+        screen_size_y = sh->disp_h << sh->lowres;
         if (opts->screen_size_xy >= 0.001) {
             if (opts->screen_size_xy <= 8) {
                 // -xy means x+y scale
@@ -358,8 +362,12 @@ int mpcodecs_config_vo2(sh_video_t *sh, int w, int h,
 mp_image_t *mpcodecs_get_image(sh_video_t *sh, int mp_imgtype, int mp_imgflag,
                                int w, int h)
 {
-    mp_image_t *mpi =
-        vf_get_image(sh->vfilter, sh->outfmt, mp_imgtype, mp_imgflag, w, h);
+    mp_image_t *mpi;
+    if (in_video_thread(sh))
+        mpi = video_thread_get_image(sh, mp_imgtype, mp_imgflag, w, h);
+    else
+        mpi = vf_get_image(sh->vfilter, sh->outfmt, mp_imgtype, mp_imgflag,
+                           w, h);
     if (mpi)
         mpi->x = mpi->y = 0;
     return mpi;
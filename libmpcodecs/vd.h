@@ -51,6 +51,10 @@ extern const vd_functions_t *const mpcodecs_vd_drivers[];
 #define VDCTRL_RESYNC_STREAM 8 // reset decode state after seeking
 #define VDCTRL_QUERY_UNSEEN_FRAMES 9 // current decoder lag
 #define VDCTRL_RESET_ASPECT 10 // reinit filter/VO chain for new aspect ratio
+#define VDCTRL_QUERY_DECODE_THREAD 11 // decode2() may run in another thread
+#define VDCTRL_SET_DEGRADE 12 // trade decoding quality for speed (int level)
+#define VDCTRL_SET_DISPLAY_SIZE 13 // size the video is shown at (int[2])
+#define VDCTRL_START_DECODE_THREAD 14 // decode2() runs in another thread now
 
 // callbacks:
 int mpcodecs_config_vo2(sh_video_t *sh, int w, int h,
@@ -30,6 +30,7 @@
 #include "config.h"
 #include "mp_msg.h"
 #include "options.h"
+#include "mpcommon.h"
 #include "av_opts.h"
 
 #include "mpbswap.h"
@@ -56,12 +57,21 @@ static const vd_info_t info = {
 #error palette too large, adapt libmpcodecs/vf.c:vf_get_image
 #endif
 
+// packet kept back while the decoder is drained for a lowres switch
+struct held_packet {
+    uint8_t *data;
+    int len;
+    double pts;
+};
+
 typedef struct {
     AVCodecContext *avctx;
     AVFrame *pic;
     enum PixelFormat pix_fmt;
     int do_slices;
     int do_dr1;
+    int use_pool;   // decode into refcounted mp_image pool buffers
+    bool pool_ok;   // pool buffers can be used with this codec
     int vo_initialized;
     int best_csp;
     int qp_stat[32];
@@ -71,12 +81,21 @@ typedef struct {
     int b_count;
     AVRational last_sample_aspect_ratio;
     enum AVDiscard skip_frame;
+    enum AVDiscard skip_loop_filter;
+    int degrade;    // decoding quality degradation level, see VDCTRL_SET_DEGRADE
+    bool auto_lowres; // lowres=auto: lowres level follows the display size
+    int lowres;     // lowres level to switch to at the next keyframe
+    bool draining;  // passing on the delayed frames before switching
+    struct held_packet *held; // packets received meanwhile
+    int num_held;
 } vd_ffmpeg_ctx;
 
 #include "m_option.h"
 
 static int get_buffer(AVCodecContext *avctx, AVFrame *pic);
 static void release_buffer(AVCodecContext *avctx, AVFrame *pic);
+static int pool_get_buffer(AVCodecContext *avctx, AVFrame *pic);
+static void pool_release_buffer(AVCodecContext *avctx, AVFrame *pic);
 static void draw_slice(struct AVCodecContext *s, const AVFrame *src,
                        int offset[4], int y, int type, int height);
 
@@ -101,6 +120,7 @@ const m_option_t lavc_decode_opts_conf[] = {
     OPT_STRING("skipframe", lavc_param.skip_frame_str, 0),
     OPT_INTRANGE("threads", lavc_param.threads, 0, 0, 16),
     OPT_FLAG_CONSTANTS("bitexact", lavc_param.bitexact, 0, 0, CODEC_FLAG_BITEXACT),
+    OPT_FLAG_ON("pool", lavc_param.pool, 0),
     OPT_STRING("o", lavc_param.avopt, 0),
     {NULL, NULL, 0, 0, 0, 0, NULL}
 };
@@ -142,11 +162,13 @@ static int init(sh_video_t *sh)
             && !do_vis_debug)
         ctx->do_slices = 1;
 
-    if (lavc_codec->capabilities & CODEC_CAP_DR1 && !do_vis_debug
-            && lavc_codec->id != CODEC_ID_H264
+    bool pool_ok = lavc_codec->capabilities & CODEC_CAP_DR1 && !do_vis_debug
             && lavc_codec->id != CODEC_ID_INTERPLAY_VIDEO
-            && lavc_codec->id != CODEC_ID_ROQ && lavc_codec->id != CODEC_ID_VP8
-            && lavc_codec->id != CODEC_ID_LAGARITH)
+            && lavc_codec->id != CODEC_ID_ROQ
+            && lavc_codec->id != CODEC_ID_LAGARITH;
+    // H.264 and VP8 keep more reference frames than IP/IPB buffers allow
+    if (pool_ok && lavc_codec->id != CODEC_ID_H264
+            && lavc_codec->id != CODEC_ID_VP8)
         ctx->do_dr1 = 1;
     ctx->ip_count = ctx->b_count = 0;
 
@@ -157,8 +179,9 @@ static int init(sh_video_t *sh)
     avctx->codec_type = AVMEDIA_TYPE_VIDEO;
     avctx->codec_id = lavc_codec->id;
 
-    if (lavc_codec->capabilities & CODEC_CAP_HWACCEL   // XvMC
-        || lavc_codec->capabilities & CODEC_CAP_HWACCEL_VDPAU) {
+    bool hwaccel = lavc_codec->capabilities & (CODEC_CAP_HWACCEL    // XvMC
+                                               | CODEC_CAP_HWACCEL_VDPAU);
+    if (hwaccel) {
         ctx->do_dr1    = true;
         ctx->do_slices = true;
         lavc_param->threads    = 1;
@@ -194,12 +217,22 @@ static int init(sh_video_t *sh)
         mp_tmsg(MSGT_DECVIDEO, MSGL_INFO, "Asking decoder to use "
                 "%d threads if supported.\n", lavc_param->threads);
     }
+    ctx->pool_ok = pool_ok;
 
     if (ctx->do_dr1) {
         avctx->flags |= CODEC_FLAG_EMU_EDGE;
         avctx->get_buffer = get_buffer;
         avctx->release_buffer = release_buffer;
         avctx->reget_buffer = get_buffer;
+    } else if (pool_ok && lavc_param->pool) {
+        /* Pool buffers can be allocated from any thread and as many as
+         * needed, and the frames decoded into them can be passed on
+         * without copying. */
+        ctx->use_pool = 1;
+        avctx->flags |= CODEC_FLAG_EMU_EDGE;
+        avctx->get_buffer = pool_get_buffer;
+        avctx->release_buffer = pool_release_buffer;
+        avctx->thread_safe_callbacks = 1;
     }
 
     avctx->flags |= lavc_param->bitexact;
@@ -220,9 +253,21 @@ static int init(sh_video_t *sh)
     avctx->debug_mv = lavc_param->vismv;
     avctx->skip_top   = lavc_param->skip_top;
     avctx->skip_bottom = lavc_param->skip_bottom;
-    if (lavc_param->lowres_str != NULL) {
+    char *lowres_str = lavc_param->lowres_str;
+    char *skip_frame_str = lavc_param->skip_frame_str;
+    // -thumbnails needs only keyframes, at about the size of the thumbnails
+    if (sh->opts->thumbnails) {
+        if (!lowres_str)
+            lowres_str = "auto";
+        if (!skip_frame_str)
+            skip_frame_str = "nonkey";
+    }
+    if (lowres_str && !strcmp(lowres_str, "auto")) {
+        // picked when the player tells us the display size
+        ctx->auto_lowres = !hwaccel && lavc_codec->max_lowres > 0;
+    } else if (lowres_str != NULL) {
         int lowres, lowres_w;
-        sscanf(lavc_param->lowres_str, "%d,%d", &lowres, &lowres_w);
+        sscanf(lowres_str, "%d,%d", &lowres, &lowres_w);
         if (lowres < 1 || lowres > 16 ||
                 lowres_w > 0 && avctx->width < lowres_w)
             lowres = 0;
@@ -230,7 +275,7 @@ static int init(sh_video_t *sh)
     }
     avctx->skip_loop_filter = str2AVDiscard(lavc_param->skip_loop_filter_str);
     avctx->skip_idct = str2AVDiscard(lavc_param->skip_idct_str);
-    avctx->skip_frame = str2AVDiscard(lavc_param->skip_frame_str);
+    avctx->skip_frame = str2AVDiscard(skip_frame_str);
 
     if (lavc_param->avopt) {
         if (parse_avopts(avctx, lavc_param->avopt) < 0) {
@@ -244,6 +289,8 @@ static int init(sh_video_t *sh)
 
     // Do this after the above avopt handling in case it changes values
     ctx->skip_frame = avctx->skip_frame;
+    ctx->skip_loop_filter = avctx->skip_loop_filter;
+    ctx->lowres = avctx->lowres;
 
     mp_dbg(MSGT_DECVIDEO, MSGL_DBG2,
            "libavcodec.size: %d x %d\n", avctx->width, avctx->height);
@@ -420,6 +467,7 @@ static int init_vo(sh_video_t *sh, enum PixelFormat pix_fmt)
         ctx->last_sample_aspect_ratio = avctx->sample_aspect_ratio;
         sh->disp_w = width;
         sh->disp_h = height;
+        sh->lowres = ctx->auto_lowres ? avctx->lowres : 0;
         ctx->pix_fmt = pix_fmt;
         ctx->best_csp = pixfmt2imgfmt(pix_fmt);
         const unsigned int *supported_fmts;
@@ -588,6 +636,87 @@ static void release_buffer(struct AVCodecContext *avctx, AVFrame *pic)
         pic->data[i] = NULL;
 }
 
+static int pool_get_buffer(AVCodecContext *avctx, AVFrame *pic)
+{
+    int imgfmt = pixfmt2imgfmt(avctx->pix_fmt);
+    int xs, ys;
+    int width = avctx->width;
+    int height = avctx->height;
+
+    // only planar YUV, palettes are not refcounted
+    if (!mp_get_chroma_shift(imgfmt, &xs, &ys, NULL) || xs > 2 || ys > 2)
+        return avcodec_default_get_buffer(avctx, pic);
+    avcodec_align_dimensions(avctx, &width, &height);
+    // keep the chroma lines aligned for SIMD code too
+    mp_image_t *mpi = new_mp_image(FFALIGN(width, 32 << xs), height);
+    mp_image_setfmt(mpi, imgfmt);
+    mp_image_alloc_planes(mpi);
+
+    for (int i = 0; i < 4; i++) {
+        pic->data[i] = mpi->planes[i];
+        pic->linesize[i] = mpi->stride[i];
+    }
+    pic->opaque = mpi;
+    pic->type = FF_BUFFER_TYPE_USER;
+    // see get_buffer()
+    pic->reordered_opaque = avctx->reordered_opaque;
+    return 0;
+}
+
+static void pool_release_buffer(AVCodecContext *avctx, AVFrame *pic)
+{
+    if (pic->type != FF_BUFFER_TYPE_USER) {
+        avcodec_default_release_buffer(avctx, pic);
+        return;
+    }
+    // the planes stay valid as long as other images refer to them
+    free_mp_image(pic->opaque);
+    pic->opaque = NULL;
+    for (int i = 0; i < 4; i++)
+        pic->data[i] = NULL;
+}
+
+/* Switch to the lowres level picked by VDCTRL_SET_DISPLAY_SIZE. libavcodec
+ * only reads it when opening the decoder, and reopening it drops all frames
+ * the decoder still holds. So at a keyframe the decoder is drained first,
+ * see decode(), and after a seek it is flushed anyway. */
+static void reopen_lowres(sh_video_t *sh)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    AVCodecContext *avctx = ctx->avctx;
+    AVCodec *codec = avctx->codec;
+    int old_lowres = avctx->lowres;
+
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "[VD_FFMPEG] Switching from lowres %d "
+           "to %d.\n", old_lowres, ctx->lowres);
+    avcodec_close(avctx);
+    avctx->lowres = ctx->lowres;
+    if (avcodec_open2(avctx, codec, NULL) < 0) {
+        mp_msg(MSGT_DECVIDEO, MSGL_ERR, "[VD_FFMPEG] Reopening the decoder "
+               "failed, not using lowres=auto.\n");
+        ctx->auto_lowres = false;
+        avctx->lowres = ctx->lowres = old_lowres;
+        if (avcodec_open2(avctx, codec, NULL) < 0)
+            mp_tmsg(MSGT_DECVIDEO, MSGL_ERR, "Could not open codec.\n");
+    }
+}
+
+static void hold_packet(vd_ffmpeg_ctx *ctx, void *data, int len, double pts)
+{
+    // libavcodec wants zeroed padding after the data
+    uint8_t *copy = talloc_zero_size(ctx, len + FF_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(copy, data, len);
+    ctx->held = talloc_realloc(ctx, ctx->held, struct held_packet,
+                               ctx->num_held + 1);
+    ctx->held[ctx->num_held++] = (struct held_packet){copy, len, pts};
+}
+
+static void drop_held_packet(vd_ffmpeg_ctx *ctx)
+{
+    talloc_free(ctx->held[0].data);
+    memmove(ctx->held, ctx->held + 1, --ctx->num_held * sizeof(*ctx->held));
+}
+
 static av_unused void swap_palette(void *pal)
 {
     int i;
@@ -613,26 +742,66 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
     if (!dr1)
         avctx->draw_horiz_band = NULL;
 
+    /* A lowres switch waits for a keyframe (demuxers set the packet flags
+     * for keyframes only). The frames still in the decoder are passed on
+     * first, one per call, by decoding empty packets, and the packets that
+     * arrive meanwhile are decoded after the switch. The decoder's output
+     * delay is refilled from these, so they do not add latency for long. */
+    if (ctx->lowres != avctx->lowres && packet && packet->flags)
+        ctx->draining = true;
+    bool held = (ctx->draining || ctx->num_held) && len > 0;
+    if (held)
+        hold_packet(ctx, data, len, *reordered_pts);
+
     if (flags & 2)
         avctx->skip_frame = AVDISCARD_ALL;
     else if (flags & 1)
         avctx->skip_frame = AVDISCARD_NONREF;
+    else if (ctx->degrade >= 2)
+        avctx->skip_frame = FFMAX(ctx->skip_frame, AVDISCARD_NONREF);
     else
         avctx->skip_frame = ctx->skip_frame;
 
-    av_init_packet(&pkt);
-    pkt.data = data;
-    pkt.size = len;
-    // HACK: make PNGs decode normally instead of as CorePNG delta frames
-    pkt.flags = AV_PKT_FLAG_KEY;
-    if (packet && packet->avpacket) {
-        pkt.side_data = packet->avpacket->side_data;
-        pkt.side_data_elems = packet->avpacket->side_data_elems;
-    }
     // The avcodec opaque field stupidly supports only int64_t type
     union pts { int64_t i; double d; };
-    avctx->reordered_opaque = (union pts){.d = *reordered_pts}.i;
-    ret = avcodec_decode_video2(avctx, pic, &got_picture, &pkt);
+    while (1) {
+        bool from_queue = !ctx->draining && ctx->num_held;
+        double pts = *reordered_pts;
+        av_init_packet(&pkt);
+        if (ctx->draining) {
+            pkt.data = NULL;
+            pkt.size = 0;
+            pts = MP_NOPTS_VALUE;
+        } else if (from_queue) {
+            pkt.data = ctx->held[0].data;
+            pkt.size = ctx->held[0].len;
+            pts = ctx->held[0].pts;
+        } else {
+            pkt.data = data;
+            pkt.size = len;
+            if (packet && packet->avpacket) {
+                pkt.side_data = packet->avpacket->side_data;
+                pkt.side_data_elems = packet->avpacket->side_data_elems;
+            }
+        }
+        // HACK: make PNGs decode normally instead of as CorePNG delta frames
+        pkt.flags = AV_PKT_FLAG_KEY;
+        avctx->reordered_opaque = (union pts){.d = pts}.i;
+        ret = avcodec_decode_video2(avctx, pic, &got_picture, &pkt);
+        if (from_queue)
+            drop_held_packet(ctx);
+        if (got_picture)
+            break;
+        if (ctx->draining) {
+            ctx->draining = false;
+            reopen_lowres(sh);
+            continue;
+        }
+        // go on with the next packet while the decoder fills up again
+        if (from_queue && (ctx->num_held || !held))
+            continue;
+        break;
+    }
     *reordered_pts = (union pts){.i = pic->reordered_opaque}.d;
 
     dr1 = ctx->do_dr1;
@@ -733,6 +902,11 @@ static struct mp_image *decode(struct sh_video *sh, struct demux_packet *packet,
     }
 
     if (!dr1) {
+        // lets the frame be kept without copying if it is in a pool buffer
+        struct mp_image_buffer *buf = NULL;
+        if (ctx->use_pool && pic->type == FF_BUFFER_TYPE_USER)
+            buf = ((mp_image_t *)pic->opaque)->buffer;
+        mp_image_set_buffer(mpi, buf);
         mpi->planes[0] = pic->data[0];
         mpi->planes[1] = pic->data[1];
         mpi->planes[2] = pic->data[2];
@@ -815,17 +989,75 @@ static int control(sh_video_t *sh, int cmd, void *arg, ...)
     }
     case VDCTRL_RESYNC_STREAM:
         avcodec_flush_buffers(avctx);
+        // no frames are left in the decoder to match these
+        sh->num_buffered_pts = 0;
+        ctx->draining = false;
+        while (ctx->num_held)
+            drop_held_packet(ctx);
+        if (ctx->lowres != avctx->lowres)
+            reopen_lowres(sh);
         return CONTROL_TRUE;
     case VDCTRL_QUERY_UNSEEN_FRAMES:;
         int delay = avctx->has_b_frames;
         if (avctx->active_thread_type & FF_THREAD_FRAME)
             delay += avctx->thread_count - 1;
-        return delay + 10;
+        return delay + ctx->num_held + 10;
     case VDCTRL_RESET_ASPECT:
         if (ctx->vo_initialized)
             ctx->vo_initialized = false;
         init_vo(sh, avctx->pix_fmt);
         return true;
+    case VDCTRL_QUERY_DECODE_THREAD:
+        // hardware decoding needs the VO, which is not thread-safe
+        return avctx->codec->capabilities & (CODEC_CAP_HWACCEL
+                                             | CODEC_CAP_HWACCEL_VDPAU) ?
+               CONTROL_FALSE : CONTROL_TRUE;
+    case VDCTRL_START_DECODE_THREAD:
+        /* Our get_buffer and draw_horiz_band callbacks are not safe to call
+         * from the decoding thread either. release_buffer() still handles
+         * any direct rendering buffers the decoder holds. */
+        if (ctx->do_dr1 && !ctx->ip_count && !ctx->b_count
+            && ctx->pool_ok && sh->opts->lavc_param.pool) {
+            ctx->use_pool = 1;
+            avctx->get_buffer = pool_get_buffer;
+            avctx->release_buffer = pool_release_buffer;
+            avctx->reget_buffer = avcodec_default_reget_buffer;
+        } else if (ctx->do_dr1) {
+            avctx->get_buffer = avcodec_default_get_buffer;
+            avctx->reget_buffer = avcodec_default_reget_buffer;
+        }
+        ctx->do_dr1 = false;
+        ctx->do_slices = false;
+        avctx->draw_horiz_band = NULL;
+        return CONTROL_TRUE;
+    case VDCTRL_SET_DISPLAY_SIZE: {
+        if (!ctx->auto_lowres)
+            return CONTROL_FALSE;
+        // the largest reduction for which the video stays at least as big
+        // as it is shown
+        int *size = arg;
+        int lowres = 0;
+        int max_lowres = FFMIN(avctx->codec->max_lowres, 3);
+        while (lowres < max_lowres
+               && avctx->coded_width >> (lowres + 1) >= size[0]
+               && avctx->coded_height >> (lowres + 1) >= size[1])
+            lowres++;
+        ctx->lowres = lowres;
+        return CONTROL_TRUE;
+    }
+    case VDCTRL_SET_DEGRADE: {
+        // 1: no deblocking of non-reference frames
+        // 2: also skip decoding non-reference frames
+        // 3: no deblocking at all
+        static const enum AVDiscard loop_filter[] = {
+            AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_NONREF,
+            AVDISCARD_ALL,
+        };
+        ctx->degrade = av_clip(*(int *)arg, 0, 3);
+        avctx->skip_loop_filter = FFMAX(ctx->skip_loop_filter,
+                                        loop_filter[ctx->degrade]);
+        return CONTROL_TRUE;
+    }
     }
     return CONTROL_UNKNOWN;
 }
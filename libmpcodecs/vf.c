@@ -334,7 +334,7 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
     case MP_IMGTYPE_NUMBERED:
         if (number == -1) {
             int i;
-            for (i = 0; i < NUM_NUMBERED_MPI; i++)
+            for (i = 0; i < vf->imgctx.num_numbered_images; i++)
                 if (!vf->imgctx.numbered_images[i] ||
                         !vf->imgctx.numbered_images[i]->usage_count)
                     break;
@@ -342,6 +342,16 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
         }
         if (number < 0 || number >= NUM_NUMBERED_MPI)
             return NULL;
+        if (number >= vf->imgctx.num_numbered_images) {
+            // e.g. frame threads keep more references than seen so far
+            int num = number + 1;
+            vf->imgctx.numbered_images =
+                realloc(vf->imgctx.numbered_images,
+                        num * sizeof(*vf->imgctx.numbered_images));
+            for (int i = vf->imgctx.num_numbered_images; i < num; i++)
+                vf->imgctx.numbered_images[i] = NULL;
+            vf->imgctx.num_numbered_images = num;
+        }
         if (!vf->imgctx.numbered_images[number])
             vf->imgctx.numbered_images[number] = new_mp_image(w2, h);
         mpi = vf->imgctx.numbered_images[number];
@@ -364,7 +374,7 @@ mp_image_t *vf_get_image(vf_instance_t *vf, unsigned int outfmt,
             if (mpi->flags & MP_IMGFLAG_ALLOCATED) {
                 if (mpi->width < w2 || mpi->height < h) {
                     // need to re-allocate buffer memory:
-                    av_free(mpi->planes[0]);
+                    mp_image_set_buffer(mpi, NULL);
                     mpi->flags &= ~MP_IMGFLAG_ALLOCATED;
                     mp_msg(MSGT_VFILTER, MSGL_V,
                            "vf.c: have to REALLOCATE buffer memory :(\n");
@@ -830,8 +840,9 @@ void vf_uninit_filter(vf_instance_t *vf)
     free_mp_image(vf->imgctx.static_images[1]);
     free_mp_image(vf->imgctx.temp_images[0]);
     free_mp_image(vf->imgctx.export_images[0]);
-    for (int i = 0; i < NUM_NUMBERED_MPI; i++)
+    for (int i = 0; i < vf->imgctx.num_numbered_images; i++)
         free_mp_image(vf->imgctx.numbered_images[i]);
+    free(vf->imgctx.numbered_images);
     free(vf);
 }
 
@@ -40,13 +40,14 @@ typedef struct vf_info {
     const void *opts;
 } vf_info_t;
 
-#define NUM_NUMBERED_MPI 50
+#define NUM_NUMBERED_MPI 1024 // upper limit, the array grows as needed
 
 struct vf_image_context {
     mp_image_t *static_images[2];
     mp_image_t *temp_images[1];
     mp_image_t *export_images[1];
-    mp_image_t *numbered_images[NUM_NUMBERED_MPI];
+    mp_image_t **numbered_images;
+    int num_numbered_images;
     int static_idx;
 };
 
@@ -368,6 +368,11 @@ static int put_image(struct vf_instance *vf, mp_image_t *mpi, double pts)
             ? vf->priv->renderer_vsfilter : vf->priv->renderer_realaspect;
     if (sub_visibility && renderer && osd->ass_track
             && (pts != MP_NOPTS_VALUE)) {
+        if (osd->ass_fonts_changed) {
+            mp_ass_configure_fonts(vf->priv->renderer_realaspect);
+            mp_ass_configure_fonts(vf->priv->renderer_vsfilter);
+            osd->ass_fonts_changed = false;
+        }
         if (osd->ass_force_reload) {
             mp_ass_reload_options(vf->priv->renderer_realaspect, vf->opts);
             mp_ass_reload_options(vf->priv->renderer_vsfilter, vf->opts);
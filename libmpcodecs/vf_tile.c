@@ -81,6 +81,8 @@ struct vf_priv_s {
     /* Work data */
     int  frame_cur;
     double start_pts;
+    /* The composition being filled */
+    mp_image_t *dmpi;
 };
 
 
@@ -148,8 +150,12 @@ static int put_image(struct vf_instance *vf, mp_image_t *mpi, double pts)
 //        /* First frame, delete the background */
 //
 //    }
-    if (t == 0)
+    if (t == 0) {
         priv->start_pts = pts;
+        /* Don't show old data around and between the tiles */
+        vf_mpi_clear(dmpi, 0, 0, xw, yh);
+    }
+    priv->dmpi = dmpi;
 
     /* Position of image */
     xi = priv->start + (mpi->w + priv->delta) * (t % priv->xtile);
@@ -186,6 +192,7 @@ static int put_image(struct vf_instance *vf, mp_image_t *mpi, double pts)
         /* Display the composition */
         dmpi->width  = xw;
         dmpi->height = yh;
+        priv->dmpi = NULL;
         return vf_next_put_image(vf, dmpi, priv->start_pts);
     }
     else {
@@ -194,6 +201,20 @@ static int put_image(struct vf_instance *vf, mp_image_t *mpi, double pts)
     }
 }
 
+static int control(struct vf_instance *vf, int request, void *data)
+{
+    struct vf_priv_s *priv = vf->priv;
+
+    /* Display an incomplete composition, e.g. at the end of the file */
+    if (request == VFCTRL_FLUSH_FRAMES && priv->dmpi) {
+        mp_image_t *dmpi = priv->dmpi;
+        priv->dmpi = NULL;
+        priv->frame_cur = 0;
+        vf_next_put_image(vf, dmpi, priv->start_pts);
+    }
+    return vf_next_control(vf, request, data);
+}
+
 static void uninit(struct vf_instance *vf)
 {
     /* free local data */
@@ -278,6 +299,7 @@ static int vf_open(vf_instance_t *vf, char *args)
     vf->put_image    = put_image;
     vf->query_format = query_format;
     vf->config       = config;
+    vf->control      = control;
     vf->uninit       = uninit;
     vf->default_reqs = VFCAP_ACCEPT_STRIDE;
     /* Private data */
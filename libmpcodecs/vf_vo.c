@@ -177,6 +177,11 @@ static int control(struct vf_instance *vf, int request, void *data)
                 ass_set_aspect_ratio(renderer, scale, 1);
             }
 
+            if (osd->ass_fonts_changed) {
+                mp_ass_configure_fonts(vf->priv->renderer_realaspect);
+                mp_ass_configure_fonts(vf->priv->renderer_vsfilter);
+                osd->ass_fonts_changed = false;
+            }
             if (osd->ass_force_reload) {
                 mp_ass_reload_options(vf->priv->renderer_realaspect, vf->opts);
                 mp_ass_reload_options(vf->priv->renderer_vsfilter, vf->opts);
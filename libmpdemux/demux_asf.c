@@ -82,9 +82,9 @@ static void asf_descrambling(unsigned char **src,unsigned len, struct asf_priv*
 	  }
 	s2+=asf->scrambling_h*asf->scrambling_w*asf->scrambling_b;
   }
-  //if(i<len) fast_memcpy(dst+i,src+i,len-i);
-  free(*src);
-  *src = dst;
+  // the packet buffer may come from the packet pool, copy back into it
+  fast_memcpy(*src,dst,i);
+  free(dst);
 }
 
 /*****************************************************************
@@ -101,11 +101,11 @@ static void init_priv (struct asf_priv* asf){
 static void demux_asf_append_to_packet(demux_packet_t* dp,unsigned char *data,int len,int offs)
 {
   if(dp->len!=offs && offs!=-1) mp_msg(MSGT_DEMUX,MSGL_V,"warning! fragment.len=%d BUT next fragment offset=%d  \n",dp->len,offs);
-  dp->buffer=realloc(dp->buffer,dp->len+len+MP_INPUT_BUFFER_PADDING_SIZE);
-  fast_memcpy(dp->buffer+dp->len,data,len);
-  memset(dp->buffer+dp->len+len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
-  mp_dbg(MSGT_DEMUX,MSGL_DBG4,"data appended! %d+%d\n",dp->len,len);
-  dp->len+=len;
+  int oldlen=dp->len;
+  resize_demux_packet(dp,dp->len+len);
+  fast_memcpy(dp->buffer+oldlen,data,len);
+  memset(dp->buffer+dp->len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+  mp_dbg(MSGT_DEMUX,MSGL_DBG4,"data appended! %d+%d\n",oldlen,len);
 }
 
 static int demux_asf_read_packet(demuxer_t *demux,unsigned char *data,int len,int id,int seq,uint64_t time,unsigned short dur,int offs,int keyframe){
@@ -40,9 +40,23 @@
 
 #define HDR_SIZE 4
 
+//! every how many MP3 frames a position is stored in the seek index
+#define MP3_INDEX_INTERVAL 64
+
 typedef struct da_priv {
   int frmt;
   double next_pts;
+  // MP3 only
+  int64_t frame;      // number of the frame at the current stream position
+  int frame_exact;    // frame was counted from movi_start and can be trusted
+  off_t *index;       // index[i] is the position of frame i*MP3_INDEX_INTERVAL
+  int num_index;
+  struct mp3_toc_entry {
+    double time;
+    off_t pos;
+  } *toc;             // coarse seek table from a Xing/Info or VBRI header
+  int num_toc;
+  double duration;    // from the frame count in the VBR header, 0 if unknown
 } da_priv_t;
 
 //! rather arbitrary value for maximum length of wav-format headers
@@ -257,6 +271,96 @@ get_flac_metadata (demuxer_t* demuxer)
 }
 #endif
 
+/**
+ * \brief read the Xing/Info or VBRI header that encoders put into the first
+ * MP3 frame and build a coarse time -> position table from it
+ */
+static void parse_mp3_vbr_header(demuxer_t *demuxer, da_priv_t *priv,
+                                 sh_audio_t *sh) {
+  stream_t *s = demuxer->stream;
+  unsigned char buf[4096];
+  unsigned char *p, *end;
+  double frame_time = sh->audio.dwScale / (double)sh->audio.dwRate;
+  unsigned frames = 0, bytes = 0;
+  int len, i;
+
+  stream_seek(s, demuxer->movi_start);
+  if (stream_read(s, buf, 4) != 4)
+    return;
+  len = mp_decode_mp3_header(buf);
+  if (len <= 4)
+    return;
+  if (len > (int)sizeof(buf))
+    len = sizeof(buf);
+  len = 4 + stream_read(s, buf + 4, len - 4);
+  end = buf + len;
+
+  // the Xing tag follows the side info, whose size depends on the
+  // MPEG version and the channel mode
+  if (((buf[1] >> 3) & 3) == 3)
+    p = buf + 4 + ((buf[3] >> 6) == 3 ? 17 : 32);
+  else
+    p = buf + 4 + ((buf[3] >> 6) == 3 ? 9 : 17);
+  if (p + 8 <= end && (!memcmp(p, "Xing", 4) || !memcmp(p, "Info", 4))) {
+    unsigned flags = AV_RB32(p + 4);
+    p += 8;
+    if ((flags & 1) && p + 4 <= end) {
+      frames = AV_RB32(p);
+      p += 4;
+    }
+    if ((flags & 2) && p + 4 <= end) {
+      bytes = AV_RB32(p);
+      p += 4;
+    }
+    if ((flags & 4) && frames && bytes && p + 100 <= end) {
+      // 100 entries, entry i is the position of i percent of the
+      // duration in units of 1/256 of the file size
+      priv->toc = malloc(101 * sizeof(*priv->toc));
+      for (i = 0; i < 100; i++) {
+        priv->toc[i].time = frames * frame_time * i / 100;
+        priv->toc[i].pos = demuxer->movi_start + (int64_t)p[i] * bytes / 256;
+      }
+      priv->toc[100].time = frames * frame_time;
+      priv->toc[100].pos = demuxer->movi_start + bytes;
+      priv->num_toc = 101;
+    }
+    mp_msg(MSGT_DEMUX, MSGL_V, "demux_audio: Xing header, %u frames, %u bytes%s\n",
+           frames, bytes, priv->num_toc ? ", TOC" : "");
+  } else if (buf + 4 + 32 + 26 <= end && !memcmp(buf + 4 + 32, "VBRI", 4)) {
+    int entries, scale, entry_size, frames_per_entry;
+    off_t pos = demuxer->movi_start;
+    p = buf + 4 + 32;
+    bytes = AV_RB32(p + 10);
+    frames = AV_RB32(p + 14);
+    entries = AV_RB16(p + 18);
+    scale = AV_RB16(p + 20);
+    entry_size = AV_RB16(p + 22);
+    frames_per_entry = AV_RB16(p + 24);
+    p += 26;
+    if (entries && entry_size >= 1 && entry_size <= 4 &&
+        p + entries * entry_size <= end) {
+      // each entry is the size in bytes of the next frames_per_entry frames
+      priv->toc = malloc((entries + 1) * sizeof(*priv->toc));
+      priv->toc[0].time = 0;
+      priv->toc[0].pos = pos;
+      for (i = 0; i < entries; i++) {
+        unsigned size = 0;
+        int j;
+        for (j = 0; j < entry_size; j++)
+          size = size << 8 | *p++;
+        pos += (int64_t)size * scale;
+        priv->toc[i + 1].time = (i + 1) * frames_per_entry * frame_time;
+        priv->toc[i + 1].pos = pos;
+      }
+      priv->num_toc = entries + 1;
+    }
+    mp_msg(MSGT_DEMUX, MSGL_V, "demux_audio: VBRI header, %u frames, %u bytes, %d TOC entries\n",
+           frames, bytes, priv->num_toc);
+  }
+  if (frames)
+    priv->duration = frames * frame_time;
+}
+
 static int demux_audio_open(demuxer_t* demuxer) {
   stream_t *s;
   sh_audio_t* sh_audio;
@@ -325,6 +429,10 @@ static int demux_audio_open(demuxer_t* demuxer) {
 
   sh_audio = new_sh_audio(demuxer,0);
 
+  priv = calloc(1, sizeof(da_priv_t));
+  priv->frmt = frmt;
+  demuxer->priv = priv;
+
   switch(frmt) {
   case MP3:
     sh_audio->format = (mp3_found->mpa_layer < 3 ? 0x50 : 0x55);
@@ -378,6 +486,7 @@ static int demux_audio_open(demuxer_t* demuxer) {
 	g = stream_read_char(s);
 	demux_info_add(demuxer,"Genre",genres[g]);
       }
+      parse_mp3_vbr_header(demuxer, priv, sh_audio);
     }
     break;
   case WAV: {
@@ -499,10 +608,6 @@ static int demux_audio_open(demuxer_t* demuxer) {
 	    break;
   }
 
-  priv = malloc(sizeof(da_priv_t));
-  priv->frmt = frmt;
-  priv->next_pts = 0;
-  demuxer->priv = priv;
   demuxer->audio->id = 0;
   demuxer->audio->sh = sh_audio;
   sh_audio->ds = demuxer->audio;
@@ -523,6 +628,8 @@ static int demux_audio_open(demuxer_t* demuxer) {
       }
     }
   }
+  // frames are only counted from the very first one
+  priv->frame_exact = stream_tell(s) == demuxer->movi_start;
 
   mp_msg(MSGT_DEMUX,MSGL_V,"demux_audio: audio data 0x%X - 0x%X  \n",(int)demuxer->movi_start,(int)demuxer->movi_end);
 
@@ -530,6 +637,45 @@ static int demux_audio_open(demuxer_t* demuxer) {
 }
 
 
+/**
+ * \brief skip to the next possible MP3 frame header
+ * Searches the buffered data for sync bytes with memchr instead of
+ * trying to decode a header at every byte position.
+ * \return 0 at EOF
+ */
+static int mp3_resync(stream_t *s) {
+  unsigned char *buf;
+  while ((buf = stream_peek(s, HDR_SIZE))) {
+    unsigned char *end = buf + s->buf_len - s->buf_pos - (HDR_SIZE - 1);
+    unsigned char *p = buf;
+    while ((p = memchr(p, 0xff, end - p))) {
+      if ((p[1] & 0xe0) == 0xe0 && mp_decode_mp3_header(p) > 0) {
+        s->buf_pos += p - buf;
+        return 1;
+      }
+      p++;
+    }
+    // keep the last bytes, they may start a header
+    s->buf_pos += end - buf;
+  }
+  return 0;
+}
+
+/**
+ * \brief account for the MP3 frame starting at pos
+ * Adds the frame to the seek index if it is the next one to be indexed.
+ */
+static void mp3_count_frame(da_priv_t *priv, off_t pos) {
+  if (priv->frame_exact &&
+      priv->frame == (int64_t)priv->num_index * MP3_INDEX_INTERVAL) {
+    if (!(priv->num_index & 1023))
+      priv->index = realloc(priv->index,
+                            (priv->num_index + 1024) * sizeof(*priv->index));
+    priv->index[priv->num_index++] = pos;
+  }
+  priv->frame++;
+}
+
 static int demux_audio_fill_buffer(demuxer_t *demux, demux_stream_t *ds) {
   int l;
   demux_packet_t* dp;
@@ -553,6 +699,7 @@ static int demux_audio_fill_buffer(demuxer_t *demux, demux_stream_t *ds) {
 	if (demux->movi_end && stream_tell(s) >= demux->movi_end)
 	  return 0; // might be ID3 tag, i.e. EOF
 	stream_skip(s,-3);
+	mp3_resync(s);
       } else {
 	dp = new_demux_packet(l);
 	memcpy(dp->buffer,hdr,4);
@@ -561,6 +708,7 @@ static int demux_audio_fill_buffer(demuxer_t *demux, demux_stream_t *ds) {
 	  free_demux_packet(dp);
 	  return 0;
 	}
+	mp3_count_frame(priv, stream_tell(s) - l);
 	priv->next_pts += sh_audio->audio.dwScale/(double)sh_audio->samplerate;
 	break;
       }
@@ -601,22 +749,71 @@ static int demux_audio_fill_buffer(demuxer_t *demux, demux_stream_t *ds) {
 
 static void high_res_mp3_seek(demuxer_t *demuxer,float time) {
   uint8_t hdr[4];
-  int len,nf;
+  int len;
+  int64_t target, start;
+  stream_t *s = demuxer->stream;
   da_priv_t* priv = demuxer->priv;
   sh_audio_t* sh = (sh_audio_t*)demuxer->audio->sh;
 
-  nf = time*sh->samplerate/sh->audio.dwScale;
-  while(nf > 0) {
-    stream_read(demuxer->stream,hdr,4);
+  target = FFMAX(time, 0) * sh->samplerate / sh->audio.dwScale;
+  // Start from the last indexed frame before the target, unless the
+  // current position is closer.
+  if (priv->num_index) {
+    int i = FFMIN(target / MP3_INDEX_INTERVAL, priv->num_index - 1);
+    start = (int64_t)i * MP3_INDEX_INTERVAL;
+    if (!priv->frame_exact || priv->frame > target || priv->frame < start) {
+      stream_seek(s, priv->index[i]);
+      priv->frame = start;
+      priv->frame_exact = 1;
+    }
+  } else if (!priv->frame_exact || priv->frame > target) {
+    stream_seek(s, demuxer->movi_start);
+    priv->frame = 0;
+    priv->frame_exact = 1;
+  }
+  while (priv->frame < target) {
+    if (stream_read(s,hdr,4) != 4)
+      break;
     len = mp_decode_mp3_header(hdr);
     if(len < 0) {
-      stream_skip(demuxer->stream,-3);
+      stream_skip(s,-3);
+      if (!mp3_resync(s))
+        break;
       continue;
     }
-    stream_skip(demuxer->stream,len-4);
-    priv->next_pts += sh->audio.dwScale/(double)sh->samplerate;
-    nf--;
+    mp3_count_frame(priv, stream_tell(s) - 4);
+    stream_skip(s,len-4);
+  }
+  priv->next_pts = priv->frame * sh->audio.dwScale / (double)sh->samplerate;
+}
+
+/**
+ * \brief seek to the approximate position of time using the VBR header TOC
+ */
+static void toc_mp3_seek(demuxer_t *demuxer, double time) {
+  da_priv_t* priv = demuxer->priv;
+  struct mp3_toc_entry *toc = priv->toc;
+  int lo = 0, hi = priv->num_toc - 1;
+  off_t pos;
+
+  time = FFMIN(FFMAX(time, 0), toc[hi].time);
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (toc[mid].time <= time)
+      lo = mid;
+    else
+      hi = mid;
   }
+  pos = toc[lo].pos;
+  if (toc[hi].time > toc[lo].time)
+    pos += (toc[hi].pos - toc[lo].pos) * (time - toc[lo].time) /
+           (toc[hi].time - toc[lo].time);
+  if (demuxer->movi_end && pos >= demuxer->movi_end)
+    pos = demuxer->movi_end;
+  stream_seek(demuxer->stream, pos);
+  priv->next_pts = time;
+  priv->frame_exact = pos == demuxer->movi_start;
+  priv->frame = 0;
 }
 
 static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_delay,int flags){
@@ -624,7 +821,6 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
   sh_audio_t* sh_audio;
   stream_t* s;
   int64_t base,pos;
-  float len;
   da_priv_t* priv;
 
   if(!(sh_audio = demuxer->audio->sh))
@@ -632,16 +828,21 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
   s = demuxer->stream;
   priv = demuxer->priv;
 
-  if(priv->frmt == MP3 && opts->hr_mp3_seek && !(flags & SEEK_FACTOR)) {
-    len = (flags & SEEK_ABSOLUTE) ? rel_seek_secs - priv->next_pts : rel_seek_secs;
-    if(len < 0) {
-      stream_seek(s,demuxer->movi_start);
-      len = priv->next_pts + len;
-      priv->next_pts = 0;
+  if(priv->frmt == MP3 && (!(flags & SEEK_FACTOR) || priv->duration > 0)) {
+    double time;
+    if (flags & SEEK_FACTOR)
+      time = rel_seek_secs * priv->duration;
+    else
+      time = (flags & SEEK_ABSOLUTE) ? rel_seek_secs
+                                     : priv->next_pts + rel_seek_secs;
+    if (opts->hr_mp3_seek) {
+      high_res_mp3_seek(demuxer, time);
+      return;
+    }
+    if (priv->num_toc) {
+      toc_mp3_seek(demuxer, time);
+      return;
     }
-    if(len > 0)
-      high_res_mp3_seek(demuxer,len);
-    return;
   }
 
   base = flags&SEEK_ABSOLUTE ? demuxer->movi_start : stream_tell(s);
@@ -658,6 +859,10 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
   priv->next_pts = (pos-demuxer->movi_start)/(double)sh_audio->i_bps;
 
   switch(priv->frmt) {
+  case MP3:
+    priv->frame_exact = pos == demuxer->movi_start;
+    priv->frame = 0;
+    break;
   case WAV:
     pos -= (pos - demuxer->movi_start) %
             (sh_audio->wf->nBlockAlign ? sh_audio->wf->nBlockAlign :
@@ -671,6 +876,10 @@ static void demux_audio_seek(demuxer_t *demuxer,float rel_seek_secs,float audio_
 static void demux_close_audio(demuxer_t* demuxer) {
   da_priv_t* priv = demuxer->priv;
 
+  if (!priv)
+    return;
+  free(priv->index);
+  free(priv->toc);
   free(priv);
 }
 
@@ -681,6 +890,10 @@ static int demux_audio_control(demuxer_t *demuxer,int cmd, void *arg){
 
     switch(cmd) {
 	case DEMUXER_CTRL_GET_TIME_LENGTH:
+	    if (priv->duration > 0) {
+		*((double *)arg) = priv->duration;
+		return DEMUXER_CTRL_OK;
+	    }
 	    if (audio_length<=0) return DEMUXER_CTRL_DONTKNOW;
 	    *((double *)arg)=(double)audio_length;
 	    return DEMUXER_CTRL_GUESS;
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <stdbool.h>
 
 #include "osdep/io.h"
 
@@ -34,6 +35,196 @@
 #include "stheader.h"
 #include "mf.h"
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/// read a whole file into a new packet, NULL on error
+static demux_packet_t *read_file(const char *name)
+{
+  demux_packet_t *dp;
+  long file_size;
+  FILE *f = fopen(name, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  file_size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (file_size < 0) {
+    fclose(f);
+    return NULL;
+  }
+  dp = new_demux_packet(file_size);
+  if (!fread(dp->buffer, file_size, 1, f)) {
+    free_demux_packet(dp);
+    dp = NULL;
+  }
+  fclose(f);
+  return dp;
+}
+
+#ifdef HAVE_PTHREADS
+/* Files after the current one are read by a pool of threads, so that the
+ * latency of opening them overlaps. Frame n goes to slots[n % window]. */
+struct mf_prefetch {
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;     // signaled to the threads: work or quit
+  pthread_cond_t done;       // signaled to the demuxer: a file was read
+  pthread_t *threads;
+  int num_threads;
+  mf_t *mf;
+  int window;
+  struct mf_slot {
+    int frame;
+    bool ready;
+    demux_packet_t *dp;      // NULL if the file could not be read
+  } *slots;
+  int next_read;             // frame the demuxer wants next
+  int next_issue;            // frame the next free thread will read
+  int generation;            // incremented on seek, stale reads are dropped
+  bool quit;
+};
+
+static void *prefetch_thread(void *arg)
+{
+  struct mf_prefetch *pf = arg;
+  pthread_mutex_lock(&pf->lock);
+  while (!pf->quit) {
+    int frame = pf->next_issue;
+    int generation = pf->generation;
+    struct mf_slot *slot = &pf->slots[frame % pf->window];
+    demux_packet_t *dp;
+    if (frame >= pf->mf->nr_of_files || frame >= pf->next_read + pf->window) {
+      pthread_cond_wait(&pf->wakeup, &pf->lock);
+      continue;
+    }
+    pf->next_issue++;
+    slot->frame = frame;
+    slot->ready = false;
+    pthread_mutex_unlock(&pf->lock);
+    dp = read_file(pf->mf->names[frame]);
+    pthread_mutex_lock(&pf->lock);
+    if (generation == pf->generation) {
+      slot->dp = dp;
+      slot->ready = true;
+      pthread_cond_broadcast(&pf->done);
+    } else if (dp)
+      free_demux_packet(dp);
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return NULL;
+}
+
+/// drop all files read ahead, lock must be held
+static void prefetch_flush(struct mf_prefetch *pf)
+{
+  int i;
+  for (i = 0; i < pf->window; i++) {
+    if (pf->slots[i].ready && pf->slots[i].dp)
+      free_demux_packet(pf->slots[i].dp);
+    pf->slots[i].dp = NULL;
+    pf->slots[i].ready = false;
+    pf->slots[i].frame = -1;
+  }
+  pf->generation++;
+}
+
+static void prefetch_seek(mf_t *mf, int frame)
+{
+  struct mf_prefetch *pf = mf->prefetch;
+  if (!pf)
+    return;
+  pthread_mutex_lock(&pf->lock);
+  prefetch_flush(pf);
+  pf->next_read = pf->next_issue = frame;
+  pthread_cond_broadcast(&pf->wakeup);
+  pthread_mutex_unlock(&pf->lock);
+}
+
+static demux_packet_t *prefetch_read(mf_t *mf, int frame)
+{
+  struct mf_prefetch *pf = mf->prefetch;
+  struct mf_slot *slot = &pf->slots[frame % pf->window];
+  demux_packet_t *dp;
+  pthread_mutex_lock(&pf->lock);
+  if (frame != pf->next_read) {
+    // not the frame read ahead for, restart from it
+    prefetch_flush(pf);
+    pf->next_read = pf->next_issue = frame;
+    pthread_cond_broadcast(&pf->wakeup);
+  }
+  while (!(slot->ready && slot->frame == frame))
+    pthread_cond_wait(&pf->done, &pf->lock);
+  dp = slot->dp;
+  slot->dp = NULL;
+  slot->ready = false;
+  pf->next_read = frame + 1;
+  pthread_cond_broadcast(&pf->wakeup);
+  pthread_mutex_unlock(&pf->lock);
+  return dp;
+}
+
+static void prefetch_start(mf_t *mf)
+{
+  struct mf_prefetch *pf;
+  int i;
+  if (mf_prefetch <= 0 || mf->nr_of_files <= 1)
+    return;
+  pf = talloc_zero(NULL, struct mf_prefetch);
+  pf->mf = mf;
+  pf->window = mf_prefetch;
+  pf->slots = talloc_array(pf, struct mf_slot, pf->window);
+  pf->threads = talloc_array(pf, pthread_t, FFMIN(mf_threads, pf->window));
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->wakeup, NULL);
+  pthread_cond_init(&pf->done, NULL);
+  pthread_mutex_lock(&pf->lock);
+  prefetch_flush(pf);
+  pf->next_read = pf->next_issue = mf->curr_frame;
+  pthread_mutex_unlock(&pf->lock);
+  for (i = 0; i < FFMIN(mf_threads, pf->window); i++) {
+    if (pthread_create(&pf->threads[i], NULL, prefetch_thread, pf))
+      break;
+    pf->num_threads++;
+  }
+  if (!pf->num_threads) {
+    pthread_cond_destroy(&pf->done);
+    pthread_cond_destroy(&pf->wakeup);
+    pthread_mutex_destroy(&pf->lock);
+    talloc_free(pf);
+    return;
+  }
+  mf->prefetch = pf;
+  mp_msg(MSGT_DEMUX, MSGL_V, "[demux_mf] reading %d files ahead with %d threads\n",
+         pf->window, pf->num_threads);
+}
+
+static void prefetch_stop(mf_t *mf)
+{
+  struct mf_prefetch *pf = mf->prefetch;
+  int i;
+  if (!pf)
+    return;
+  pthread_mutex_lock(&pf->lock);
+  pf->quit = true;
+  pthread_cond_broadcast(&pf->wakeup);
+  pthread_mutex_unlock(&pf->lock);
+  for (i = 0; i < pf->num_threads; i++)
+    pthread_join(pf->threads[i], NULL);
+  prefetch_flush(pf);
+  pthread_cond_destroy(&pf->done);
+  pthread_cond_destroy(&pf->wakeup);
+  pthread_mutex_destroy(&pf->lock);
+  talloc_free(pf);
+  mf->prefetch = NULL;
+}
+#else
+static void prefetch_start(mf_t *mf) {}
+static void prefetch_stop(mf_t *mf) {}
+static void prefetch_seek(mf_t *mf, int frame) {}
+static demux_packet_t *prefetch_read(mf_t *mf, int frame) { return NULL; }
+#endif
+
 static void demux_seek_mf(demuxer_t *demuxer,float rel_seek_secs,float audio_delay,int flags){
   mf_t * mf = (mf_t *)demuxer->priv;
   sh_video_t   * sh_video = demuxer->video->sh;
@@ -44,6 +235,7 @@ static void demux_seek_mf(demuxer_t *demuxer,float rel_seek_secs,float audio_del
   if ( newpos < 0 ) newpos=0;
   if( newpos >= mf->nr_of_files) newpos=mf->nr_of_files - 1;
   demuxer->filepos=mf->curr_frame=newpos;
+  prefetch_seek(mf, newpos);
 }
 
 // return value:
@@ -51,26 +243,22 @@ static void demux_seek_mf(demuxer_t *demuxer,float rel_seek_secs,float audio_del
 //     1 = successfully read a packet
 static int demux_mf_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds){
   mf_t         * mf;
-  FILE         * f;
+  sh_video_t   * sh_video = demuxer->video->sh;
+  demux_packet_t * dp;
 
   mf=(mf_t*)demuxer->priv;
   if ( mf->curr_frame >= mf->nr_of_files ) return 0;
 
-  if ( !( f=fopen( mf->names[mf->curr_frame],"rb" ) ) ) return 0;
-  {
-   sh_video_t     * sh_video = demuxer->video->sh;
-   fseek(f, 0, SEEK_END);
-   long file_size = ftell(f);
-   fseek(f, 0, SEEK_SET);
-   demux_packet_t * dp = new_demux_packet( file_size );
-   if ( !fread( dp->buffer,file_size,1,f ) ) return 0;
-   dp->pts=mf->curr_frame / sh_video->fps;
-   dp->pos=mf->curr_frame;
-   dp->flags=0;
-   // append packet to DS stream:
-   ds_add_packet( demuxer->video,dp );
-  }
-  fclose( f );
+  if (mf->prefetch)
+    dp = prefetch_read(mf, mf->curr_frame);
+  else
+    dp = read_file(mf->names[mf->curr_frame]);
+  if (!dp) return 0;
+  dp->pts=mf->curr_frame / sh_video->fps;
+  dp->pos=mf->curr_frame;
+  dp->flags=0;
+  // append packet to DS stream:
+  ds_add_packet( demuxer->video,dp );
 
   demuxer->filepos=mf->curr_frame++;
   return 1;
@@ -175,12 +363,15 @@ static demuxer_t* demux_open_mf(demuxer_t* demuxer){
 
   demuxer->priv=(void*)mf;
 
+  prefetch_start(mf);
+
   return demuxer;
 }
 
 static void demux_close_mf(demuxer_t* demuxer) {
   mf_t *mf = demuxer->priv;
 
+  prefetch_stop(mf);
   free(mf);
 }
 
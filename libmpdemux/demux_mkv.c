@@ -26,6 +26,9 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <libavutil/common.h>
 #include <libavutil/lzo.h>
@@ -38,6 +41,10 @@
 #include <zlib.h>
 #endif
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "talloc.h"
 #include "options.h"
 #include "bstr.h"
@@ -49,6 +56,7 @@
 #include "demux_real.h"
 
 #include "mp_msg.h"
+#include "path.h"
 
 #include "sub/sub.h"
 
@@ -163,6 +171,15 @@ typedef struct mkv_demuxer {
     uint64_t cluster_size;
     uint64_t blockgroup_size;
 
+    // Part of the current cluster read into memory, see cluster_peek().
+    // The stream is positioned at chunk_pos + chunk_len.
+    uint8_t *chunk;          // points into chunk_buf or the stream mapping
+    uint8_t *chunk_buf;
+    size_t chunk_buf_size;
+    size_t chunk_len, chunk_offset;
+    off_t chunk_pos;         // file position of chunk[0]
+    bool chunk_mapped;
+
     mkv_index_t *indexes;
     int num_indexes;
 
@@ -173,12 +190,20 @@ typedef struct mkv_demuxer {
     bool parsed_tags;
     bool parsed_chapters;
     bool parsed_attachments;
+    off_t deferred_cues;     // positions of elements to parse on first use
+    off_t deferred_tags;
 
     struct cluster_pos {
         uint64_t filepos;
         uint64_t timecode;
     } *cluster_positions;
     int num_cluster_pos;
+    bool index_complete;     // cluster_positions lists all clusters
+    bool index_verified;     // ... and the indexer thread has checked that
+    bool cached_complete;    // index was loaded from the index cache
+    off_t first_cluster;
+    struct mkv_indexer *indexer;
+    bool indexer_started;
 
     uint64_t skip_to_timecode;
     int v_skip_to_keyframe, a_skip_to_keyframe;
@@ -205,6 +230,18 @@ static void *grow_array(void *array, int nelem, size_t elsize)
     return array;
 }
 
+// number of elements to allocate for nelem elements to work with grow_array()
+static int grow_array_size(int nelem)
+{
+    return (nelem + 32) & ~31;
+}
+
+// true if the file has Cues, even if they are not parsed yet
+static bool has_cues(struct mkv_demuxer *mkv_d)
+{
+    return mkv_d->indexes || mkv_d->deferred_cues;
+}
+
 static bool is_parsed_header(struct mkv_demuxer *mkv_d, off_t pos)
 {
     int low = 0;
@@ -244,19 +281,279 @@ static void add_cluster_position(mkv_demuxer_t *mkv_d, uint64_t filepos,
     if (mkv_d->indexes)
         return;
 
-    int n = mkv_d->num_cluster_pos;
-    if (n > 0 && mkv_d->cluster_positions[n-1].filepos >= filepos)
+    // keep the positions sorted, clusters may be found in any order
+    int lo = 0, hi = mkv_d->num_cluster_pos;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (mkv_d->cluster_positions[mid].filepos < filepos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < mkv_d->num_cluster_pos
+        && mkv_d->cluster_positions[lo].filepos == filepos)
         return;
 
     mkv_d->cluster_positions =
         grow_array(mkv_d->cluster_positions, mkv_d->num_cluster_pos,
                    sizeof(*mkv_d->cluster_positions));
-    mkv_d->cluster_positions[mkv_d->num_cluster_pos++] = (struct cluster_pos){
+    memmove(mkv_d->cluster_positions + lo + 1, mkv_d->cluster_positions + lo,
+            (mkv_d->num_cluster_pos - lo) * sizeof(*mkv_d->cluster_positions));
+    mkv_d->cluster_positions[lo] = (struct cluster_pos){
         .filepos = filepos,
         .timecode = timecode,
     };
+    mkv_d->num_cluster_pos++;
+}
+
+/**
+ * \brief read the top level element at the current position and skip it
+ * \param pos set to the position and timecode of the element if it is a cluster
+ * \return 1 for a cluster, 0 for other elements, -1 at the end of the file,
+ *         -2 if the element has an unknown size and can't be skipped
+ */
+static int index_next_element(stream_t *s, uint64_t tc_scale,
+                              struct cluster_pos *pos)
+{
+    uint64_t start = stream_tell(s);
+    uint32_t type = ebml_read_id(s, NULL);
+    uint64_t len = ebml_read_length(s, NULL);
+    uint64_t end = stream_tell(s) + len;
+    int res = 0;
+    if (s->eof)
+        return -1;
+    if (len == EBML_UINT_INVALID)
+        return -2;
+    if (type == MATROSKA_ID_CLUSTER) {
+        while (!s->eof && stream_tell(s) < end) {
+            if (ebml_read_id(s, NULL) == MATROSKA_ID_TIMECODE) {
+                pos->filepos = start;
+                pos->timecode = ebml_read_uint(s, NULL) * tc_scale;
+                res = 1;
+                break;
+            }
+            ebml_read_skip(s, NULL);
+        }
+    }
+    if (s->eof)
+        return res ? res : -1;
+    stream_seek(s, end);
+    return res;
+}
+
+/* Files without Cues are indexed by reading the cluster headers. The index
+ * is built in a background thread while the file plays. Once that thread
+ * has read every cluster header up to the end of the file, the index is
+ * kept in a cache file named after the segment UID, size and mtime of the
+ * file. Partial indexes are never saved. */
+
+#define INDEX_CACHE_MAGIC "MPMKVIDX1"
+
+static char *index_cache_name(struct demuxer *demuxer)
+{
+    struct stat st;
+    stream_t *s = demuxer->stream;
+    if (!demuxer->opts->mkv_index_cache || s->type != STREAMTYPE_FILE
+        || fstat(s->fd, &st) < 0)
+        return NULL;
+    char name[80] = "mkv_index/";
+    for (int i = 0; i < 16; i++)
+        av_strlcatf(name, sizeof(name), "%02x",
+                    demuxer->matroska_data.segment_uid[i]);
+    av_strlcatf(name, sizeof(name), "-%"PRIx64"-%"PRIx64,
+                (uint64_t)st.st_size, (uint64_t)st.st_mtime);
+    return get_path(name);
+}
+
+static void load_index_cache(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    char *name = index_cache_name(demuxer);
+    FILE *fp;
+    char magic[sizeof(INDEX_CACHE_MAGIC)];
+    int32_t num;
+    uint8_t complete;
+    if (!name)
+        return;
+    if (!(fp = fopen(name, "rb"))) {
+        free(name);
+        return;
+    }
+    if (fread(magic, sizeof(magic), 1, fp) != 1
+        || memcmp(magic, INDEX_CACHE_MAGIC, sizeof(magic))
+        || fread(&complete, 1, 1, fp) != 1 || !complete
+        || fread(&num, 4, 1, fp) != 1 || num <= 0 || num > (1 << 24))
+        goto fail;
+    struct cluster_pos *pos = malloc(grow_array_size(num) * sizeof(*pos));
+    if (!pos || fread(pos, sizeof(*pos), num, fp) != num) {
+        free(pos);
+        goto fail;
+    }
+    free(mkv_d->cluster_positions);
+    mkv_d->cluster_positions = pos;
+    mkv_d->num_cluster_pos = num;
+    mkv_d->index_complete = mkv_d->index_verified = true;
+    mkv_d->cached_complete = true;
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Loaded %d cluster positions from %s\n",
+           num, name);
+    fclose(fp);
+    free(name);
+    return;
+ fail:
+    mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Ignoring invalid index cache %s\n",
+           name);
+    fclose(fp);
+    free(name);
 }
 
+static void save_index_cache(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    int32_t num = mkv_d->num_cluster_pos;
+    uint8_t complete = 1;
+    if (has_cues(mkv_d) || !mkv_d->index_verified || mkv_d->cached_complete)
+        return;
+    char *name = index_cache_name(demuxer);
+    if (!name)
+        return;
+    char *dir = get_path("mkv_index");
+    if (dir)
+        mkdir(dir, 0777);
+    free(dir);
+    // write to a temporary file so readers never see a partial index
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", name);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Can't write index cache %s: %s\n",
+               tmp, strerror(errno));
+        goto out;
+    }
+    bool ok = fwrite(INDEX_CACHE_MAGIC, sizeof(INDEX_CACHE_MAGIC), 1, fp) == 1
+              && fwrite(&complete, 1, 1, fp) == 1
+              && fwrite(&num, 4, 1, fp) == 1
+              && fwrite(mkv_d->cluster_positions,
+                        sizeof(*mkv_d->cluster_positions), num, fp) == num;
+    if (fclose(fp) || !ok || rename(tmp, name)) {
+        remove(tmp);
+        goto out;
+    }
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Saved %d cluster positions to %s\n",
+           num, name);
+ out:
+    talloc_free(tmp);
+    free(name);
+}
+
+#ifdef HAVE_PTHREADS
+struct mkv_indexer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    stream_t *stream;        // separate stream on the same file
+    uint64_t tc_scale;
+    struct cluster_pos *positions; // found by the thread, protected by lock
+    int num_positions;
+    int num_merged;          // entries already added to cluster_positions
+    bool done, complete, quit;
+};
+
+static void *indexer_thread(void *arg)
+{
+    struct mkv_indexer *ix = arg;
+    struct cluster_pos pos;
+    int res = 0;
+    while (res >= 0) {
+        pthread_mutex_lock(&ix->lock);
+        bool quit = ix->quit;
+        pthread_mutex_unlock(&ix->lock);
+        if (quit)
+            break;
+        res = index_next_element(ix->stream, ix->tc_scale, &pos);
+        if (res > 0) {
+            pthread_mutex_lock(&ix->lock);
+            ix->positions = grow_array(ix->positions, ix->num_positions,
+                                       sizeof(pos));
+            ix->positions[ix->num_positions++] = pos;
+            pthread_mutex_unlock(&ix->lock);
+        }
+    }
+    pthread_mutex_lock(&ix->lock);
+    ix->done = true;
+    ix->complete = res == -1;
+    pthread_mutex_unlock(&ix->lock);
+    return NULL;
+}
+
+static void start_indexer(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    mkv_d->indexer_started = true;
+    if (has_cues(mkv_d) || mkv_d->index_verified || !demuxer->seekable
+        || !mkv_d->first_cluster || !demuxer->opts->mkv_background_index
+        || demuxer->stream->type != STREAMTYPE_FILE)
+        return;
+    int fformat = 0;
+    stream_t *s = open_stream(demuxer->stream->url, demuxer->opts, &fformat);
+    if (!s)
+        return;
+    // start at the first cluster, so that reaching the end of the file
+    // proves that no cluster is missing from the index
+    stream_seek(s, mkv_d->first_cluster);
+    struct mkv_indexer *ix = talloc_zero(mkv_d, struct mkv_indexer);
+    ix->stream = s;
+    ix->tc_scale = mkv_d->tc_scale;
+    pthread_mutex_init(&ix->lock, NULL);
+    if (pthread_create(&ix->thread, NULL, indexer_thread, ix)) {
+        pthread_mutex_destroy(&ix->lock);
+        free_stream(s);
+        talloc_free(ix);
+        return;
+    }
+    mkv_d->indexer = ix;
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Indexing clusters in the background\n");
+}
+
+/// Add the clusters found by the indexer thread to the index.
+static void merge_indexer(struct mkv_demuxer *mkv_d)
+{
+    struct mkv_indexer *ix = mkv_d->indexer;
+    if (!ix)
+        return;
+    pthread_mutex_lock(&ix->lock);
+    for (; ix->num_merged < ix->num_positions; ix->num_merged++) {
+        struct cluster_pos *pos = &ix->positions[ix->num_merged];
+        add_cluster_position(mkv_d, pos->filepos, pos->timecode);
+    }
+    if (ix->complete)
+        mkv_d->index_complete = mkv_d->index_verified = true;
+    pthread_mutex_unlock(&ix->lock);
+}
+
+static void stop_indexer(struct mkv_demuxer *mkv_d)
+{
+    struct mkv_indexer *ix = mkv_d->indexer;
+    if (!ix)
+        return;
+    pthread_mutex_lock(&ix->lock);
+    ix->quit = true;
+    pthread_mutex_unlock(&ix->lock);
+    pthread_join(ix->thread, NULL);
+    merge_indexer(mkv_d);
+    pthread_mutex_destroy(&ix->lock);
+    free_stream(ix->stream);
+    free(ix->positions);
+    talloc_free(ix);
+    mkv_d->indexer = NULL;
+}
+#else
+static void start_indexer(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    mkv_d->indexer_started = true;
+}
+static void merge_indexer(struct mkv_demuxer *mkv_d) {}
+static void stop_indexer(struct mkv_demuxer *mkv_d) {}
+#endif
+
 
 #define AAC_SYNC_EXTENSION_TYPE 0x02b7
 static int aac_get_sample_rate_index(uint32_t sample_rate)
@@ -426,6 +723,35 @@ static int demux_mkv_read_info(demuxer_t *demuxer)
     return res;
 }
 
+int demux_mkv_read_segment_uid(struct stream *s, unsigned char uid[16])
+{
+    if (ebml_read_id(s, NULL) != EBML_ID_EBML || ebml_read_skip(s, NULL)
+        || ebml_read_id(s, NULL) != MATROSKA_ID_SEGMENT
+        || ebml_read_length(s, NULL) == EBML_UINT_INVALID)
+        return -1;
+    while (!s->eof) {
+        uint32_t id = ebml_read_id(s, NULL);
+        if (id == MATROSKA_ID_CLUSTER || id == EBML_ID_INVALID)
+            break;
+        if (id != MATROSKA_ID_INFO) {
+            if (ebml_read_skip(s, NULL))
+                break;
+            continue;
+        }
+        struct ebml_info info = {};
+        struct ebml_parse_ctx parse_ctx = { .no_error_messages = true };
+        if (ebml_read_element(s, &parse_ctx, &info, &ebml_info_desc) < 0)
+            return -1;
+        // a truncated element can't be trusted
+        int res = s->eof ? -1 : info.n_segment_uid && info.segment_uid.len == 16;
+        if (res > 0)
+            memcpy(uid, info.segment_uid.start, 16);
+        talloc_free(parse_ctx.talloc_ctx);
+        return res;
+    }
+    return -1;
+}
+
 static void parse_trackencodings(struct demuxer *demuxer,
                                  struct mkv_track *track,
                                  struct ebml_content_encodings *encodings)
@@ -921,6 +1247,79 @@ static int demux_mkv_read_attachments(demuxer_t *demuxer)
     return 0;
 }
 
+/**
+ * \brief read the attachment list without the attached data
+ *
+ * Only the file offset and size of each FileData element are stored;
+ * the data is read by demuxer_attachment_data() when it is needed.
+ */
+static int demux_mkv_index_attachments(demuxer_t *demuxer)
+{
+    stream_t *s = demuxer->stream;
+
+    mp_msg(MSGT_DEMUX, MSGL_V,
+           "[mkv] /---- [ parsing attachments ] ---------\n");
+
+    uint64_t len = ebml_read_length(s, NULL);
+    if (len == EBML_UINT_INVALID)
+        return -1;
+    off_t end = stream_tell(s) + len;
+    while (stream_tell(s) < end && !s->eof) {
+        uint32_t id = ebml_read_id(s, NULL);
+        if (id != MATROSKA_ID_ATTACHEDFILE) {
+            if (ebml_read_skip(s, NULL))
+                return -1;
+            continue;
+        }
+        len = ebml_read_length(s, NULL);
+        if (len == EBML_UINT_INVALID)
+            return -1;
+        off_t file_end = stream_tell(s) + len;
+        char *name = NULL, *mime = NULL;
+        off_t data_pos = 0;
+        uint64_t data_len = 0;
+        while (stream_tell(s) < file_end && !s->eof) {
+            switch (ebml_read_id(s, NULL)) {
+            case MATROSKA_ID_FILENAME:
+                free(name);
+                name = ebml_read_utf8(s, NULL);
+                break;
+            case MATROSKA_ID_FILEMIMETYPE:
+                free(mime);
+                mime = ebml_read_ascii(s, NULL);
+                break;
+            case MATROSKA_ID_FILEDATA:
+                data_len = ebml_read_length(s, NULL);
+                if (data_len == EBML_UINT_INVALID)
+                    goto out;
+                data_pos = stream_tell(s);
+                stream_skip(s, data_len);
+                break;
+            default:
+                if (ebml_read_skip(s, NULL))
+                    goto out;
+            }
+        }
+    out:
+        if (!name || !mime || !data_pos || data_len > 1000000000) {
+            mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] Malformed attachment\n");
+        } else {
+            demuxer_add_attachment_at(demuxer, bstr(name), bstr(mime),
+                                      data_pos, data_len);
+            mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Attachment: %s, %s, %"PRIu64
+                   " bytes\n", name, mime, data_len);
+        }
+        free(name);
+        free(mime);
+        if (!stream_seek(s, file_end))
+            return -1;
+    }
+
+    mp_msg(MSGT_DEMUX, MSGL_V,
+           "[mkv] \\---- [ parsing attachments ] ---------\n");
+    return 0;
+}
+
 static int read_header_element(struct demuxer *demuxer, uint32_t id,
                                off_t at_filepos);
 
@@ -983,6 +1382,36 @@ static bool seek_pos_id(struct stream *s, off_t pos, uint32_t id)
     return true;
 }
 
+static bool stream_seekable(struct stream *s)
+{
+    return s->end_pos && (s->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK;
+}
+
+/// Remember where an element starts instead of parsing it while opening.
+static bool defer_element(struct demuxer *demuxer, off_t *deferred, off_t pos)
+{
+    if (*deferred || !stream_seekable(demuxer->stream))
+        return false;
+    *deferred = pos;
+    return true;
+}
+
+/// Parse an element remembered by defer_element(), keeping the read position.
+static void read_deferred_element(struct demuxer *demuxer, off_t *deferred,
+                                  uint32_t id,
+                                  int (*read)(struct demuxer *demuxer))
+{
+    stream_t *s = demuxer->stream;
+    off_t pos = *deferred;
+    if (!pos)
+        return;
+    *deferred = 0;
+    off_t oldpos = stream_tell(s);
+    if (seek_pos_id(s, pos, id))
+        read(demuxer);
+    stream_seek(s, oldpos);
+}
+
 static int read_header_element(struct demuxer *demuxer, uint32_t id,
                                off_t at_filepos)
 {
@@ -1013,6 +1442,10 @@ static int read_header_element(struct demuxer *demuxer, uint32_t id,
     case MATROSKA_ID_CUES:
         if (is_parsed_header(mkv_d, pos))
             break;
+        if (index_mode != 0 && index_mode != 2
+            && defer_element(demuxer, &mkv_d->deferred_cues,
+                             at_filepos ? at_filepos : pos))
+            break;
         if (at_filepos && !seek_pos_id(s, at_filepos, id))
             return -1;
         return demux_mkv_read_cues(demuxer);
@@ -1020,9 +1453,12 @@ static int read_header_element(struct demuxer *demuxer, uint32_t id,
     case MATROSKA_ID_TAGS:
         if (mkv_d->parsed_tags)
             break;
+        mkv_d->parsed_tags = true;
+        if (defer_element(demuxer, &mkv_d->deferred_tags,
+                          at_filepos ? at_filepos : pos))
+            break;
         if (at_filepos && !seek_pos_id(s, at_filepos, id))
             return -1;
-        mkv_d->parsed_tags = true;
         return demux_mkv_read_tags(demuxer);
 
     case MATROSKA_ID_SEEKHEAD:
@@ -1046,6 +1482,8 @@ static int read_header_element(struct demuxer *demuxer, uint32_t id,
         if (at_filepos && !seek_pos_id(s, at_filepos, id))
             return -1;
         mkv_d->parsed_attachments = true;
+        if (stream_seekable(s))
+            return demux_mkv_index_attachments(demuxer);
         return demux_mkv_read_attachments(demuxer);
 
     case EBML_ID_VOID:
@@ -1611,10 +2049,13 @@ static void mkv_free(struct demuxer *demuxer)
     struct mkv_demuxer *mkv_d = demuxer->priv;
     if (!mkv_d)
         return;
+    stop_indexer(mkv_d);
+    save_index_cache(demuxer);
     for (int i = 0; i < mkv_d->num_tracks; i++)
         demux_mkv_free_trackentry(mkv_d->tracks[i]);
     free(mkv_d->indexes);
     free(mkv_d->cluster_positions);
+    free(mkv_d->chunk_buf);
 }
 
 static int demux_mkv_open(demuxer_t *demuxer)
@@ -1684,6 +2125,7 @@ static int demux_mkv_open(demuxer_t *demuxer)
             mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] |+ found cluster, headers are "
                    "parsed completely :)\n");
             stream_seek(s, stream_tell(s) - 4);
+            mkv_d->first_cluster = stream_tell(s);
             break;
         }
         int res = read_header_element(demuxer, id, 0);
@@ -1741,6 +2183,9 @@ static int demux_mkv_open(demuxer_t *demuxer)
 
     demuxer->accurate_seek = true;
 
+    if (!has_cues(mkv_d))
+        load_index_cache(demuxer);
+
     return DEMUXER_TYPE_MATROSKA;
 }
 
@@ -1971,9 +2416,156 @@ static void handle_realaudio(demuxer_t *demuxer, mkv_track_t *track,
     }
 }
 
+#define CLUSTER_CHUNK_SIZE (1024 * 1024)
+#define CLUSTER_PADDING FFMAX(AV_LZO_INPUT_PADDING, MP_INPUT_BUFFER_PADDING_SIZE)
+
+// file position the cluster parser has reached
+static off_t cluster_tell(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    if (!mkv_d->cluster_size)
+        return stream_tell(demuxer->stream);
+    return mkv_d->chunk_pos + mkv_d->chunk_offset;
+}
+
+/* Start parsing a new cluster at the current stream position. */
+static void cluster_start(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    mkv_d->chunk_pos = stream_tell(demuxer->stream);
+    mkv_d->chunk_len = mkv_d->chunk_offset = 0;
+    mkv_d->blockgroup_size = 0;
+}
+
+/* Stop parsing the current cluster, e.g. before seeking. */
+static void cluster_reset(struct mkv_demuxer *mkv_d)
+{
+    mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
+    mkv_d->chunk_len = mkv_d->chunk_offset = 0;
+}
+
+/* Move the stream to where cluster parsing stopped, in case the last
+ * chunk extends beyond the end of the cluster (broken cluster sizes). */
+static void cluster_end(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    if (mkv_d->chunk_offset < mkv_d->chunk_len)
+        stream_seek(demuxer->stream, mkv_d->chunk_pos + mkv_d->chunk_offset);
+    mkv_d->chunk_len = mkv_d->chunk_offset = 0;
+}
+
+/**
+ * \brief make the next len bytes of the current cluster available in memory
+ *
+ * Cluster data is read in chunks of up to CLUSTER_CHUNK_SIZE bytes (more if
+ * a single element is larger), so that element headers can be parsed with
+ * the ebml_parse_* functions and blocks used without copying them. If the
+ * stream is memory mapped the chunk points into the mapping.
+ * The returned data stays valid until the next call that needs more data
+ * than is left in the chunk, and is followed by CLUSTER_PADDING bytes.
+ * \return pointer to the data, NULL on EOF or error
+ */
+static uint8_t *cluster_peek(struct demuxer *demuxer, uint64_t len)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    stream_t *s = demuxer->stream;
+    size_t avail = mkv_d->chunk_len - mkv_d->chunk_offset;
+    if (len <= avail)
+        return mkv_d->chunk + mkv_d->chunk_offset;
+    if (len > 500000000)
+        return NULL;
+    size_t size = FFMAX(len, FFMIN(CLUSTER_CHUNK_SIZE, mkv_d->cluster_size));
+    off_t pos = mkv_d->chunk_pos + mkv_d->chunk_offset;
+    uint8_t *map = stream_get_mapped(s, pos, size + CLUSTER_PADDING);
+    if (map) {
+        stream_skip(s, size - avail);
+        mkv_d->chunk = map;
+        mkv_d->chunk_mapped = true;
+    } else {
+        if (size + CLUSTER_PADDING > mkv_d->chunk_buf_size) {
+            size_t offset = mkv_d->chunk_mapped ? 0
+                            : mkv_d->chunk - mkv_d->chunk_buf;
+            uint8_t *buf = realloc(mkv_d->chunk_buf, size + CLUSTER_PADDING);
+            if (!buf)
+                return NULL;
+            if (!mkv_d->chunk_mapped)
+                mkv_d->chunk = buf + offset;
+            mkv_d->chunk_buf = buf;
+            mkv_d->chunk_buf_size = size + CLUSTER_PADDING;
+        }
+        // keep the unused rest of the previous chunk
+        if (avail)
+            memmove(mkv_d->chunk_buf, mkv_d->chunk + mkv_d->chunk_offset,
+                    avail);
+        int r = stream_read(s, mkv_d->chunk_buf + avail, size - avail);
+        size = avail + FFMAX(r, 0);
+        memset(mkv_d->chunk_buf + size, 0, CLUSTER_PADDING);
+        mkv_d->chunk = mkv_d->chunk_buf;
+        mkv_d->chunk_mapped = false;
+    }
+    mkv_d->chunk_pos = pos;
+    mkv_d->chunk_offset = 0;
+    mkv_d->chunk_len = size;
+    return len <= size ? mkv_d->chunk : NULL;
+}
+
+/* Skip len bytes of the current cluster. */
+static void cluster_skip(struct demuxer *demuxer, uint64_t len)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    size_t avail = mkv_d->chunk_len - mkv_d->chunk_offset;
+    if (len <= avail) {
+        mkv_d->chunk_offset += len;
+        return;
+    }
+    stream_skip(demuxer->stream, len - avail);
+    mkv_d->chunk_pos += mkv_d->chunk_len + (len - avail);
+    mkv_d->chunk_len = mkv_d->chunk_offset = 0;
+}
+
+/**
+ * \brief read the header of the next element in the current cluster
+ * \param len set to the length of the element data
+ * \param header_len set to the length of the header
+ * \return element ID, EBML_ID_INVALID on error
+ */
+static uint32_t cluster_read_header(struct demuxer *demuxer, uint64_t *len,
+                                    int *header_len)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    int avail = FFMIN(mkv_d->cluster_size, 12);
+    // never read past a block group, its data must stay in the chunk
+    if (mkv_d->blockgroup_size)
+        avail = FFMIN(avail, mkv_d->blockgroup_size);
+    uint8_t *p = cluster_peek(demuxer, avail);
+    int il, ll;
+    if (!p)
+        return EBML_ID_INVALID;
+    uint32_t id = ebml_parse_id(p, &il);
+    if (il < 0 || il >= avail)
+        return EBML_ID_INVALID;
+    *len = ebml_parse_length(p + il, &ll);
+    if (ll < 0 || il + ll > avail)
+        return EBML_ID_INVALID;
+    mkv_d->chunk_offset += il + ll;
+    *header_len = il + ll;
+    return id;
+}
+
+/* Read the data of an integer element of the current cluster. */
+static uint8_t *cluster_read_int(struct demuxer *demuxer, uint64_t len)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    uint8_t *p;
+    if (len < 1 || len > 8 || !(p = cluster_peek(demuxer, len)))
+        return NULL;
+    mkv_d->chunk_offset += len;
+    return p;
+}
+
 static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
                         uint64_t block_duration, int64_t block_bref,
-                        int64_t block_fref, uint8_t simpleblock)
+                        int64_t block_fref, uint8_t simpleblock, bool mapped)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
     mkv_track_t *track = NULL;
@@ -2079,8 +2671,13 @@ static int handle_block(demuxer_t *demuxer, uint8_t *block, uint64_t length,
                 uint8_t *buffer;
                 demux_mkv_decode(track, block, &buffer, &size, 1);
                 if (buffer) {
-                    dp = new_demux_packet(size);
-                    memcpy(dp->buffer, buffer, size);
+                    if (buffer == block && mapped && ds != demuxer->sub) {
+                        dp = new_demux_packet_frommap(demuxer->stream->mapping,
+                                                      buffer, size);
+                    } else {
+                        dp = new_demux_packet(size);
+                        memcpy(dp->buffer, buffer, size);
+                    }
                     if (buffer != block)
                         talloc_free(buffer);
                     dp->flags = (block_bref == 0
@@ -2117,7 +2714,11 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
     stream_t *s = demuxer->stream;
     uint64_t l;
-    int il, tmp;
+    uint8_t *p;
+    int il;
+
+    if (!mkv_d->indexer_started)
+        start_indexer(demuxer);
 
     while (1) {
         while (mkv_d->cluster_size > 0) {
@@ -2126,37 +2727,25 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
             uint8_t *block = NULL;
 
             while (mkv_d->blockgroup_size > 0) {
-                switch (ebml_read_id(s, &il)) {
+                switch (cluster_read_header(demuxer, &l, &il)) {
                 case MATROSKA_ID_BLOCKDURATION:
-                    block_duration = ebml_read_uint(s, &l);
-                    if (block_duration == EBML_UINT_INVALID) {
-                        free(block);
+                    if (!(p = cluster_read_int(demuxer, l)))
                         return 0;
-                    }
-                    block_duration *= mkv_d->tc_scale;
+                    block_duration = ebml_parse_uint(p, l) * mkv_d->tc_scale;
                     break;
 
                 case MATROSKA_ID_BLOCK:
-                    block_length = ebml_read_length(s, &tmp);
-                    free(block);
-                    if (block_length > 500000000)
-                        return 0;
-                    block = malloc(block_length + AV_LZO_INPUT_PADDING);
-                    demuxer->filepos = stream_tell(s);
-                    if (stream_read(s, block, block_length) !=
-                        (int) block_length) {
-                        free(block);
+                    demuxer->filepos = cluster_tell(demuxer);
+                    if (!(block = cluster_peek(demuxer, l)))
                         return 0;
-                    }
-                    l = tmp + block_length;
+                    mkv_d->chunk_offset += l;
+                    block_length = l;
                     break;
 
                 case MATROSKA_ID_REFERENCEBLOCK:;
-                    int64_t num = ebml_read_int(s, &l);
-                    if (num == EBML_INT_INVALID) {
-                        free(block);
+                    if (!(p = cluster_read_int(demuxer, l)))
                         return 0;
-                    }
+                    int64_t num = ebml_parse_sint(p, l);
                     if (num <= 0)
                         block_bref = num;
                     else
@@ -2164,11 +2753,10 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
                     break;
 
                 case EBML_ID_INVALID:
-                    free(block);
                     return 0;
 
                 default:
-                    ebml_read_skip(s, &l);
+                    cluster_skip(demuxer, l);
                     break;
                 }
                 mkv_d->blockgroup_size -= l + il;
@@ -2178,8 +2766,7 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
             if (block) {
                 int res = handle_block(demuxer, block, block_length,
                                        block_duration, block_bref, block_fref,
-                                       0);
-                free(block);
+                                       0, mkv_d->chunk_mapped);
                 if (res < 0)
                     return 0;
                 if (res)
@@ -2187,58 +2774,57 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
             }
 
             if (mkv_d->cluster_size > 0) {
-                switch (ebml_read_id(s, &il)) {
-                case MATROSKA_ID_TIMECODE:;
-                    uint64_t num = ebml_read_uint(s, &l);
-                    if (num == EBML_UINT_INVALID)
+                switch (cluster_read_header(demuxer, &l, &il)) {
+                case MATROSKA_ID_TIMECODE:
+                    if (!(p = cluster_read_int(demuxer, l)))
                         return 0;
-                    mkv_d->cluster_tc = num * mkv_d->tc_scale;
+                    mkv_d->cluster_tc = ebml_parse_uint(p, l) * mkv_d->tc_scale;
                     add_cluster_position(mkv_d, mkv_d->cluster_start,
                                          mkv_d->cluster_tc);
                     break;
 
                 case MATROSKA_ID_BLOCKGROUP:
-                    mkv_d->blockgroup_size = ebml_read_length(s, &tmp);
-                    l = tmp;
+                    if (l == EBML_UINT_INVALID) {
+                        // its end is unknown, resync at the next cluster
+                        mp_msg(MSGT_DEMUX, MSGL_WARN, "[mkv] BlockGroup of "
+                               "unknown size, skipping to the next cluster\n");
+                        mkv_d->cluster_size = 0;
+                        continue;
+                    }
+                    // read the whole group so that the block stays valid
+                    if (!cluster_peek(demuxer, l))
+                        return 0;
+                    mkv_d->blockgroup_size = l;
+                    l = 0;
                     break;
 
                 case MATROSKA_ID_SIMPLEBLOCK:;
-                    int res;
-                    block_length = ebml_read_length(s, &tmp);
-                    if (block_length > 500000000)
+                    demuxer->filepos = cluster_tell(demuxer);
+                    if (!(block = cluster_peek(demuxer, l)))
                         return 0;
-                    block = malloc(block_length);
-                    demuxer->filepos = stream_tell(s);
-                    if (stream_read(s, block, block_length) !=
-                        (int) block_length) {
-                        free(block);
-                        return 0;
-                    }
-                    l = tmp + block_length;
-                    res = handle_block(demuxer, block, block_length,
-                                       block_duration, block_bref,
-                                       block_fref, 1);
-                    free(block);
+                    mkv_d->chunk_offset += l;
                     mkv_d->cluster_size -= l + il;
+                    int res = handle_block(demuxer, block, l, block_duration,
+                                           block_bref, block_fref, 1,
+                                           mkv_d->chunk_mapped);
                     if (res < 0)
                         return 0;
                     else if (res)
                         return 1;
-                    else
-                        mkv_d->cluster_size += l + il;
-                    break;
+                    continue;
 
                 case EBML_ID_INVALID:
                     return 0;
 
                 default:
-                    ebml_read_skip(s, &l);
+                    cluster_skip(demuxer, l);
                     break;
                 }
                 mkv_d->cluster_size -= l + il;
             }
         }
 
+        cluster_end(demuxer);
         while (ebml_read_id(s, &il) != MATROSKA_ID_CLUSTER) {
             ebml_read_skip(s, NULL);
             if (s->eof)
@@ -2246,6 +2832,7 @@ static int demux_mkv_fill_buffer(demuxer_t *demuxer, demux_stream_t *ds)
         }
         mkv_d->cluster_start = stream_tell(s) - il;
         mkv_d->cluster_size = ebml_read_length(s, NULL);
+        cluster_start(demuxer);
     }
 
     return 0;
@@ -2259,6 +2846,7 @@ static int seek_creating_index(struct demuxer *demuxer, float rel_seek_secs,
     int64_t target_tc_ns = (int64_t) (rel_seek_secs * 1e9);
     if (target_tc_ns < 0)
         target_tc_ns = 0;
+    merge_indexer(mkv_d);
     uint64_t max_filepos = 0;
     int64_t max_tc = -1;
     int n = mkv_d->num_cluster_pos;
@@ -2267,34 +2855,24 @@ static int seek_creating_index(struct demuxer *demuxer, float rel_seek_secs,
         max_tc = mkv_d->cluster_positions[n - 1].timecode;
     }
 
-    if (target_tc_ns > max_tc) {
-        if ((off_t) max_filepos > stream_tell(s))
+    if (target_tc_ns > max_tc && !mkv_d->index_complete) {
+        off_t cur = cluster_tell(demuxer);
+        if ((off_t) max_filepos > cur)
             stream_seek(s, max_filepos);
         else
-            stream_seek(s, stream_tell(s) + mkv_d->cluster_size);
+            stream_seek(s, cur + mkv_d->cluster_size);
         /* parse all the clusters upto target_filepos */
-        while (!s->eof) {
-            uint64_t start = stream_tell(s);
-            uint32_t type = ebml_read_id(s, NULL);
-            uint64_t len = ebml_read_length(s, NULL);
-            uint64_t end = stream_tell(s) + len;
-            if (type == MATROSKA_ID_CLUSTER) {
-                while (!s->eof && stream_tell(s) < end) {
-                    if (ebml_read_id(s, NULL) == MATROSKA_ID_TIMECODE) {
-                        uint64_t tc = ebml_read_uint(s, NULL);
-                        tc *= mkv_d->tc_scale;
-                        add_cluster_position(mkv_d, start, tc);
-                        if (tc >= target_tc_ns)
-                            goto enough_index;
-                        break;
-                    }
-                }
+        struct cluster_pos pos;
+        int res;
+        while ((res = index_next_element(s, mkv_d->tc_scale, &pos)) >= 0) {
+            if (res) {
+                add_cluster_position(mkv_d, pos.filepos, pos.timecode);
+                if (pos.timecode >= target_tc_ns)
+                    break;
             }
-            if (s->eof)
-                break;
-            stream_seek(s, end);
         }
-    enough_index:
+        if (res == -1)
+            mkv_d->index_complete = true;
         if (s->eof)
             stream_reset(s);
     }
@@ -2316,7 +2894,7 @@ static int seek_creating_index(struct demuxer *demuxer, float rel_seek_secs,
             min_diff = diff < 0 ? -1 * diff : diff;
         }
     }
-    mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
+    cluster_reset(mkv_d);
     stream_seek(s, cluster_pos);
     return 0;
 }
@@ -2354,7 +2932,7 @@ static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
         }
 
     if (index) {        /* We've found an entry. */
-        mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
+        cluster_reset(mkv_d);
         stream_seek(demuxer->stream, index->filepos);
     }
     return index;
@@ -2378,6 +2956,8 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs,
         else
             flags |= SEEK_FORWARD;
     }
+    read_deferred_element(demuxer, &mkv_d->deferred_cues, MATROSKA_ID_CUES,
+                          demux_mkv_read_cues);
     // Adjust the target a little bit to catch cases where the target position
     // specifies a keyframe with high, but not perfect, precision.
     rel_seek_secs += flags & SEEK_FORWARD ? -0.005 : 0.005;
@@ -2436,7 +3016,7 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs,
         if (!index)
             return;
 
-        mkv_d->cluster_size = mkv_d->blockgroup_size = 0;
+        cluster_reset(mkv_d);
         stream_seek(s, index->filepos);
 
         if (demuxer->video->id >= 0)
@@ -2455,6 +3035,10 @@ static int demux_mkv_control(demuxer_t *demuxer, int cmd, void *arg)
     switch (cmd) {
     case DEMUXER_CTRL_CORRECT_PTS:
         return DEMUXER_CTRL_OK;
+    case DEMUXER_CTRL_LOAD_INFO:
+        read_deferred_element(demuxer, &mkv_d->deferred_tags,
+                              MATROSKA_ID_TAGS, demux_mkv_read_tags);
+        return DEMUXER_CTRL_OK;
     case DEMUXER_CTRL_GET_TIME_LENGTH:
         if (mkv_d->duration == 0)
             return DEMUXER_CTRL_DONTKNOW;
@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include <libavutil/common.h>
 #include <libavutil/intreadwrite.h>
@@ -82,28 +83,18 @@
 #define char2short(x,y)	AV_RB16(&(x)[(y)])
 #define char2int(x,y) 	AV_RB32(&(x)[(y)])
 
-typedef struct {
-    unsigned int pts; // duration
-    unsigned int size;
-    off_t pos;
-} mov_sample_t;
-
-typedef struct {
-    unsigned int sample; // number of the first sample in the chunk
-    unsigned int size;   // number of samples in the chunk
-    int desc;            // for multiple codecs mode - not used
-    off_t pos;
-} mov_chunk_t;
-
 typedef struct {
     unsigned int first;
     unsigned int spc;
     unsigned int sdid;
+    int sample;          // number of the first sample in the first chunk
 } mov_chunkmap_t;
 
 typedef struct {
     unsigned int num;
     unsigned int dur;
+    int sample;          // number of the first sample of this run
+    int64_t pts;         // and its pts
 } mov_durmap_t;
 
 typedef struct {
@@ -149,10 +140,18 @@ typedef struct {
     unsigned char* stream_header;
     int stream_header_len; // if >0, this header should be sent before the 1st frame
     //
-    int samples_size;
-    mov_sample_t* samples;
+    // The sample tables are kept as in the file, sample positions and
+    // times are looked up in them when needed.
+    int samples_size;    // number of samples, 0 if read by chunks
+    int stsz_size;
+    unsigned int* stsz;  // sample sizes, NULL if all have the same size
+    int fixed_samplesize;
     int chunks_size;
-    mov_chunk_t* chunks;
+    off_t* chunks;       // chunk positions
+    // last sample looked up, to step to the next one cheaply
+    int cur_sample;
+    int cur_chunk_end;   // first sample of the next chunk
+    off_t cur_pos;
     int chunkmap_size;
     mov_chunkmap_t* chunkmap;
     int durmap_size;
@@ -166,74 +165,165 @@ typedef struct {
     void* desc; // image/sound/etc description (pointer to ImageDescription etc)
 } mov_track_t;
 
-static void mov_build_index(mov_track_t* trak,int timescale){
-    int i,j,s;
-    int last=trak->chunks_size;
-    unsigned int pts=0;
+static unsigned int mov_sample_size(mov_track_t* trak, int sample){
+    if(!trak->stsz) return trak->fixed_samplesize;
+    return sample < trak->stsz_size ? trak->stsz[sample] : 0;
+}
 
-#if 0
-    if (trak->chunks_size <= 0)
-    {
-	mp_msg(MSGT_DEMUX, MSGL_WARN, "No chunk offset table, trying to build one!\n");
+/// index of the chunkmap run a chunk belongs to, -1 if none
+static int mov_chunk_run(mov_track_t* trak, int chunk){
+    int lo = 0, hi = trak->chunkmap_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (trak->chunkmap[mid].first <= (unsigned)chunk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
 
-	trak->chunks_size = trak->samples_size; /* XXX: FIXME ! */
-	// audit: this code will be vulnerable if it is reenabled (currently #if 0)
-	trak->chunks = realloc(trak->chunks, sizeof(mov_chunk_t)*trak->chunks_size);
+/// number of samples in a chunk
+static int mov_chunk_samples(mov_track_t* trak, int chunk){
+    int run = mov_chunk_run(trak, chunk);
+    return run < 0 ? 0 : trak->chunkmap[run].spc;
+}
+
+/// number of the first sample in a chunk
+static int mov_chunk_sample(mov_track_t* trak, int chunk){
+    int run = mov_chunk_run(trak, chunk);
+    if (run < 0)
+        return 0;
+    return trak->chunkmap[run].sample +
+           (chunk - trak->chunkmap[run].first) * trak->chunkmap[run].spc;
+}
 
-	for (i=0; i < trak->chunks_size; i++)
-	    trak->chunks[i].pos = -1;
+/// first chunk starting at or after sample, chunks_size if none
+static int mov_find_chunk(mov_track_t* trak, int sample){
+    int lo = 0, hi = trak->chunks_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (mov_chunk_sample(trak, mid) < sample)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-#endif
+    return lo;
+}
 
-    mp_msg(MSGT_DEMUX, MSGL_V, "MOV track #%d: %d chunks, %d samples\n",trak->id,trak->chunks_size,trak->samples_size);
-    mp_msg(MSGT_DEMUX, MSGL_V, "pts=%d  scale=%d  time=%5.3f\n",trak->length,trak->timescale,(float)trak->length/(float)trak->timescale);
+/// file position of a sample, 0 if it is in no chunk
+static off_t mov_sample_pos(mov_track_t* trak, int sample){
+    if (sample == trak->cur_sample + 1 && sample < trak->cur_chunk_end) {
+        // next sample in the same chunk
+        trak->cur_pos += mov_sample_size(trak, trak->cur_sample);
+    } else if (sample != trak->cur_sample) {
+        mov_chunkmap_t* cm;
+        int lo = 0, hi = trak->chunkmap_size, chunk, first, i;
+        // last run starting at or before the sample
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (trak->chunkmap[mid].sample <= sample)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        cm = lo > 0 ? &trak->chunkmap[lo - 1] : NULL;
+        if (!cm || !cm->spc ||
+            (chunk = cm->first + (sample - cm->sample) / cm->spc) >= trak->chunks_size) {
+            trak->cur_sample = -1;
+            trak->cur_chunk_end = 0;
+            return 0;
+        }
+        first = cm->sample + (chunk - cm->first) * cm->spc;
+        trak->cur_pos = trak->chunks[chunk];
+        if (trak->stsz) {
+            for (i = first; i < sample; i++)
+                trak->cur_pos += mov_sample_size(trak, i);
+        } else
+            trak->cur_pos += (off_t)(sample - first) * trak->fixed_samplesize;
+        trak->cur_chunk_end = first + cm->spc;
+    }
+    trak->cur_sample = sample;
+    return trak->cur_pos;
+}
 
-    // process chunkmap:
-    i=trak->chunkmap_size;
-    while(i>0){
-	--i;
-	j=trak->chunkmap[i].first;
-	for(;j>=0 && j<last;j++){
-	    trak->chunks[j].desc=trak->chunkmap[i].sdid;
-	    trak->chunks[j].size=trak->chunkmap[i].spc;
-	}
-	last=FFMIN(trak->chunkmap[i].first, trak->chunks_size);
+/// pts of a sample, in track timescale units
+static int64_t mov_sample_pts(mov_track_t* trak, int sample){
+    mov_durmap_t* dm;
+    int lo = 0, hi = trak->durmap_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (trak->durmap[mid].sample <= sample)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return 0;
+    dm = &trak->durmap[lo - 1];
+    // samples past the end of the table get the end pts
+    return dm->pts + (int64_t)FFMIN(sample - dm->sample, dm->num) * dm->dur;
+}
+
+/// first sample with a pts of at least pts, samples_size if none
+static int mov_find_sample(mov_track_t* trak, int64_t pts){
+    int lo = 0, hi = trak->samples_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (mov_sample_pts(trak, mid) < pts)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-#if 0
-    for (i=0; i < trak->chunks_size; i++)
-    {
-	/* fixup position */
-	if (trak->chunks[i].pos == -1)
-	    if (i > 0)
-		trak->chunks[i].pos = trak->chunks[i-1].pos + trak->chunks[i-1].size;
-	    else
-		trak->chunks[i].pos = 0; /* FIXME: set initial pos */
-#endif
+static void mov_build_index(mov_track_t* trak,int timescale){
+    int i,j;
+    int64_t s;
+    int64_t pts=0;
+
+    mp_msg(MSGT_DEMUX, MSGL_V, "MOV track #%d: %d chunks, %d samples\n",trak->id,trak->chunks_size,trak->stsz_size);
+    mp_msg(MSGT_DEMUX, MSGL_V, "pts=%d  scale=%d  time=%5.3f\n",trak->length,trak->timescale,(float)trak->length/(float)trak->timescale);
 
-    // calc pts of chunks:
-    s=0;
-    for(j=0;j<trak->chunks_size;j++){
-        trak->chunks[j].sample=s;
-        s+=trak->chunks[j].size;
+    trak->cur_sample = -1;
+    trak->cur_chunk_end = 0;
+
+    // process chunkmap: a run ends where the next one starts, so runs
+    // starting after their successor are empty
+    for (i = trak->chunkmap_size - 2; i >= 0; i--)
+        if (trak->chunkmap[i].first > trak->chunkmap[i + 1].first)
+            trak->chunkmap[i].first = trak->chunkmap[i + 1].first;
+    s = 0;
+    for (i = 0; i < trak->chunkmap_size; i++) {
+        unsigned int first = FFMIN(trak->chunkmap[i].first, trak->chunks_size);
+        unsigned int last = i + 1 < trak->chunkmap_size ?
+            FFMIN(trak->chunkmap[i + 1].first, trak->chunks_size) : trak->chunks_size;
+        trak->chunkmap[i].sample = s;
+        s = FFMIN(s + (int64_t)(last - first) * trak->chunkmap[i].spc, INT_MAX);
     }
-    i = 0;
-    for (j = 0; j < trak->durmap_size; j++)
-      i += trak->durmap[j].num;
-    if (i != s) {
+
+    // calc pts of the durmap runs:
+    j = 0;
+    for (i = 0; i < trak->durmap_size; i++) {
+        trak->durmap[i].sample = j;
+        trak->durmap[i].pts = pts;
+        j = FFMIN((int64_t)j + trak->durmap[i].num, INT_MAX);
+        pts += (int64_t)trak->durmap[i].num * trak->durmap[i].dur;
+    }
+    if (j != s) {
       mp_msg(MSGT_DEMUX, MSGL_WARN,
-             "MOV: durmap and chunkmap sample count differ (%i vs %i)\n", i, s);
-      if (i > s) s = i;
+             "MOV: durmap and chunkmap sample count differ (%i vs %"PRId64")\n", j, s);
+      if (j > s) s = j;
     }
 
     // workaround for fixed-size video frames (dv and uncompressed)
-    if(!trak->samples_size && trak->type!=MOV_TRAK_AUDIO){
-	trak->samples=calloc(s, sizeof(mov_sample_t));
-	trak->samples_size=trak->samples ? s : 0;
-	for(i=0;i<trak->samples_size;i++)
-	    trak->samples[i].size=trak->samplesize;
+    if(!trak->stsz && trak->type!=MOV_TRAK_AUDIO){
+	trak->fixed_samplesize=trak->samplesize;
+	trak->samples_size=s;
 	trak->samplesize=0;
-    }
+    } else
+	trak->samples_size=trak->stsz_size;
 
     if(!trak->samples_size){
 	// constant sampesize
@@ -245,41 +335,17 @@ static void mov_build_index(mov_track_t* trak,int timescale){
 
     if (trak->samples_size < s) {
       mp_msg(MSGT_DEMUX, MSGL_WARN,
-             "MOV: durmap or chunkmap bigger than sample count (%i vs %i)\n",
+             "MOV: durmap or chunkmap bigger than sample count (%"PRId64" vs %i)\n",
              s, trak->samples_size);
-      free(trak->samples);
-      trak->samples = calloc(s, sizeof(mov_sample_t));
-      trak->samples_size = trak->samples ? s : 0;
+      trak->samples_size = s;
     }
 
-    // calc pts:
-    s=0;
-    for(j=0;j<trak->durmap_size;j++){
-	for(i=0;i<trak->durmap[j].num;i++){
-	    if (s >= trak->samples_size)
-		break;
-	    trak->samples[s].pts=pts;
-	    ++s;
-	    pts+=trak->durmap[j].dur;
-	}
-    }
-
-    // calc sample offsets
-    s=0;
-    for(j=0;j<trak->chunks_size;j++){
-	off_t pos=trak->chunks[j].pos;
-	for(i=0;i<trak->chunks[j].size;i++){
-	    if (s >= trak->samples_size)
-		break;
-	    trak->samples[s].pos=pos;
-	    mp_msg(MSGT_DEMUX, MSGL_DBG3, "Sample %5d: pts=%8d  off=0x%08X  size=%d\n",s,
-		trak->samples[s].pts,
-		(int)trak->samples[s].pos,
-		trak->samples[s].size);
-	    pos+=trak->samples[s].size;
-	    ++s;
-	}
-    }
+    if (mp_msg_test(MSGT_DEMUX, MSGL_DBG3))
+	for (i = 0; i < trak->samples_size; i++)
+	    mp_msg(MSGT_DEMUX, MSGL_DBG3, "Sample %5d: pts=%8"PRId64"  off=0x%08X  size=%d\n",i,
+		mov_sample_pts(trak, i),
+		(int)mov_sample_pos(trak, i),
+		mov_sample_size(trak, i));
 
     // precalc editlist entries
     if(trak->editlist_size>0){
@@ -287,7 +353,7 @@ static void mov_build_index(mov_track_t* trak,int timescale){
 	int e_pts=0;
 	for(i=0;i<trak->editlist_size;i++){
 	    mov_editlist_t* el=&trak->editlist[i];
-	    int sample=0;
+	    int sample;
 	    int pts=el->pos;
 	    el->start_frame=frame;
 	    if(pts<0){
@@ -295,17 +361,13 @@ static void mov_build_index(mov_track_t* trak,int timescale){
 		el->frames=0; continue;
 	    }
 	    // find start sample
-	    for(;sample<trak->samples_size;sample++){
-		if(pts<=trak->samples[sample].pts) break;
-	    }
+	    sample=mov_find_sample(trak, pts);
 	    el->start_sample=sample;
-	    el->pts_offset=((long long)e_pts*(long long)trak->timescale)/(long long)timescale-trak->samples[sample].pts;
+	    el->pts_offset=((long long)e_pts*(long long)trak->timescale)/(long long)timescale-mov_sample_pts(trak, sample);
 	    pts+=((long long)el->dur*(long long)trak->timescale)/(long long)timescale;
 	    e_pts+=el->dur;
 	    // find end sample
-	    for(;sample<trak->samples_size;sample++){
-		if(pts<trak->samples[sample].pts) break;
-	    }
+	    sample=FFMAX(sample, mov_find_sample(trak, (int64_t)pts + 1));
 	    el->frames=sample-el->start_sample;
 	    frame+=el->frames;
 	    mp_msg(MSGT_DEMUX,MSGL_V,"EL#%d: pts=%d  1st_sample=%d  frames=%d (%5.3fs)  pts_offs=%d\n",i,
@@ -558,7 +620,7 @@ static void demux_close_mov(demuxer_t *demuxer) {
       free(track->tkdata);
       free(track->stdata);
       free(track->stream_header);
-      free(track->samples);
+      free(track->stsz);
       free(track->chunks);
       free(track->chunkmap);
       free(track->durmap);
@@ -1370,18 +1432,18 @@ static void lschunks(demuxer_t* demuxer,int level,off_t endpos,mov_track_t* trak
 
 		for (i=0; i<trak->samples_size; i++)
 		{
-		    char buf[trak->samples[i].size];
-		    stream_seek(demuxer->stream, trak->samples[i].pos);
+		    char buf[mov_sample_size(trak, i)];
+		    stream_seek(demuxer->stream, mov_sample_pos(trak, i));
 		    snprintf((char *)&name[0], 20, "samp%d", i);
 		    fd = open((char *)&name[0], O_CREAT|O_WRONLY);
-		    stream_read(demuxer->stream, &buf[0], trak->samples[i].size);
-		    write(fd, &buf[0], trak->samples[i].size);
+		    stream_read(demuxer->stream, &buf[0], mov_sample_size(trak, i));
+		    write(fd, &buf[0], mov_sample_size(trak, i));
 		    close(fd);
 		 }
 		for (i=0; i<trak->chunks_size; i++)
 		{
 		    char buf[trak->length];
-		    stream_seek(demuxer->stream, trak->chunks[i].pos);
+		    stream_seek(demuxer->stream, trak->chunks[i]);
 		    snprintf((char *)&name[0], 20, "chunk%d", i);
 		    fd = open((char *)&name[0], O_CREAT|O_WRONLY);
 		    stream_read(demuxer->stream, &buf[0], trak->length);
@@ -1393,7 +1455,7 @@ static void lschunks(demuxer_t* demuxer,int level,off_t endpos,mov_track_t* trak
 		    char *buf;
 
 		    buf = malloc(trak->samplesize);
-		    stream_seek(demuxer->stream, trak->chunks[0].pos);
+		    stream_seek(demuxer->stream, trak->chunks[0]);
 		    snprintf((char *)&name[0], 20, "trak%d", trak->id);
 		    fd = open((char *)&name[0], O_CREAT|O_WRONLY);
 		    stream_read(demuxer->stream, buf, trak->samplesize);
@@ -1814,11 +1876,11 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
       trak->samplesize = ss;
       if (!ss) {
         // variable samplesize
-        free(trak->samples);
-        trak->samples = calloc(entries, sizeof(mov_sample_t));
-        trak->samples_size = trak->samples ? entries : 0;
-        for (i = 0; i < trak->samples_size; i++)
-          trak->samples[i].size = stream_read_dword(demuxer->stream);
+        free(trak->stsz);
+        trak->stsz = calloc(entries, sizeof(*trak->stsz));
+        trak->stsz_size = trak->stsz ? entries : 0;
+        for (i = 0; i < trak->stsz_size; i++)
+          trak->stsz[i] = stream_read_dword(demuxer->stream);
       }
       break;
     }
@@ -1832,12 +1894,12 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
       // extend array if needed:
       if (len > trak->chunks_size) {
         free(trak->chunks);
-        trak->chunks = calloc(len, sizeof(mov_chunk_t));
+        trak->chunks = calloc(len, sizeof(*trak->chunks));
         trak->chunks_size = trak->chunks ? len : 0;
       }
       // read elements:
       for(i = 0; i < trak->chunks_size; i++)
-        trak->chunks[i].pos = stream_read_dword(demuxer->stream);
+        trak->chunks[i] = stream_read_dword(demuxer->stream);
       break;
     }
     case MOV_FOURCC('c','o','6','4'): {
@@ -1850,7 +1912,7 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
       // extend array if needed:
       if (len > trak->chunks_size) {
         free(trak->chunks);
-        trak->chunks = calloc(len, sizeof(mov_chunk_t));
+        trak->chunks = calloc(len, sizeof(*trak->chunks));
         trak->chunks_size = trak->chunks ? len : 0;
       }
       // read elements:
@@ -1858,9 +1920,9 @@ static int lschunks_intrak(demuxer_t* demuxer, int level, unsigned int id,
 #ifndef	_LARGEFILE_SOURCE
         if (stream_read_dword(demuxer->stream) != 0)
           mp_msg(MSGT_DEMUX, MSGL_WARN, "Chunk %d has got 64bit address, but you've MPlayer compiled without LARGEFILE support!\n", i);
-        trak->chunks[i].pos = stream_read_dword(demuxer->stream);
+        trak->chunks[i] = stream_read_dword(demuxer->stream);
 #else
-        trak->chunks[i].pos = stream_read_qword(demuxer->stream);
+        trak->chunks[i] = stream_read_qword(demuxer->stream);
 #endif
       }
       break;
@@ -2036,9 +2098,9 @@ static demuxer_t* mov_read_header(demuxer_t* demuxer){
 		mp_msg(MSGT_DEMUX, MSGL_INFO, "MOV: Track #%d: Extracting %d data chunks to files\n",t_no,trak->samples_size);
 		for (i=0; i<trak->samples_size; i++)
 		{
-		    int len=trak->samples[i].size;
+		    int len=mov_sample_size(trak, i);
 		    char buf[len];
-		    stream_seek(demuxer->stream, trak->samples[i].pos);
+		    stream_seek(demuxer->stream, mov_sample_pos(trak, i));
 		    snprintf(name, 20, "t%02d-s%03d.%s", t_no,i,
 			(trak->media_handler==MOV_FOURCC('f','l','s','h')) ?
 			    "swf":"dump");
@@ -2124,20 +2186,22 @@ static int demux_mov_fill_buffer(demuxer_t *demuxer,demux_stream_t* ds){
 
 if(trak->samplesize){
     // read chunk:
+    int chunk_samples;
     if(trak->pos>=trak->chunks_size) return 0; // EOF
-    stream_seek(demuxer->stream,trak->chunks[trak->pos].pos);
-    pts=(float)(trak->chunks[trak->pos].sample*trak->duration)/(float)trak->timescale;
+    stream_seek(demuxer->stream,trak->chunks[trak->pos]);
+    pts=(float)((int64_t)mov_chunk_sample(trak,trak->pos)*trak->duration)/(float)trak->timescale;
+    chunk_samples=mov_chunk_samples(trak,trak->pos);
     if(trak->samplesize!=1)
     {
 	mp_msg(MSGT_DEMUX, MSGL_DBG2, "WARNING! Samplesize(%d) != 1\n",
 	    trak->samplesize);
 	if((trak->fourcc != MOV_FOURCC('t','w','o','s')) && (trak->fourcc != MOV_FOURCC('s','o','w','t')))
-	    x=trak->chunks[trak->pos].size*trak->samplesize;
+	    x=chunk_samples*trak->samplesize;
 	else
-	    x=trak->chunks[trak->pos].size;
+	    x=chunk_samples;
     }
     else
-	x=trak->chunks[trak->pos].size;
+	x=chunk_samples;
 //    printf("X = %d\n", x);
     /* the following stuff is audio related */
     if (trak->type == MOV_TRAK_AUDIO){
@@ -2156,9 +2220,9 @@ if(trak->samplesize){
 	    x*=trak->samplebytes;
 	}
       }
-      mp_msg(MSGT_DEMUX, MSGL_DBG2, "Audio sample %d bytes pts %5.3f\n",trak->chunks[trak->pos].size*trak->samplesize,pts);
+      mp_msg(MSGT_DEMUX, MSGL_DBG2, "Audio sample %d bytes pts %5.3f\n",chunk_samples*trak->samplesize,pts);
     } /* MOV_TRAK_AUDIO */
-    pos=trak->chunks[trak->pos].pos;
+    pos=trak->chunks[trak->pos];
 } else {
     int frame=trak->pos;
     // editlist support:
@@ -2175,16 +2239,16 @@ if(trak->samplesize){
 	frame-=trak->editlist[trak->editlist_pos].start_frame;
 	frame+=trak->editlist[trak->editlist_pos].start_sample;
 	// calc pts:
-	pts=(float)(trak->samples[frame].pts+
+	pts=(float)(mov_sample_pts(trak,frame)+
 	    trak->editlist[trak->editlist_pos].pts_offset)/(float)trak->timescale;
     } else {
 	if(frame>=trak->samples_size) return 0; // EOF
-	pts=(float)trak->samples[frame].pts/(float)trak->timescale;
+	pts=(float)mov_sample_pts(trak,frame)/(float)trak->timescale;
     }
     // read sample:
-    stream_seek(demuxer->stream,trak->samples[frame].pos);
-    x=trak->samples[frame].size;
-    pos=trak->samples[frame].pos;
+    pos=mov_sample_pos(trak,frame);
+    stream_seek(demuxer->stream,pos);
+    x=mov_sample_size(trak,frame);
 }
 if(trak->pos==0 && trak->stream_header_len>0){
     // we have to append the stream header...
@@ -2207,19 +2271,13 @@ if(trak->pos==0 && trak->stream_header_len>0){
     if (demuxer->sub->id >= 0 && demuxer->sub->id < priv->track_db)
       trak = priv->tracks[demuxer->sub->id];
     if (trak) {
-      int samplenr = 0;
-      while (samplenr < trak->samples_size) {
-        double subpts = (double)trak->samples[samplenr].pts / (double)trak->timescale;
-        if (subpts >= pts) break;
-        samplenr++;
-      }
-      samplenr--;
+      int samplenr = mov_find_sample(trak, ceil(pts * trak->timescale)) - 1;
       if (samplenr < 0)
         vo_sub = NULL;
       else if (samplenr != priv->current_sub) {
-        off_t pos = trak->samples[samplenr].pos;
-        int len = trak->samples[samplenr].size;
-        double subpts = (double)trak->samples[samplenr].pts / (double)trak->timescale;
+        off_t pos = mov_sample_pos(trak, samplenr);
+        int len = mov_sample_size(trak, samplenr);
+        double subpts = (double)mov_sample_pts(trak, samplenr) / (double)trak->timescale;
         stream_seek(demuxer->stream, pos);
         ds_read_packet(demuxer->sub, demuxer->stream, len, subpts, pos, 0);
         priv->current_sub = samplenr;
@@ -2238,26 +2296,24 @@ static float mov_seek_track(mov_track_t* trak,float pts,int flags){
 if(trak->samplesize){
     int sample=pts/trak->duration;
 //    printf("MOV track seek - chunk: %d  (pts: %5.3f  dur=%d)  \n",sample,pts,trak->duration);
-    if(!(flags&SEEK_ABSOLUTE)) sample+=trak->chunks[trak->pos].sample; // relative
-    trak->pos=0;
-    while(trak->pos<trak->chunks_size && trak->chunks[trak->pos].sample<sample) ++trak->pos;
+    if(!(flags&SEEK_ABSOLUTE)) sample+=mov_chunk_sample(trak,trak->pos); // relative
+    trak->pos=mov_find_chunk(trak,sample);
     if (trak->pos == trak->chunks_size) return -1;
-    pts=(float)(trak->chunks[trak->pos].sample*trak->duration)/(float)trak->timescale;
+    pts=(float)((int64_t)mov_chunk_sample(trak,trak->pos)*trak->duration)/(float)trak->timescale;
 } else {
-    unsigned int ipts;
-    if(!(flags&SEEK_ABSOLUTE)) pts+=trak->samples[trak->pos].pts;
+    int64_t ipts;
+    if(!(flags&SEEK_ABSOLUTE)) pts+=mov_sample_pts(trak,trak->pos);
     if(pts<0) pts=0;
     ipts=pts;
     //printf("MOV track seek - sample: %d  \n",ipts);
-    for(trak->pos=0;trak->pos<trak->samples_size;++trak->pos){
-	if(trak->samples[trak->pos].pts>=ipts) break; // found it!
-    }
+    trak->pos=mov_find_sample(trak,ipts);
     if (trak->pos == trak->samples_size) return -1;
     if(trak->keyframes_size){
 	// find nearest keyframe
-	int i;
-	for(i=0;i<trak->keyframes_size;i++){
-	    if(trak->keyframes[i]>=trak->pos) break;
+	int i=0, hi=trak->keyframes_size;
+	while(i<hi){
+	    int mid=(i+hi)/2;
+	    if(trak->keyframes[mid]<trak->pos) i=mid+1; else hi=mid;
 	}
 	if (i == trak->keyframes_size) return -1;
 	if(i>0 && (trak->keyframes[i]-trak->pos) > (trak->pos-trak->keyframes[i-1]))
@@ -2265,7 +2321,7 @@ if(trak->samplesize){
 	trak->pos=trak->keyframes[i];
 //	printf("nearest keyframe: %d  \n",trak->pos);
     }
-    pts=(float)trak->samples[trak->pos].pts/(float)trak->timescale;
+    pts=(float)mov_sample_pts(trak,trak->pos)/(float)trak->timescale;
 }
 
 //    printf("MOV track seek done:  %5.3f  \n",pts);
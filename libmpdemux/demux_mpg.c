@@ -35,6 +35,8 @@
 #include "parse_es.h"
 #include "stheader.h"
 #include "mp3_hdr.h"
+#include "mpeg_hdr.h"
+#include "pts_index.h"
 
 //#define MAX_PS_PACKETSIZE 2048
 #define MAX_PS_PACKETSIZE (224*1024)
@@ -58,6 +60,7 @@ typedef struct mpg_demuxer {
   unsigned int es_map[0x40];	//es map of stream types (associated to the pes id) from 0xb0 to 0xef
   int num_a_streams;
   int a_stream_ids[MAX_A_STREAMS];
+  struct pts_index pts_index;
 } mpg_demuxer_t;
 
 static int mpeg_pts_error=0;
@@ -247,9 +250,39 @@ static demuxer_t* demux_mpg_open(demuxer_t* demuxer) {
 
 static void demux_close_mpg(demuxer_t* demuxer) {
   mpg_demuxer_t* mpg_d = demuxer->priv;
+  if (mpg_d)
+    pts_index_free(&mpg_d->pts_index);
   free(mpg_d);
 }
 
+// first PES timestamp of the selected video (or audio) stream after pos
+static double ps_read_pts(demuxer_t *demuxer, off_t pos, off_t *found)
+{
+  demux_stream_t *ds = demuxer->video->sh ? demuxer->video : demuxer->audio;
+  unsigned char buf[PTS_PROBE_SIZE];
+  int sid, len, i;
+
+  if (ds == demuxer->video)
+    sid = ds->id >= 0 && ds->id < 16 ? 0xE0 + ds->id : -1;
+  else
+    sid = ds->id >= 0 && ds->id < 32 ? 0xC0 + ds->id : 0xBD;
+  if (sid < 0)
+    return MP_NOPTS_VALUE;
+  stream_seek(demuxer->stream, pos);
+  len = stream_read(demuxer->stream, buf, PTS_PROBE_SIZE);
+  for (i = 0; i + 3 < len; i++) {
+    int64_t pts;
+    if (buf[i] || buf[i+1] || buf[i+2] != 1 || buf[i+3] != sid)
+      continue;
+    pts = mp_pes_pts(buf + i, len - i);
+    if (pts >= 0) {
+      *found = pos + i;
+      return pts / 90000.0;
+    }
+  }
+  return MP_NOPTS_VALUE;
+}
+
 
 static unsigned long long read_mpeg_timestamp(stream_t *s,int c){
   unsigned int d,e;
@@ -942,6 +975,27 @@ static void demux_seek_mpg(demuxer_t *demuxer, float rel_seek_secs,
           newpos+=2324*75*rel_seek_secs; // 174.3 kbyte/sec
         else
           newpos+=sh_video->i_bps*rel_seek_secs;
+
+        if (mpg_d && demuxer->opts->seek_tolerance > 0
+            && demuxer->stream->type == STREAMTYPE_FILE && (sh_video || sh_audio)
+            && pts_index_init(demuxer, &mpg_d->pts_index, ps_read_pts)) {
+          double start = pts_index_start(&mpg_d->pts_index);
+          double target = -1;
+          // absolute targets count from the first timestamp in the file
+          if (flags & SEEK_ABSOLUTE)
+            target = start + rel_seek_secs;
+          else if (oldpts >= 0)
+            target = oldpts + rel_seek_secs;
+          if (target >= 0) {
+            off_t pos = pts_index_seek(demuxer, &mpg_d->pts_index, target,
+                                       demuxer->opts->seek_tolerance,
+                                       ps_read_pts);
+            if (pos >= 0) {
+              newpos = pos;
+              precision = 0;
+            }
+          }
+        }
     }
 
     while (1) {
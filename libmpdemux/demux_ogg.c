@@ -36,6 +36,7 @@
 #include "aviprint.h"
 #include "demux_mov.h"
 #include "demux_ogg.h"
+#include "pts_index.h"
 
 #define FOURCC_VORBIS mmioFOURCC('v', 'r', 'b', 's')
 #define FOURCC_SPEEX  mmioFOURCC('s', 'p', 'x', ' ')
@@ -149,6 +150,8 @@ typedef struct ogg_demuxer {
     int64_t          initial_granulepos;
     int64_t          final_granulepos;
     int64_t          duration;
+    /// Page timestamps probed when seeking without syncpoints
+    struct pts_index pts_index;
 
     /* Used for subtitle switching. */
     int    n_text;
@@ -1397,6 +1400,116 @@ fallback:
 
 }
 
+/// stream used for seeking: video if there is any, else audio
+static ogg_stream_t *demux_ogg_seek_stream(demuxer_t *demuxer, float *rate)
+{
+    ogg_demuxer_t *ogg_d = demuxer->priv;
+    ogg_stream_t *os;
+
+    if (demuxer->video->id >= 0) {
+        os    = &ogg_d->subs[demuxer->video->id];
+        *rate = os->samplerate;
+    } else {
+        os    = &ogg_d->subs[demuxer->audio->id];
+        *rate = os->vi.rate;
+    }
+    return os;
+}
+
+/// granulepos of the first page of the seek stream at or after pos
+static int64_t demux_ogg_read_granulepos(demuxer_t *demuxer, off_t pos,
+                                         off_t *found)
+{
+    float rate;
+    ogg_stream_t *os = demux_ogg_seek_stream(demuxer, &rate);
+    unsigned char buf[PTS_PROBE_SIZE];
+    unsigned char *p = buf, *end;
+    int len;
+
+    stream_seek(demuxer->stream, pos);
+    len = stream_read(demuxer->stream, buf, sizeof(buf));
+    if (len < 27)
+        return -1;
+    end = buf + len - 27;
+    while (p < end && (p = memchr(p, 'O', end - p))) {
+        int64_t gp;
+        if (memcmp(p, "OggS", 4) || p[4] != 0 || (p[5] & ~7) ||
+            AV_RL32(p + 14) != (uint32_t)os->stream.serialno) {
+            p++;
+            continue;
+        }
+        gp = AV_RL64(p + 6);
+        if (gp < 0) { // no packet ends on this page
+            p++;
+            continue;
+        }
+        *found = pos + (p - buf);
+        return gp;
+    }
+    return -1;
+}
+
+/// pts_reader for bisection, the time of the last packet ending on a page
+static double demux_ogg_read_pts(demuxer_t *demuxer, off_t pos, off_t *found)
+{
+    float rate;
+    ogg_stream_t *os = demux_ogg_seek_stream(demuxer, &rate);
+    int64_t gp = demux_ogg_read_granulepos(demuxer, pos, found);
+
+    if (gp < 0 || rate <= 0)
+        return MP_NOPTS_VALUE;
+    if (os->theora) {
+#ifdef CONFIG_OGGTHEORA
+        int shift = _ilog(os->keyframe_frequency_force - 1);
+        gp = (gp >> shift) + (gp & ((1 << shift) - 1));
+#endif
+    }
+    return gp / rate;
+}
+
+/**
+ * Find the position to seek to for granulepos gp by bisecting the file on
+ * page granulepos. For Theora this is a position before the keyframe the
+ * target frame depends on.
+ * \return position relative to movi_start, -1 if bisection is not possible
+ */
+static off_t demux_ogg_bisect(demuxer_t *demuxer, int64_t gp)
+{
+    ogg_demuxer_t *ogg_d = demuxer->priv;
+    double tolerance = demuxer->opts->seek_tolerance;
+    float rate;
+    ogg_stream_t *os = demux_ogg_seek_stream(demuxer, &rate);
+    double target = gp / rate;
+    off_t pos;
+
+    if (tolerance <= 0 || rate <= 0 ||
+        !pts_index_init(demuxer, &ogg_d->pts_index, demux_ogg_read_pts))
+        return -1;
+    if (target <= pts_index_start(&ogg_d->pts_index))
+        return 0;
+    pos = pts_index_seek(demuxer, &ogg_d->pts_index, target, tolerance,
+                         demux_ogg_read_pts);
+    if (pos >= 0 && os->theora) {
+#ifdef CONFIG_OGGTHEORA
+        // Land before the page that completes the keyframe, the
+        // granulepos of the page found tells which one that is.
+        int shift = _ilog(os->keyframe_frequency_force - 1);
+        off_t found;
+        int64_t page_gp = demux_ogg_read_granulepos(demuxer, pos, &found);
+        if (page_gp >= 0) {
+            double key = (page_gp >> shift) / rate;
+            if (key <= pts_index_start(&ogg_d->pts_index))
+                return 0;
+            pos = pts_index_seek(demuxer, &ogg_d->pts_index, key - 1 / rate,
+                                 tolerance, demux_ogg_read_pts);
+        }
+#endif
+    }
+    if (pos < 0)
+        return -1;
+    return pos - demuxer->movi_start;
+}
+
 static void demux_ogg_seek(demuxer_t *demuxer, float rel_seek_secs,
                            float audio_delay, int flags)
 {
@@ -1408,7 +1521,7 @@ static void demux_ogg_seek(demuxer_t *demuxer, float rel_seek_secs,
     demux_stream_t *ds;
     ogg_packet op;
     float rate;
-    int i, sp, first = 1, precision = 1, do_seek = 1;
+    int i, sp, first = 1, precision = 1, do_seek = 1, bisected = 0;
     vorbis_info *vi = NULL;
     int64_t gp = 0, old_gp;
     off_t pos, old_pos;
@@ -1466,6 +1579,9 @@ static void demux_ogg_seek(demuxer_t *demuxer, float rel_seek_secs,
         }
         pos = ogg_d->syncpoints[sp].page_pos;
         precision = 0;
+    } else if ((pos = demux_ogg_bisect(demuxer, gp)) >= 0) {
+        precision = 0;
+        bisected  = 1;
     } else {
         pos = flags & SEEK_ABSOLUTE ? 0 : ogg_d->pos;
         if (flags & SEEK_FACTOR)
@@ -1551,7 +1667,7 @@ static void demux_ogg_seek(demuxer_t *demuxer, float rel_seek_secs,
                     }
                 }
             }
-            if (is_gp_valid && pos > 0 && old_gp > gp
+            if (is_gp_valid && !bisected && pos > 0 && old_gp > gp
                     && 2 * (old_gp - op.granulepos) < old_gp - gp) {
                 /* prepare another seek because looking for a syncpoint
                    destroyed the backward search */
@@ -1602,6 +1718,7 @@ static void demux_close_ogg(demuxer_t *demuxer)
         free(ogg_d->subs);
     }
     free(ogg_d->syncpoints);
+    pts_index_free(&ogg_d->pts_index);
     free(ogg_d->text_ids);
     if (ogg_d->text_langs) {
         for (i = 0; i < ogg_d->n_text; i++)
@@ -29,11 +29,13 @@ typedef struct demux_packet {
     double stream_pts;
     off_t pos; // position in index (AVI) or file (MPG)
     unsigned char *buffer;
+    int buffer_class; // size class of buffer in the packet pool, -1 if none
     int flags; // keyframe, etc
     int refcount; // counter for the master packet, if 0, buffer can be free()d
     struct demux_packet *master; //in clones, pointer to the master packet
     struct demux_packet *next;
     struct AVPacket *avpacket;   // original libavformat packet (demux_lavf)
+    struct stream_mapping *mapping; // buffer points into this file mapping
 } demux_packet_t;
 
 #endif /* MPLAYER_DEMUX_PACKET_H */
@@ -37,6 +37,7 @@
 #include "stheader.h"
 #include "ms_hdr.h"
 #include "mpeg_hdr.h"
+#include "pts_index.h"
 #include "demux_ts.h"
 
 #define TS_PH_PACKET_SIZE 192
@@ -242,6 +243,10 @@ typedef struct {
 	int last_sid;
 	char packet[TS_FEC_PACKET_SIZE];
 	TS_stream_info vstr, astr;
+	struct pts_index pts_index;
+	uint32_t skip_pids[NB_PID_MAX / 32];	// dropped before any parsing
+	int skip_pids_valid;
+	int skip_vid, skip_aid, skip_sid, skip_prog;	// selection they are for
 } ts_priv_t;
 
 
@@ -342,6 +347,7 @@ static void ts_add_stream(demuxer_t * demuxer, ES_stream_t *es)
 
 	if(priv->ts.streams[es->pid].sh)
 		return;
+	priv->skip_pids_valid = 0;
 
 	if((IS_AUDIO(es->type) || IS_AUDIO(es->subtype)) && priv->last_aid+1 < MAX_A_STREAMS)
 	{
@@ -1132,6 +1138,7 @@ static void demux_close_ts(demuxer_t * demuxer)
 				free_demux_packet(priv->fifo[i].pack);
 			priv->fifo[i].pack = NULL;
 		}
+		pts_index_free(&priv->pts_index);
 		free(priv);
 	}
 	demuxer->priv=NULL;
@@ -1633,11 +1640,23 @@ static int pes_parse2(unsigned char *buf, uint16_t packet_len, ES_stream_t *es,
 
 static int ts_sync(stream_t *stream)
 {
+	unsigned char *buf, *sync;
+	int len;
+
 	mp_msg(MSGT_DEMUX, MSGL_DBG3, "TS_SYNC \n");
 
-	while (!stream->eof)
-		if (stream_read_char(stream) == 0x47)
+	// search the whole buffered block at once
+	while ((buf = stream_peek(stream, 1)))
+	{
+		len = stream->buf_len - stream->buf_pos;
+		sync = memchr(buf, 0x47, len);
+		if (sync)
+		{
+			stream->buf_pos += sync - buf + 1;
 			return 1;
+		}
+		stream->buf_pos += len;
+	}
 
 	return 0;
 }
@@ -1757,6 +1776,7 @@ static int parse_pat(ts_priv_t * priv, int is_start, unsigned char *buff, int si
 	skip = collect_section(section, is_start, buff, size);
 	if(! skip)
 		return 0;
+	priv->skip_pids_valid = 0;
 
 	ptr = &(section->buffer[skip]);
 	//PARSING
@@ -2214,6 +2234,7 @@ static ES_stream_t *new_pid(ts_priv_t *priv, int pid)
 	tss->extradata = NULL;
 	tss->extradata_alloc = tss->extradata_len = 0;
 	priv->ts.pids[pid] = tss;
+	priv->skip_pids_valid = 0;
 
 	return tss;
 }
@@ -2449,6 +2470,7 @@ static int parse_pmt(ts_priv_t * priv, uint16_t progid, uint16_t pid, int is_sta
 	skip = collect_section(section, is_start, buff, size);
 	if(! skip)
 		return 0;
+	priv->skip_pids_valid = 0;
 
 	base = &(section->buffer[skip]);
 
@@ -2765,6 +2787,83 @@ static int fill_extradata(mp4_decoder_config_t * mp4_dec, ES_stream_t *tss)
 	return tss->extradata_len;
 }
 
+/*
+ * Mark the pids whose packets ts_parse() would only read and throw away:
+ * null and reserved pids, and the streams that are already known but not
+ * selected. Tables, the PCR pid and pids of unknown type are still parsed.
+ */
+static void update_skip_pids(demuxer_t *demuxer)
+{
+	ts_priv_t *priv = (ts_priv_t*) demuxer->priv;
+	sh_sub_t *sh_sub = demuxer->sub->sh;
+	int sid = sh_sub ? sh_sub->sid : -1;
+	int pcr_pid, pid;
+
+	if(priv->skip_pids_valid && priv->skip_vid == demuxer->video->id &&
+	   priv->skip_aid == demuxer->audio->id && priv->skip_sid == sid &&
+	   priv->skip_prog == priv->prog)
+		return;
+	priv->skip_vid = demuxer->video->id;
+	priv->skip_aid = demuxer->audio->id;
+	priv->skip_sid = sid;
+	priv->skip_prog = priv->prog;
+	priv->skip_pids_valid = 1;
+
+	pcr_pid = prog_pcr_pid(priv, priv->prog);
+	for(pid = 0; pid < NB_PID_MAX; pid++)
+	{
+		ES_stream_t *tss = priv->ts.pids[pid];
+		sh_av_t *st = &priv->ts.streams[pid];
+		uint32_t bit = 1u << (pid & 31);
+		int skip = (pid > 1 && pid < 16) || pid == 8191;
+
+		if(tss && st->sh && pid != pcr_pid && tss->type != SL_PES_STREAM &&
+		   prog_id_in_pat(priv, pid) == -1)
+			skip = !(st->type == TYPE_VIDEO && st->id == demuxer->video->id) &&
+			       !(st->type == TYPE_AUDIO && st->id == demuxer->audio->id) &&
+			       pid != sid;
+
+		if(skip)
+			priv->skip_pids[pid >> 5] |= bit;
+		else if(priv->skip_pids[pid >> 5] & bit)
+		{
+			// the packets in between were lost, start again at a PES header
+			priv->skip_pids[pid >> 5] &= ~bit;
+			if(tss)
+			{
+				tss->is_synced = 0;
+				tss->last_cc = -1;
+			}
+		}
+	}
+}
+
+// Drop all buffered packets of skipped pids without parsing them.
+static void skip_unwanted_packets(demuxer_t *demuxer)
+{
+	ts_priv_t *priv = (ts_priv_t*) demuxer->priv;
+	stream_t *stream = demuxer->stream;
+	int size = priv->ts.packet_size;
+	unsigned char *buf;
+
+	update_skip_pids(demuxer);
+	while((buf = stream_peek(stream, size)))
+	{
+		int avail = stream->buf_len - stream->buf_pos;
+		int i;
+
+		for(i = 0; i + size <= avail; i += size)
+		{
+			int pid = ((buf[i + 1] & 0x1F) << 8) | buf[i + 2];
+			if(buf[i] != 0x47 || !(priv->skip_pids[pid >> 5] & (1u << (pid & 31))))
+				break;
+		}
+		stream->buf_pos += i;
+		if(i + size <= avail)
+			return;
+	}
+}
+
 // 0 = EOF or no stream found
 // else = [-] number of bytes written to the packet
 static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet, int probe)
@@ -2801,6 +2900,9 @@ static int ts_parse(demuxer_t *demuxer , ES_stream_t *es, unsigned char *packet,
 		junk = priv->ts.packet_size - TS_PACKET_SIZE;
 		buf_size = priv->ts.packet_size - junk;
 
+		if(! probe)
+			skip_unwanted_packets(demuxer);
+
 		if(stream_eof(stream))
 		{
 			if(! probe)
@@ -3241,6 +3343,47 @@ static void reset_fifos(demuxer_t *demuxer, int a, int v, int s)
 }
 
 
+// first PES timestamp of the selected video (or audio) stream after pos
+static double ts_read_pts(demuxer_t *demuxer, off_t pos, off_t *found)
+{
+	ts_priv_t *priv = (ts_priv_t*) demuxer->priv;
+	demux_stream_t *ds = demuxer->video->sh ? demuxer->video : demuxer->audio;
+	int type = ds == demuxer->video ? TYPE_VIDEO : TYPE_AUDIO;
+	int size = priv->ts.packet_size;
+	unsigned char buf[PTS_PROBE_SIZE];
+	int len, i;
+
+	stream_seek(demuxer->stream, pos);
+	len = stream_read(demuxer->stream, buf, PTS_PROBE_SIZE);
+	for(i = 0; i + size < len; i++)
+		if(buf[i] == 0x47 && buf[i + size] == 0x47)
+			break;
+	for(; i + TS_PACKET_SIZE <= len && buf[i] == 0x47; i += size)
+	{
+		unsigned char *p = buf + i;
+		int pid = ((p[1] & 0x1F) << 8) | p[2];
+		int hdr = 4;
+		int64_t pts;
+
+		// only packets starting a PES packet, with payload and no error
+		if((p[1] & 0xC0) != 0x40 || !(p[3] & 0x10))
+			continue;
+		if(priv->ts.streams[pid].type != type || priv->ts.streams[pid].id != ds->id)
+			continue;
+		if(p[3] & 0x20)
+			hdr += 1 + p[4];
+		if(hdr >= TS_PACKET_SIZE)
+			continue;
+		pts = mp_pes_pts(p + hdr, TS_PACKET_SIZE - hdr);
+		if(pts >= 0)
+		{
+			*found = pos + i;
+			return pts / 90000.0;
+		}
+	}
+	return MP_NOPTS_VALUE;
+}
+
 static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_delay, int flags)
 {
 	demux_stream_t *d_audio=demuxer->audio;
@@ -3250,6 +3393,9 @@ static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_d
 	ts_priv_t * priv = (ts_priv_t*) demuxer->priv;
 	int i, video_stats;
 	off_t newpos;
+	double tolerance = demuxer->opts->seek_tolerance;
+	double cur_pts = sh_video ? d_video->pts : d_audio->pts;
+	struct stream_time_window window;
 
 	//================= seek in MPEG-TS ==========================
 
@@ -3280,9 +3426,43 @@ static void demux_seek_ts(demuxer_t *demuxer, float rel_seek_secs, float audio_d
 			newpos += 2324*75*rel_seek_secs; // 174.3 kbyte/sec
 		else
 			newpos += video_stats*rel_seek_secs;
+
+		if(tolerance > 0 && (sh_video || sh_audio) && demuxer->stream->end_pos > 0
+		   && pts_index_init(demuxer, &priv->pts_index, ts_read_pts))
+		{
+			double start = pts_index_start(&priv->pts_index);
+			double target = MP_NOPTS_VALUE;
+			// absolute targets count from the first timestamp in the file
+			if(flags & SEEK_ABSOLUTE)
+				target = start + rel_seek_secs;
+			else if(cur_pts != MP_NOPTS_VALUE && cur_pts > 0)
+				target = cur_pts + rel_seek_secs;
+			if(target != MP_NOPTS_VALUE)
+			{
+				off_t pos = pts_index_seek(demuxer, &priv->pts_index,
+					target, tolerance, ts_read_pts);
+				if(pos >= 0)
+					newpos = pos;
+			}
+		}
 	}
 
 
+	// time-shifted live stream, seek inside the recorded window
+	if(stream_control(demuxer->stream, STREAM_CTRL_GET_TIME_WINDOW, &window) == STREAM_OK)
+	{
+		double target = MP_NOPTS_VALUE;
+		if(flags & SEEK_FACTOR)
+			target = window.start + (window.end - window.start) * rel_seek_secs;
+		else if(flags & SEEK_ABSOLUTE)
+			target = window.start + rel_seek_secs;
+		else if(cur_pts != MP_NOPTS_VALUE && cur_pts > 0)
+			target = cur_pts + rel_seek_secs;
+		if(target != MP_NOPTS_VALUE &&
+		   stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_TIME, &target) == STREAM_OK)
+			newpos = stream_tell(demuxer->stream);
+	}
+
 	if(newpos < demuxer->movi_start)
   		newpos = demuxer->movi_start;	//begininng of stream
 
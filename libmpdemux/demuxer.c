@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <unistd.h>
 
@@ -28,17 +29,24 @@
 #include <sys/stat.h>
 
 #include "config.h"
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#endif
 #include "options.h"
 #include "talloc.h"
 #include "mp_msg.h"
 #include "m_config.h"
 
 #include "libvo/fastmemcpy.h"
+#include "osdep/timer.h"
 
 #include "stream/stream.h"
 #include "demuxer.h"
 #include "stheader.h"
 #include "mf.h"
+#include "mpeg_hdr.h"
 
 #include "libaf/af_format.h"
 #include "libmpcodecs/dec_teletext.h"
@@ -171,6 +179,154 @@ const demuxer_desc_t *const demuxer_list[] = {
     NULL
 };
 
+/* Packet structs and payload buffers are recycled through a pool instead
+ * of going through malloc()/free() for every packet. Structs are allocated
+ * in slabs, payloads in power of two size classes. The memory is returned
+ * once the last demuxer is closed and all packets have been freed.
+ * The packet constructors have no demuxer argument, so there is a single
+ * pool shared by all demuxers. */
+
+#define PACKET_SLAB_SIZE 128
+#define POOL_MIN_SHIFT 8   // the smallest payload class holds 256 bytes
+#define POOL_CLASSES 13    // the largest 1 MB, bigger payloads are not pooled
+#define POOL_MAX_CACHED (32 * 1024 * 1024) // limit for unused payloads
+
+struct packet_slab {
+    struct packet_slab *next;
+    struct demux_packet packets[PACKET_SLAB_SIZE];
+};
+
+static struct packet_pool {
+    struct packet_slab *slabs;
+    struct demux_packet *free_packets; // linked through ->next
+    void *free_buffers[POOL_CLASSES];  // linked through their first bytes
+    int64_t cached_bytes; // size of the buffers on the free lists
+    int64_t bytes;        // all memory held by the pool
+    int64_t peak_bytes;
+    int live_packets;
+    int demuxers;
+    unsigned hits, misses;
+    int64_t queued_bytes; // payload of the packets in demux_stream queues
+    int64_t peak_queued_bytes;
+} packet_pool;
+
+#ifdef HAVE_PTHREADS
+// packets are created by the demuxer thread and freed by the player
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void pool_lock(void)   { pthread_mutex_lock(&pool_mutex); }
+static void pool_unlock(void) { pthread_mutex_unlock(&pool_mutex); }
+#else
+static void pool_lock(void)   {}
+static void pool_unlock(void) {}
+#endif
+
+static void pool_account(struct packet_pool *pool, int64_t bytes)
+{
+    pool->bytes += bytes;
+    if (pool->bytes > pool->peak_bytes)
+        pool->peak_bytes = pool->bytes;
+}
+
+static struct demux_packet *pool_get_packet(struct packet_pool *pool)
+{
+    struct demux_packet *dp = pool->free_packets;
+    if (dp)
+        pool->hits++;
+    else {
+        struct packet_slab *slab = malloc(sizeof(struct packet_slab));
+        if (!slab) {
+            mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
+            abort();
+        }
+        pool->misses++;
+        pool_account(pool, sizeof(struct packet_slab));
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        for (int i = PACKET_SLAB_SIZE - 1; i >= 0; i--) {
+            slab->packets[i].next = dp;
+            dp = &slab->packets[i];
+        }
+    }
+    pool->free_packets = dp->next;
+    pool->live_packets++;
+    return dp;
+}
+
+/// \return size class for a buffer of size bytes, -1 if too large
+static int pool_buffer_class(size_t size)
+{
+    for (int c = 0; c < POOL_CLASSES; c++)
+        if (size <= (size_t)1 << (c + POOL_MIN_SHIFT))
+            return c;
+    return -1;
+}
+
+static void *pool_get_buffer(struct packet_pool *pool, int c, size_t size)
+{
+    void *buf = c < 0 ? NULL : pool->free_buffers[c];
+    if (buf) {
+        pool->hits++;
+        pool->free_buffers[c] = *(void **)buf;
+        pool->cached_bytes -= 1 << (c + POOL_MIN_SHIFT);
+        return buf;
+    }
+    pool->misses++;
+    if (c < 0)
+        return malloc(size);
+    buf = malloc(1 << (c + POOL_MIN_SHIFT));
+    if (buf)
+        pool_account(pool, 1 << (c + POOL_MIN_SHIFT));
+    return buf;
+}
+
+static void pool_put_buffer(struct packet_pool *pool, void *buf, int c)
+{
+    if (c < 0) {
+        free(buf);
+        return;
+    }
+    int size = 1 << (c + POOL_MIN_SHIFT);
+    if (pool->cached_bytes + size > POOL_MAX_CACHED) {
+        free(buf);
+        pool->bytes -= size;
+        return;
+    }
+    *(void **)buf = pool->free_buffers[c];
+    pool->free_buffers[c] = buf;
+    pool->cached_bytes += size;
+}
+
+/// Free all pooled memory if no demuxer or packet uses it anymore.
+static void pool_release(struct packet_pool *pool)
+{
+    if (pool->demuxers || pool->live_packets || !pool->bytes)
+        return;
+    mp_msg(MSGT_DEMUXER, MSGL_V, "DEMUXER: packet pool: %u hits, %u misses, "
+           "peak %"PRId64" KB\n", pool->hits, pool->misses,
+           pool->peak_bytes / 1024);
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        while (pool->free_buffers[c]) {
+            void *buf = pool->free_buffers[c];
+            pool->free_buffers[c] = *(void **)buf;
+            free(buf);
+        }
+    }
+    while (pool->slabs) {
+        struct packet_slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab);
+    }
+    *pool = (struct packet_pool){0};
+}
+
+static void pool_put_packet(struct packet_pool *pool, struct demux_packet *dp)
+{
+    dp->next = pool->free_packets;
+    pool->free_packets = dp;
+    pool->live_packets--;
+    pool_release(pool);
+}
+
 static struct demux_packet *create_packet(size_t len)
 {
     if (len > 1000000000) {
@@ -178,7 +334,9 @@ static struct demux_packet *create_packet(size_t len)
                "over 1 GB!\n");
         abort();
     }
-    struct demux_packet *dp = malloc(sizeof(struct demux_packet));
+    pool_lock();
+    struct demux_packet *dp = pool_get_packet(&packet_pool);
+    pool_unlock();
     dp->len = len;
     dp->next = NULL;
     dp->pts = MP_NOPTS_VALUE;
@@ -189,14 +347,20 @@ static struct demux_packet *create_packet(size_t len)
     dp->refcount = 1;
     dp->master = NULL;
     dp->buffer = NULL;
+    dp->buffer_class = -1;
     dp->avpacket = NULL;
+    dp->mapping = NULL;
     return dp;
 }
 
 struct demux_packet *new_demux_packet(size_t len)
 {
     struct demux_packet *dp = create_packet(len);
-    dp->buffer = malloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
+    dp->buffer_class = pool_buffer_class(len + MP_INPUT_BUFFER_PADDING_SIZE);
+    pool_lock();
+    dp->buffer = pool_get_buffer(&packet_pool, dp->buffer_class,
+                                 len + MP_INPUT_BUFFER_PADDING_SIZE);
+    pool_unlock();
     if (!dp->buffer) {
         mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
         abort();
@@ -213,6 +377,27 @@ struct demux_packet *new_demux_packet_fromdata(void *data, size_t len)
     return dp;
 }
 
+/* Create a packet referencing data inside a file mapping instead of copying
+ * it. There must be at least MP_INPUT_BUFFER_PADDING_SIZE mapped bytes after
+ * the data. Those bytes belong to whatever follows in the file and can't be
+ * cleared, so the data is copied unless they are already zero as
+ * new_demux_packet() would set them. */
+struct demux_packet *new_demux_packet_frommap(struct stream_mapping *m,
+                                              void *data, size_t len)
+{
+    static const uint8_t zero[8];
+    if (memcmp((uint8_t *)data + len, zero, sizeof(zero))) {
+        struct demux_packet *dp = new_demux_packet(len);
+        memcpy(dp->buffer, data, len);
+        return dp;
+    }
+    struct demux_packet *dp = create_packet(len);
+    dp->buffer = data;
+    dp->mapping = m;
+    stream_mapping_ref(m);
+    return dp;
+}
+
 void resize_demux_packet(struct demux_packet *dp, size_t len)
 {
     if (len > 1000000000) {
@@ -220,7 +405,24 @@ void resize_demux_packet(struct demux_packet *dp, size_t len)
                "over 1 GB!\n");
         abort();
     }
-    dp->buffer = realloc(dp->buffer, len + MP_INPUT_BUFFER_PADDING_SIZE);
+    size_t size = len + MP_INPUT_BUFFER_PADDING_SIZE;
+    int c = pool_buffer_class(size);
+    if (dp->avpacket || (c < 0 && dp->buffer_class < 0 && !dp->mapping))
+        dp->buffer = realloc(dp->buffer, size);
+    else if (dp->mapping || c != dp->buffer_class) {
+        pool_lock();
+        unsigned char *buffer = pool_get_buffer(&packet_pool, c, size);
+        if (buffer && dp->buffer)
+            memcpy(buffer, dp->buffer, FFMIN(len, dp->len));
+        if (dp->mapping) {
+            stream_mapping_unref(dp->mapping);
+            dp->mapping = NULL;
+        } else
+            pool_put_buffer(&packet_pool, dp->buffer, dp->buffer_class);
+        pool_unlock();
+        dp->buffer = buffer;
+        dp->buffer_class = c;
+    }
     if (!dp->buffer) {
         mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
         abort();
@@ -231,7 +433,8 @@ void resize_demux_packet(struct demux_packet *dp, size_t len)
 
 struct demux_packet *clone_demux_packet(struct demux_packet *pack)
 {
-    struct demux_packet *dp = malloc(sizeof(struct demux_packet));
+    pool_lock();
+    struct demux_packet *dp = pool_get_packet(&packet_pool);
     while (pack->master)
         pack = pack->master;  // find the master
     memcpy(dp, pack, sizeof(struct demux_packet));
@@ -239,25 +442,35 @@ struct demux_packet *clone_demux_packet(struct demux_packet *pack)
     dp->refcount = 0;
     dp->master = pack;
     pack->refcount++;
+    pool_unlock();
     return dp;
 }
 
-void free_demux_packet(struct demux_packet *dp)
+static void release_packet(struct demux_packet *dp)
 {
     if (dp->master == NULL) {  //dp is a master packet
         dp->refcount--;
         if (dp->refcount == 0) {
             if (dp->avpacket)
                 talloc_free(dp->avpacket);
+            else if (dp->mapping)
+                stream_mapping_unref(dp->mapping);
             else
-                free(dp->buffer);
-            free(dp);
+                pool_put_buffer(&packet_pool, dp->buffer, dp->buffer_class);
+            pool_put_packet(&packet_pool, dp);
         }
         return;
     }
     // dp is a clone:
-    free_demux_packet(dp->master);
-    free(dp);
+    release_packet(dp->master);
+    pool_put_packet(&packet_pool, dp);
+}
+
+void free_demux_packet(struct demux_packet *dp)
+{
+    pool_lock();
+    release_packet(dp);
+    pool_unlock();
 }
 
 static void free_demuxer_stream(struct demux_stream *ds)
@@ -273,6 +486,8 @@ static struct demux_stream *new_demuxer_stream(struct demuxer *demuxer, int id)
         .id = id,
         .demuxer = demuxer,
         .asf_seq = -1,
+        .queue_start_pts = MP_NOPTS_VALUE,
+        .queue_end_pts = MP_NOPTS_VALUE,
     };
     return ds;
 }
@@ -313,6 +528,9 @@ demuxer_t *new_demuxer(struct MPOpts *opts, stream_t *stream, int type,
     d->sub = new_demuxer_stream(d, s_id);
     d->type = type;
     d->opts = opts;
+    pool_lock();
+    packet_pool.demuxers++;
+    pool_unlock();
     if (type)
         if (!(d->desc = get_demuxer_desc_from_type(type)))
             mp_msg(MSGT_DEMUXER, MSGL_ERR,
@@ -444,11 +662,322 @@ void free_sh_video(sh_video_t *sh)
     talloc_free(sh);
 }
 
+static void queue_account(int bytes)
+{
+    pool_lock();
+    packet_pool.queued_bytes += bytes;
+    if (packet_pool.queued_bytes > packet_pool.peak_queued_bytes)
+        packet_pool.peak_queued_bytes = packet_pool.queued_bytes;
+    pool_unlock();
+}
+
+/// \return seconds of data queued in ds, -1 if the packets have no pts
+static double ds_buffered_duration(struct demux_stream *ds)
+{
+    if (!ds->packs)
+        return 0;
+    if (ds->queue_start_pts == MP_NOPTS_VALUE
+        || ds->queue_end_pts == MP_NOPTS_VALUE)
+        return -1;
+    double duration = ds->queue_end_pts - ds->queue_start_pts;
+    // timestamp discontinuity, the duration is meaningless
+    return duration >= 0 ? duration : -1;
+}
+
+/// \return true if ds holds as much data as the queue limits allow
+static bool ds_queue_full(struct demux_stream *ds)
+{
+    struct MPOpts *opts = ds->demuxer->opts;
+    double duration = ds_buffered_duration(ds);
+    // wrong timestamps must not let a single stream grow without bound
+    if (ds->bytes >= MAX_PACK_BYTES)
+        return true;
+    if (duration >= 0)
+        return duration >= opts->demuxer_max_seconds;
+    // no timestamps to go by
+    return ds->packs >= MAX_PACKS;
+}
+
+#define MaybeNI _("Maybe you are playing a non-interleaved stream/file or the codec failed?\n" \
+                "For AVI files, try to force non-interleaved mode with the -ni option.\n")
+
+/// \return true (and complain) if no more packets may be demuxed
+static bool check_queue_limits(struct demuxer *demux)
+{
+    if (ds_queue_full(demux->audio)) {
+        mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many audio packets in the buffer: (%d in %d bytes).\n",
+               demux->audio->packs, demux->audio->bytes);
+    } else if (ds_queue_full(demux->video)) {
+        mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many video packets in the buffer: (%d in %d bytes).\n",
+               demux->video->packs, demux->video->bytes);
+    } else
+        return false;
+    mp_tmsg(MSGT_DEMUXER, MSGL_HINT, MaybeNI);
+    return true;
+}
+
+#ifdef HAVE_PTHREADS
+/* With -demuxer-thread, a separate thread calls demux_fill_buffer() to keep
+ * the audio and video packet queues filled, and the player only takes
+ * packets from the queues. Everything else touching demuxer internals
+ * (seeks, stream switches, demux_control()) parks the thread first with
+ * demux_pause(), so it is serialized with demuxing just as before. */
+struct demux_thread {
+    pthread_t thread;
+    pthread_mutex_t mutex;   // protects the packet lists and the fields below
+    pthread_cond_t wakeup;   // wakes the demuxer thread
+    pthread_cond_t done;     // signaled after each demux_fill_buffer()
+    int readahead;           // bytes to queue per stream
+    int pause;               // number of demux_pause() calls in effect
+    pthread_t pauser;        // thread that called demux_pause()
+    pthread_t player;        // thread that started the demuxer thread
+    bool busy;               // inside demux_fill_buffer()
+    bool eof;
+    bool quit;
+    int interrupt;           // makes blocking stream reads give up
+    struct demux_stream *wanted; // empty stream the player is waiting for
+};
+
+static bool is_demux_thread(struct demux_thread *t)
+{
+    return pthread_equal(pthread_self(), t->thread);
+}
+
+static void demux_lock(struct demuxer *demuxer)
+{
+    if (demuxer->thread)
+        pthread_mutex_lock(&demuxer->thread->mutex);
+}
+
+static void demux_unlock(struct demuxer *demuxer)
+{
+    if (demuxer->thread)
+        pthread_mutex_unlock(&demuxer->thread->mutex);
+}
+
+/// \return the thread to wait for when ds is empty, NULL to demux directly
+static struct demux_thread *reader_thread(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t || is_demux_thread(t))
+        return NULL;
+    // other threads (-decode-thread) wait until the pause is over
+    if (t->pause && pthread_equal(pthread_self(), t->pauser))
+        return NULL;
+    return t;
+}
+
+static bool queue_memory_full(struct MPOpts *opts)
+{
+    pool_lock();
+    bool full = packet_pool.queued_bytes >= opts->demuxer_max_kbytes * 1024LL;
+    pool_unlock();
+    return full;
+}
+
+/// Select the stream to demux for next, NULL if there is nothing to do.
+static struct demux_stream *thread_pick_stream(struct demuxer *demuxer,
+                                               struct demux_thread *t)
+{
+    struct demux_stream *streams[] = {demuxer->video, demuxer->audio};
+    struct demux_stream *ds = NULL;
+    // same limits as check_queue_limits()
+    if (t->pause || t->eof
+        || ds_queue_full(demuxer->audio) || ds_queue_full(demuxer->video))
+        return NULL;
+    if (t->wanted && !t->wanted->packs)
+        return t->wanted;
+    t->wanted = NULL;
+    // the memory limit only stops reading ahead, subtitle packets are not
+    // bounded otherwise
+    if (queue_memory_full(demuxer->opts))
+        return NULL;
+    for (int i = 0; i < 2; i++) {
+        struct demux_stream *s = streams[i];
+        if (s->sh && s->id != -2 && s->bytes < t->readahead
+            && (!ds || s->bytes < ds->bytes))
+            ds = s;
+    }
+    return ds;
+}
+
+static void *demux_thread(void *arg)
+{
+    struct demuxer *demuxer = arg;
+    struct demux_thread *t = demuxer->thread;
+    stream_set_thread_interrupt(&t->interrupt);
+    pthread_mutex_lock(&t->mutex);
+    while (!t->quit) {
+        struct demux_stream *ds = thread_pick_stream(demuxer, t);
+        if (!ds) {
+            pthread_cond_wait(&t->wakeup, &t->mutex);
+            continue;
+        }
+        t->busy = true;
+        pthread_mutex_unlock(&t->mutex);
+        int res = demux_fill_buffer(demuxer, ds);
+        pthread_mutex_lock(&t->mutex);
+        t->busy = false;
+        if (!res)
+            t->eof = true;
+        pthread_cond_broadcast(&t->done);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return NULL;
+}
+
+#define THREAD_WAIT_TIME 50 // ms
+
+/**
+ * Wait on cond for at most THREAD_WAIT_TIME. Called with the lock held.
+ * The thread may be stuck in a stream read, so the player checks for
+ * commands that abort playback while it waits, and makes the read give up.
+ * \return true if playback is aborted
+ */
+static bool thread_timed_wait(struct demux_thread *t, pthread_cond_t *cond)
+{
+    struct timeval now;
+    struct timespec timeout;
+    gettimeofday(&now, NULL);
+    timeout.tv_sec = now.tv_sec;
+    timeout.tv_nsec = (now.tv_usec + THREAD_WAIT_TIME * 1000) * 1000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+    if (pthread_cond_timedwait(cond, &t->mutex, &timeout) != ETIMEDOUT
+        || !pthread_equal(pthread_self(), t->player))
+        return t->interrupt;
+    pthread_mutex_unlock(&t->mutex);
+    int abort = stream_check_interrupt(0);
+    pthread_mutex_lock(&t->mutex);
+    if (abort)
+        t->interrupt = 1;
+    return t->interrupt;
+}
+
+/**
+ * Wait until the demuxer thread added packets. Called with the lock held.
+ * \return false on EOF or if playback is aborted
+ */
+static bool thread_wait_packets(struct demux_thread *t, struct demux_stream *ds)
+{
+    if (t->eof)
+        return false;
+    t->wanted = ds;
+    pthread_cond_signal(&t->wakeup);
+    return !thread_timed_wait(t, &t->done);
+}
+
+void demux_start_thread(struct demuxer *demuxer)
+{
+    struct MPOpts *opts = demuxer->opts;
+    if (!opts->demuxer_thread || demuxer->thread)
+        return;
+    // stream_control() calls from the player are not serialized with
+    // reads, so only allow streams that do not depend on them
+    if (demuxer->type == DEMUXER_TYPE_DEMUXERS
+        || (demuxer->stream->type != STREAMTYPE_FILE
+            && demuxer->stream->type != STREAMTYPE_STREAM)) {
+        mp_msg(MSGT_DEMUXER, MSGL_V, "DEMUXER: not using a demuxer thread "
+               "for this stream\n");
+        return;
+    }
+    struct demux_thread *t = talloc_zero(demuxer, struct demux_thread);
+    t->readahead = opts->demuxer_readahead * 1024;
+    t->player = pthread_self();
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->wakeup, NULL);
+    pthread_cond_init(&t->done, NULL);
+    demuxer->thread = t;
+    if (pthread_create(&t->thread, NULL, demux_thread, demuxer)) {
+        mp_msg(MSGT_DEMUXER, MSGL_ERR, "Starting demuxer thread failed.\n");
+        demuxer->thread = NULL;
+        pthread_mutex_destroy(&t->mutex);
+        pthread_cond_destroy(&t->wakeup);
+        pthread_cond_destroy(&t->done);
+        talloc_free(t);
+        return;
+    }
+    mp_msg(MSGT_DEMUXER, MSGL_V, "DEMUXER: started demuxer thread\n");
+}
+
+static void demux_stop_thread(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->mutex);
+    t->quit = true;
+    t->interrupt = 1;
+    pthread_cond_signal(&t->wakeup);
+    pthread_mutex_unlock(&t->mutex);
+    pthread_join(t->thread, NULL);
+    demuxer->thread = NULL;
+    pthread_mutex_destroy(&t->mutex);
+    pthread_cond_destroy(&t->wakeup);
+    pthread_cond_destroy(&t->done);
+    talloc_free(t);
+}
+
+void demux_pause(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t || is_demux_thread(t))
+        return;
+    pthread_mutex_lock(&t->mutex);
+    if (!t->pause++)
+        t->pauser = pthread_self();
+    // an aborted read returns soon, so keep waiting after an interrupt
+    while (t->busy)
+        thread_timed_wait(t, &t->done);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+void demux_unpause(struct demuxer *demuxer)
+{
+    struct demux_thread *t = demuxer->thread;
+    if (!t || is_demux_thread(t))
+        return;
+    pthread_mutex_lock(&t->mutex);
+    if (!--t->pause) {
+        // a seek or stream switch may have made more data available
+        t->eof = false;
+        pthread_cond_signal(&t->wakeup);
+    }
+    pthread_mutex_unlock(&t->mutex);
+}
+#else
+struct demux_thread;
+static void demux_lock(struct demuxer *demuxer) {}
+static void demux_unlock(struct demuxer *demuxer) {}
+static struct demux_thread *reader_thread(struct demuxer *demuxer)
+{
+    return NULL;
+}
+static bool thread_wait_packets(struct demux_thread *t, struct demux_stream *ds)
+{
+    return false;
+}
+
+void demux_start_thread(struct demuxer *demuxer)
+{
+    if (demuxer->opts->demuxer_thread)
+        mp_msg(MSGT_DEMUXER, MSGL_WARN, "Compiled without pthreads, "
+               "-demuxer-thread is not available.\n");
+}
+
+static void demux_stop_thread(struct demuxer *demuxer) {}
+void demux_pause(struct demuxer *demuxer) {}
+void demux_unpause(struct demuxer *demuxer) {}
+#endif
+
 void free_demuxer(demuxer_t *demuxer)
 {
     int i;
     mp_msg(MSGT_DEMUXER, MSGL_DBG2, "DEMUXER: freeing %s demuxer at %p\n",
            demuxer->desc->shortdesc, demuxer);
+    demux_stop_thread(demuxer);
     if (demuxer->desc->close)
         demuxer->desc->close(demuxer);
     // Very ugly hack to make it behave like old implementation
@@ -473,11 +1002,25 @@ void free_demuxer(demuxer_t *demuxer)
     if (demuxer->teletext)
         teletext_control(demuxer->teletext, TV_VBI_CONTROL_STOP, NULL);
     talloc_free(demuxer);
+    pool_lock();
+    packet_pool.demuxers--;
+    pool_release(&packet_pool);
+    pool_unlock();
 }
 
 
 void ds_add_packet(demux_stream_t *ds, demux_packet_t *dp)
 {
+    struct demuxer *demuxer = ds->demuxer;
+    demux_lock(demuxer);
+    if (dp->pts != MP_NOPTS_VALUE) {
+        double end = dp->pts + FFMAX(dp->duration, 0);
+        if (!ds->packs || ds->queue_start_pts == MP_NOPTS_VALUE)
+            ds->queue_start_pts = dp->pts;
+        if (!ds->packs || ds->queue_end_pts == MP_NOPTS_VALUE
+            || end > ds->queue_end_pts)
+            ds->queue_end_pts = end;
+    }
     // append packet to DS stream:
     ++ds->packs;
     ds->bytes += dp->len;
@@ -489,6 +1032,11 @@ void ds_add_packet(demux_stream_t *ds, demux_packet_t *dp)
         // first packet in stream
         ds->first = ds->last = dp;
     }
+    double duration = ds_buffered_duration(ds);
+    if (duration > demuxer->queue_peak_duration)
+        demuxer->queue_peak_duration = duration;
+    demux_unlock(demuxer);
+    queue_account(dp->len);
     mp_dbg(MSGT_DEMUXER, MSGL_DBG2,
            "DEMUX: Append packet to %s, len=%d  pts=%5.3f  pos=%u  [packs: A=%d V=%d]\n",
            (ds == ds->demuxer->audio) ? "d_audio" : "d_video", dp->len,
@@ -601,9 +1149,21 @@ void ds_clear_parser(demux_stream_t *ds)
 void ds_read_packet(demux_stream_t *ds, stream_t *stream, int len,
                     double pts, off_t pos, int flags)
 {
-    demux_packet_t *dp = new_demux_packet(len);
-    len = stream_read(stream, dp->buffer, len);
-    resize_demux_packet(dp, len);
+    demux_packet_t *dp;
+    unsigned char *data = NULL;
+    // Subtitle code may write terminators behind the packet data, so never
+    // let subtitle packets point into the mapping.
+    if (ds != ds->demuxer->sub)
+        data = stream_get_mapped(stream, stream_tell(stream),
+                                 len + MP_INPUT_BUFFER_PADDING_SIZE);
+    if (data) {
+        dp = new_demux_packet_frommap(stream->mapping, data, len);
+        stream_skip(stream, len);
+    } else {
+        dp = new_demux_packet(len);
+        len = stream_read(stream, dp->buffer, len);
+        resize_demux_packet(dp, len);
+    }
     dp->pts = pts;
     dp->pos = pos;
     dp->flags = flags;
@@ -627,12 +1187,14 @@ int demux_fill_buffer(demuxer_t *demux, demux_stream_t *ds)
 int ds_fill_buffer(demux_stream_t *ds)
 {
     demuxer_t *demux = ds->demuxer;
+    struct demux_thread *thread = reader_thread(demux);
     if (ds->current)
         free_demux_packet(ds->current);
     ds->current = NULL;
     mp_dbg(MSGT_DEMUXER, MSGL_DBG3, "ds_fill_buffer (%s) called\n",
            ds == demux->audio ? "d_audio" : ds == demux->video ? "d_video" :
            ds == demux->sub   ? "d_sub"   : "unknown");
+    demux_lock(demux);
     while (1) {
         if (ds->packs) {
             demux_packet_t *p = ds->first;
@@ -653,10 +1215,13 @@ int ds_fill_buffer(demux_stream_t *ds)
             ds->flags = p->flags;
             // unlink packet:
             ds->bytes -= p->len;
+            queue_account(-p->len);
             ds->current = p;
             ds->first = p->next;
             if (!ds->first)
                 ds->last = NULL;
+            else if (ds->first->pts != MP_NOPTS_VALUE)
+                ds->queue_start_pts = ds->first->pts;
             --ds->packs;
             /* The code below can set ds->eof to 1 when another stream runs
              * out of buffer space. That makes sense because in that situation
@@ -666,32 +1231,32 @@ int ds_fill_buffer(demux_stream_t *ds)
              * despite the eof flag then it's better to clear it to avoid
              * weird behavior. */
             ds->eof = 0;
+#ifdef HAVE_PTHREADS
+            // the queue might have dropped below the read-ahead target
+            if (thread)
+                pthread_cond_signal(&thread->wakeup);
+#endif
+            demux_unlock(demux);
             return 1;
         }
 
-#define MaybeNI _("Maybe you are playing a non-interleaved stream/file or the codec failed?\n" \
-                "For AVI files, try to force non-interleaved mode with the -ni option.\n")
-
-        if (demux->audio->packs >= MAX_PACKS
-            || demux->audio->bytes >= MAX_PACK_BYTES) {
-            mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many audio packets in the buffer: (%d in %d bytes).\n",
-                   demux->audio->packs, demux->audio->bytes);
-            mp_tmsg(MSGT_DEMUXER, MSGL_HINT, MaybeNI);
-            break;
-        }
-        if (demux->video->packs >= MAX_PACKS
-            || demux->video->bytes >= MAX_PACK_BYTES) {
-            mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many video packets in the buffer: (%d in %d bytes).\n",
-                   demux->video->packs, demux->video->bytes);
-            mp_tmsg(MSGT_DEMUXER, MSGL_HINT, MaybeNI);
+        if (check_queue_limits(demux))
             break;
+        if (thread) {
+            if (!thread_wait_packets(thread, ds))
+                break; // EOF
+            continue;
         }
-        if (!demux_fill_buffer(demux, ds)) {
+        demux_unlock(demux);
+        int res = demux_fill_buffer(demux, ds);
+        demux_lock(demux);
+        if (!res) {
             mp_dbg(MSGT_DEMUXER, MSGL_DBG2,
                    "ds_fill_buffer()->demux_fill_buffer() failed\n");
             break; // EOF
         }
     }
+    demux_unlock(demux);
     ds->buffer_pos = ds->buffer_size = 0;
     ds->buffer = NULL;
     mp_msg(MSGT_DEMUXER, MSGL_V,
@@ -745,11 +1310,18 @@ int demux_pattern_3(demux_stream_t *ds, unsigned char *mem, int maxlen,
             ds_fill_buffer(ds);
             continue;
         }
-        do {
-            head |= ds_buf[pos];
-            head <<= 8;
-        } while (++pos && head != pat);
-        len += pos;
+        if (pat == 0x100) {
+            // MPEG start code, skip the bytes that cannot be part of one
+            uint32_t state = head >> 8;
+            len = mp_find_start_code(ds_buf + pos, len, &state);
+            head = state << 8;
+        } else {
+            do {
+                head |= ds_buf[pos];
+                head <<= 8;
+            } while (++pos && head != pat);
+            len += pos;
+        }
         if (total_len + len > maxlen)
             len = maxlen - total_len;
         len = demux_read_data(ds, mem ? &mem[total_len] : NULL, len);
@@ -762,6 +1334,7 @@ int demux_pattern_3(demux_stream_t *ds, unsigned char *mem, int maxlen,
 
 void ds_free_packs(demux_stream_t *ds)
 {
+    demux_pause(ds->demuxer);
     demux_packet_t *dp = ds->first;
     while (dp) {
         demux_packet_t *dn = dp->next;
@@ -770,13 +1343,14 @@ void ds_free_packs(demux_stream_t *ds)
     }
     if (ds->asf_packet) {
         // free unfinished .asf fragments:
-        free(ds->asf_packet->buffer);
-        free(ds->asf_packet);
+        free_demux_packet(ds->asf_packet);
         ds->asf_packet = NULL;
     }
+    queue_account(-ds->bytes);
     ds->first = ds->last = NULL;
     ds->packs = 0; // !!!!!
     ds->bytes = 0;
+    ds->queue_start_pts = ds->queue_end_pts = MP_NOPTS_VALUE;
     if (ds->current)
         free_demux_packet(ds->current);
     ds->current = NULL;
@@ -784,6 +1358,7 @@ void ds_free_packs(demux_stream_t *ds)
     ds->buffer_pos = ds->buffer_size;
     ds->pts = MP_NOPTS_VALUE;
     ds->pts_bytes = 0;
+    demux_unpause(ds->demuxer);
 }
 
 int ds_get_packet(demux_stream_t *ds, unsigned char **start)
@@ -844,30 +1419,47 @@ struct demux_packet *ds_get_packet2(struct demux_stream *ds, bool repeat_last)
 double ds_get_next_pts(demux_stream_t *ds)
 {
     demuxer_t *demux = ds->demuxer;
+    struct demux_thread *thread = reader_thread(demux);
+    double pts = MP_NOPTS_VALUE;
+    demux_lock(demux);
     // if we have not read from the "current" packet, consider it
     // as the next, otherwise we never get the pts for the first packet.
     while (!ds->first && (!ds->current || ds->buffer_pos)) {
-        if (demux->audio->packs >= MAX_PACKS
-            || demux->audio->bytes >= MAX_PACK_BYTES) {
-            mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many audio packets in the buffer: (%d in %d bytes).\n",
-                   demux->audio->packs, demux->audio->bytes);
-            mp_tmsg(MSGT_DEMUXER, MSGL_HINT, MaybeNI);
-            return MP_NOPTS_VALUE;
-        }
-        if (demux->video->packs >= MAX_PACKS
-            || demux->video->bytes >= MAX_PACK_BYTES) {
-            mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many video packets in the buffer: (%d in %d bytes).\n",
-                   demux->video->packs, demux->video->bytes);
-            mp_tmsg(MSGT_DEMUXER, MSGL_HINT, MaybeNI);
-            return MP_NOPTS_VALUE;
+        if (check_queue_limits(demux))
+            goto out;
+        if (thread) {
+            if (!thread_wait_packets(thread, ds))
+                goto out;
+            continue;
         }
-        if (!demux_fill_buffer(demux, ds))
-            return MP_NOPTS_VALUE;
+        demux_unlock(demux);
+        int res = demux_fill_buffer(demux, ds);
+        demux_lock(demux);
+        if (!res)
+            goto out;
     }
     // take pts from "current" if we never read from it.
     if (ds->current && !ds->buffer_pos)
-        return ds->current->pts;
-    return ds->first->pts;
+        pts = ds->current->pts;
+    else
+        pts = ds->first->pts;
+ out:
+    demux_unlock(demux);
+    return pts;
+}
+
+void demux_get_queue_state(struct demuxer *demuxer,
+                           struct demux_queue_state *state)
+{
+    pool_lock();
+    state->bytes = packet_pool.queued_bytes;
+    state->peak_bytes = packet_pool.peak_queued_bytes;
+    pool_unlock();
+    demux_lock(demuxer);
+    state->duration = FFMAX(ds_buffered_duration(demuxer->audio),
+                            ds_buffered_duration(demuxer->video));
+    state->peak_duration = demuxer->queue_peak_duration;
+    demux_unlock(demuxer);
 }
 
 // ====================================================================
@@ -929,12 +1521,19 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
 {
     struct demuxer *demuxer;
     int fformat;
+    int probe_size = stream->probe_size;
     demuxer = new_demuxer(opts, stream, desc->type, audio_id,
                           video_id, sub_id, filename);
     demuxer->params = params;
-    if (desc->check_file)
+    if (desc->check_file) {
+        unsigned int start = GetTimer();
+        off_t pos = stream_tell(stream);
         fformat = desc->check_file(demuxer);
-    else
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Probing %s: %s, %.1f ms, "
+               "stream position %"PRId64" -> %"PRId64"\n", desc->name,
+               fformat ? "match" : "no match", (GetTimer() - start) / 1000.0,
+               (int64_t)pos, (int64_t)stream_tell(stream));
+    } else
         fformat = desc->type;
     if (force)
         fformat = desc->type;
@@ -947,11 +1546,14 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
         else
             mp_tmsg(MSGT_DEMUXER, MSGL_INFO, "Detected file format: %s\n",
                     desc->shortdesc);
+        // the detected demuxer reads on from the real stream
+        stream_set_probe(stream, 0);
         if (demuxer->desc->open) {
             struct demuxer *demux2 = demuxer->desc->open(demuxer);
             if (!demux2) {
                 mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "Opening as detected format "
                         "\"%s\" failed.\n", desc->shortdesc);
+                stream_set_probe(stream, probe_size);
                 goto fail;
             }
             /* At least demux_mov can return a demux_demuxers instance
@@ -992,6 +1594,9 @@ static struct demuxer *demux_open_stream(struct MPOpts *opts,
     struct demuxer *demuxer = NULL;
     const struct demuxer_desc *desc;
 
+    // Serve all file checks from one buffered read of the stream start
+    stream_set_probe(stream, opts->demuxer_probesize * 1024);
+
     // If somebody requested a demuxer check it
     if (file_format) {
         desc = get_demuxer_desc_from_type(file_format);
@@ -1002,7 +1607,7 @@ static struct demuxer *demux_open_stream(struct MPOpts *opts,
                                   video_id, sub_id, filename, params);
         if (demuxer)
             goto dmx_open;
-        return NULL;
+        goto fail;
     }
 
     // Test demuxers with safe file checks
@@ -1037,9 +1642,12 @@ static struct demuxer *demux_open_stream(struct MPOpts *opts,
         }
     }
 
+ fail:
+    stream_set_probe(stream, 0);
     return NULL;
 
  dmx_open:
+    stream_set_probe(stream, 0);
 
     if (demuxer->type == DEMUXER_TYPE_PLAYLIST)
         return demuxer;
@@ -1191,8 +1799,8 @@ void demux_flush(demuxer_t *demuxer)
     ds_free_packs(demuxer->sub);
 }
 
-int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
-               int flags)
+static int do_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
+                   int flags)
 {
     if (!demuxer->seekable) {
         if (demuxer->file_format == DEMUXER_TYPE_AVI)
@@ -1250,6 +1858,15 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
     return 1;
 }
 
+int demux_seek(demuxer_t *demuxer, float rel_seek_secs, float audio_delay,
+               int flags)
+{
+    demux_pause(demuxer);
+    int res = do_seek(demuxer, rel_seek_secs, audio_delay, flags);
+    demux_unpause(demuxer);
+    return res;
+}
+
 int demux_info_add(demuxer_t *demuxer, const char *opt, const char *param)
 {
     return demux_info_add_bstr(demuxer, bstr(opt), bstr(param));
@@ -1284,11 +1901,24 @@ int demux_info_add_bstr(demuxer_t *demuxer, struct bstr opt, struct bstr param)
     return 1;
 }
 
+void demux_info_load(demuxer_t *demuxer)
+{
+    if (demuxer->info_loaded)
+        return;
+    demuxer->info_loaded = true;
+    demux_control(demuxer, DEMUXER_CTRL_LOAD_INFO, NULL);
+}
+
 int demux_info_print(demuxer_t *demuxer)
 {
-    char **info = demuxer->info;
+    char **info;
     int n;
 
+    /* Only -identify output is guaranteed to include metadata the demuxer
+     * reads on first use, the normal printout shows what is known now. */
+    if (mp_msg_test(MSGT_IDENTIFY, MSGL_INFO))
+        demux_info_load(demuxer);
+    info = demuxer->info;
     if (!info)
         return 0;
 
@@ -1309,8 +1939,10 @@ int demux_info_print(demuxer_t *demuxer)
 char *demux_info_get(demuxer_t *demuxer, const char *opt)
 {
     int i;
-    char **info = demuxer->info;
+    char **info;
 
+    demux_info_load(demuxer);
+    info = demuxer->info;
     for (i = 0; info && info[2 * i] != NULL; i++) {
         if (!strcasecmp(opt, info[2 * i]))
             return info[2 * i + 1];
@@ -1321,48 +1953,55 @@ char *demux_info_get(demuxer_t *demuxer, const char *opt)
 
 int demux_control(demuxer_t *demuxer, int cmd, void *arg)
 {
+    int res = DEMUXER_CTRL_NOTIMPL;
 
-    if (demuxer->desc->control)
-        return demuxer->desc->control(demuxer, cmd, arg);
+    if (demuxer->desc->control) {
+        demux_pause(demuxer);
+        res = demuxer->desc->control(demuxer, cmd, arg);
+        demux_unpause(demuxer);
+    }
 
-    return DEMUXER_CTRL_NOTIMPL;
+    return res;
 }
 
 int demuxer_switch_audio(demuxer_t *demuxer, int index)
 {
+    demux_pause(demuxer);
     int res = demux_control(demuxer, DEMUXER_CTRL_SWITCH_AUDIO, &index);
     if (res == DEMUXER_CTRL_NOTIMPL) {
         struct sh_audio *sh_audio = demuxer->audio->sh;
-        return sh_audio ? sh_audio->aid : -2;
-    }
-    if (demuxer->audio->id >= 0) {
+        index = sh_audio ? sh_audio->aid : -2;
+    } else if (demuxer->audio->id >= 0) {
         struct sh_audio *sh_audio = demuxer->a_streams[demuxer->audio->id];
         demuxer->audio->sh = sh_audio;
         index = sh_audio->aid; // internal MPEG demuxers don't set it right
     }
     else
         demuxer->audio->sh = NULL;
+    demux_unpause(demuxer);
     return index;
 }
 
 int demuxer_switch_video(demuxer_t *demuxer, int index)
 {
+    demux_pause(demuxer);
     int res = demux_control(demuxer, DEMUXER_CTRL_SWITCH_VIDEO, &index);
     if (res == DEMUXER_CTRL_NOTIMPL) {
         struct sh_video *sh_video = demuxer->video->sh;
-        return sh_video ? sh_video->vid : -2;
-    }
-    if (demuxer->video->id >= 0) {
+        index = sh_video ? sh_video->vid : -2;
+    } else if (demuxer->video->id >= 0) {
         struct sh_video *sh_video = demuxer->v_streams[demuxer->video->id];
         demuxer->video->sh = sh_video;
         index = sh_video->vid; // internal MPEG demuxers don't set it right
     } else
         demuxer->video->sh = NULL;
+    demux_unpause(demuxer);
     return index;
 }
 
-int demuxer_add_attachment(demuxer_t *demuxer, struct bstr name,
-                           struct bstr type, struct bstr data)
+static struct demux_attachment *new_attachment(demuxer_t *demuxer,
+                                               struct bstr name,
+                                               struct bstr type)
 {
     if (!(demuxer->num_attachments % 32))
         demuxer->attachments = talloc_realloc(demuxer, demuxer->attachments,
@@ -1373,6 +2012,16 @@ int demuxer_add_attachment(demuxer_t *demuxer, struct bstr name,
         demuxer->attachments + demuxer->num_attachments;
     att->name = talloc_strndup(demuxer->attachments, name.start, name.len);
     att->type = talloc_strndup(demuxer->attachments, type.start, type.len);
+    att->data = NULL;
+    att->data_size = 0;
+    att->data_pos = 0;
+    return att;
+}
+
+int demuxer_add_attachment(demuxer_t *demuxer, struct bstr name,
+                           struct bstr type, struct bstr data)
+{
+    struct demux_attachment *att = new_attachment(demuxer, name, type);
     att->data = talloc_size(demuxer->attachments, data.len);
     memcpy(att->data, data.start, data.len);
     att->data_size = data.len;
@@ -1380,6 +2029,44 @@ int demuxer_add_attachment(demuxer_t *demuxer, struct bstr name,
     return demuxer->num_attachments++;
 }
 
+int demuxer_add_attachment_at(demuxer_t *demuxer, struct bstr name,
+                              struct bstr type, off_t pos, unsigned int size)
+{
+    struct demux_attachment *att = new_attachment(demuxer, name, type);
+    att->data_pos = pos;
+    att->data_size = size;
+
+    return demuxer->num_attachments++;
+}
+
+void *demuxer_attachment_data(demuxer_t *demuxer, struct demux_attachment *att)
+{
+    if (att->data || !att->data_pos)
+        return att->data;
+
+    stream_t *s = demuxer->stream;
+    demux_pause(demuxer);
+    off_t oldpos = stream_tell(s);
+    void *data = talloc_size(demuxer->attachments, att->data_size);
+    if (stream_seek(s, att->data_pos)
+        && stream_read(s, data, att->data_size) == (int)att->data_size) {
+        att->data = data;
+    } else {
+        mp_msg(MSGT_DEMUX, MSGL_WARN, "Couldn't read attachment %s\n",
+               att->name);
+        talloc_free(data);
+    }
+    stream_seek(s, oldpos);
+    demux_unpause(demuxer);
+    return att->data;
+}
+
+void demuxer_attachment_free_data(struct demux_attachment *att)
+{
+    talloc_free(att->data);
+    att->data = NULL;
+}
+
 int demuxer_add_chapter(demuxer_t *demuxer, struct bstr name,
                         uint64_t start, uint64_t end)
 {
@@ -1411,12 +2098,14 @@ int demuxer_seek_chapter(demuxer_t *demuxer, int chapter, double *seek_pts)
     int ris;
 
     if (!demuxer->num_chapters || !demuxer->chapters) {
+        demux_pause(demuxer);
         demux_flush(demuxer);
 
         ris = stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_CHAPTER,
                              &chapter);
         if (ris != STREAM_UNSUPPORTED)
             demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+        demux_unpause(demuxer);
 
         // exit status may be ok, but main() doesn't have to seek itself
         // (because e.g. dvds depend on sectors, not on pts)
@@ -1513,15 +2202,15 @@ int demuxer_set_angle(demuxer_t *demuxer, int angle)
     if ((angles < 1) || (angle > angles))
         return -1;
 
+    demux_pause(demuxer);
     demux_flush(demuxer);
 
     ris = stream_control(demuxer->stream, STREAM_CTRL_SET_ANGLE, &angle);
-    if (ris == STREAM_UNSUPPORTED)
-        return -1;
-
-    demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+    if (ris != STREAM_UNSUPPORTED)
+        demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+    demux_unpause(demuxer);
 
-    return angle;
+    return ris == STREAM_UNSUPPORTED ? -1 : angle;
 }
 
 int demuxer_audio_track_by_lang_and_default(struct demuxer *d, char **langt)
@@ -116,6 +116,7 @@ enum timestamp_type {
 #define DEMUXER_CTRL_SWITCH_VIDEO 14
 #define DEMUXER_CTRL_IDENTIFY_PROGRAM 15
 #define DEMUXER_CTRL_CORRECT_PTS 16
+#define DEMUXER_CTRL_LOAD_INFO 17
 
 #define SEEK_ABSOLUTE (1 << 0)
 #define SEEK_FACTOR   (1 << 1)
@@ -141,6 +142,8 @@ typedef struct demux_stream {
 //---------------
     int packs;            // number of packets in buffer
     int bytes;            // total bytes of packets in buffer
+    double queue_start_pts; // pts range covered by the queued packets,
+    double queue_end_pts;   // MP_NOPTS_VALUE if unknown
     demux_packet_t *first; // read to current buffer from here
     demux_packet_t *last; // append new packets from input stream to here
     demux_packet_t *current; // needed for refcounting of the buffer
@@ -224,6 +227,7 @@ typedef struct demux_attachment
     char *type;
     void *data;
     unsigned int data_size;
+    off_t data_pos; // stream position of the data, 0 if only in memory
 } demux_attachment_t;
 
 struct demuxer_params {
@@ -279,10 +283,20 @@ typedef struct demuxer {
 
     void *priv;   // demuxer-specific internal data
     char **info;  // metadata
+    bool info_loaded; // DEMUXER_CTRL_LOAD_INFO was sent
     struct MPOpts *opts;
     struct demuxer_params *params;
+    struct demux_thread *thread; // read-ahead thread, NULL if not used
+    double queue_peak_duration; // longest queued duration of a stream so far
 } demuxer_t;
 
+struct demux_queue_state {
+    int64_t bytes;          // queued by all demuxers
+    int64_t peak_bytes;
+    double duration;        // longest audio/video queue of this demuxer
+    double peak_duration;
+};
+
 typedef struct {
     int progid;      //program id
     int aid, vid, sid; //audio, video and subtitle id
@@ -291,6 +305,9 @@ typedef struct {
 struct demux_packet *new_demux_packet(size_t len);
 // data must already have suitable padding
 struct demux_packet *new_demux_packet_fromdata(void *data, size_t len);
+struct stream_mapping;
+struct demux_packet *new_demux_packet_frommap(struct stream_mapping *m,
+                                              void *data, size_t len);
 void resize_demux_packet(struct demux_packet *dp, size_t len);
 struct demux_packet *clone_demux_packet(struct demux_packet *pack);
 void free_demux_packet(struct demux_packet *dp);
@@ -370,12 +387,24 @@ struct demuxer *demux_open_withparams(struct MPOpts *opts,
         struct stream *stream, int file_format, int aid, int vid, int sid,
         char *filename, struct demuxer_params *params);
 
+/// Read only the Matroska headers up to the segment UID.
+/// \return 1 if found, 0 if the file has none, -1 if it can't be read
+int demux_mkv_read_segment_uid(struct stream *s, unsigned char uid[16]);
+
 void demux_flush(struct demuxer *demuxer);
 int demux_seek(struct demuxer *demuxer, float rel_seek_secs, float audio_delay,
                int flags);
 struct demuxer *new_demuxers_demuxer(struct demuxer *vd, struct demuxer *ad,
                                      struct demuxer *sd);
 
+/// Start filling the packet queues from a separate thread (-demuxer-thread)
+void demux_start_thread(struct demuxer *demuxer);
+/// Stop the demuxer thread from touching the demuxer until demux_unpause()
+void demux_pause(struct demuxer *demuxer);
+void demux_unpause(struct demuxer *demuxer);
+void demux_get_queue_state(struct demuxer *demuxer,
+                           struct demux_queue_state *state);
+
 // AVI demuxer params:
 extern int index_mode;  // -1=untouched  0=don't use index  1=use (generate) index
 extern char *index_file_save, *index_file_load;
@@ -386,6 +415,8 @@ int demux_info_add(struct demuxer *demuxer, const char *opt, const char *param);
 int demux_info_add_bstr(struct demuxer *demuxer, struct bstr opt,
                         struct bstr param);
 char *demux_info_get(struct demuxer *demuxer, const char *opt);
+/// Make the demuxer read metadata it skipped when opening the file.
+void demux_info_load(struct demuxer *demuxer);
 int demux_info_print(struct demuxer *demuxer);
 int demux_control(struct demuxer *demuxer, int cmd, void *arg);
 
@@ -398,6 +429,14 @@ void demuxer_help(void);
 
 int demuxer_add_attachment(struct demuxer *demuxer, struct bstr name,
                            struct bstr type, struct bstr data);
+/// Add an attachment whose data is read from the stream on first use.
+int demuxer_add_attachment_at(struct demuxer *demuxer, struct bstr name,
+                              struct bstr type, off_t pos, unsigned int size);
+/// Return attachment data, reading it from the stream if necessary.
+void *demuxer_attachment_data(struct demuxer *demuxer,
+                              struct demux_attachment *att);
+/// Free the attachment data. Data read from the stream can be read again.
+void demuxer_attachment_free_data(struct demux_attachment *att);
 int demuxer_add_chapter(struct demuxer *demuxer, struct bstr name,
                         uint64_t start, uint64_t end);
 int demuxer_seek_chapter(struct demuxer *demuxer, int chapter,
@@ -41,6 +41,19 @@
 #define SIZE_MAX ((size_t)-1)
 #endif
 
+/*
+ * Consume the next len bytes directly from the stream buffer.
+ * Return: pointer to them, or NULL (nothing consumed) if the stream
+ * ends before; the caller then falls back to reading byte by byte.
+ */
+static uint8_t *ebml_get_bytes(stream_t *s, int len)
+{
+    uint8_t *p = stream_peek(s, len);
+    if (p)
+        s->buf_pos += len;
+    return p;
+}
+
 /*
  * Read: the element content data ID.
  * Return: the ID.
@@ -49,6 +62,7 @@ uint32_t ebml_read_id(stream_t *s, int *length)
 {
     int i, len_mask = 0x80;
     uint32_t id;
+    uint8_t *p;
 
     for (i = 0, id = stream_read_char(s); i < 4 && !(id & len_mask); i++)
         len_mask >>= 1;
@@ -56,8 +70,9 @@ uint32_t ebml_read_id(stream_t *s, int *length)
         return EBML_ID_INVALID;
     if (length)
         *length = i + 1;
+    p = ebml_get_bytes(s, i);
     while (i--)
-        id = (id << 8) | stream_read_char(s);
+        id = (id << 8) | (p ? *p++ : stream_read_char(s));
     return id;
 }
 
@@ -113,6 +128,7 @@ uint64_t ebml_read_length(stream_t *s, int *length)
 {
     int i, j, num_ffs = 0, len_mask = 0x80;
     uint64_t len;
+    uint8_t *p;
 
     for (i = 0, len = stream_read_char(s); i < 8 && !(len & len_mask); i++)
         len_mask >>= 1;
@@ -123,8 +139,9 @@ uint64_t ebml_read_length(stream_t *s, int *length)
         *length = j;
     if ((int) (len &= (len_mask - 1)) == len_mask - 1)
         num_ffs++;
+    p = ebml_get_bytes(s, i);
     while (i--) {
-        len = (len << 8) | stream_read_char(s);
+        len = (len << 8) | (p ? *p++ : stream_read_char(s));
         if ((len & 0xFF) == 0xFF)
             num_ffs++;
     }
@@ -140,6 +157,7 @@ uint64_t ebml_read_uint(stream_t *s, uint64_t *length)
 {
     uint64_t len, value = 0;
     int l;
+    uint8_t *p;
 
     len = ebml_read_length(s, &l);
     if (len == EBML_UINT_INVALID || len < 1 || len > 8)
@@ -147,8 +165,9 @@ uint64_t ebml_read_uint(stream_t *s, uint64_t *length)
     if (length)
         *length = len + l;
 
+    p = ebml_get_bytes(s, len);
     while (len--)
-        value = (value << 8) | stream_read_char(s);
+        value = (value << 8) | (p ? *p++ : stream_read_char(s));
 
     return value;
 }
@@ -161,6 +180,7 @@ int64_t ebml_read_int(stream_t *s, uint64_t *length)
     int64_t value = 0;
     uint64_t len;
     int l;
+    uint8_t *p;
 
     len = ebml_read_length(s, &l);
     if (len == EBML_UINT_INVALID || len < 1 || len > 8)
@@ -168,13 +188,14 @@ int64_t ebml_read_int(stream_t *s, uint64_t *length)
     if (length)
         *length = len + l;
 
+    p = ebml_get_bytes(s, len);
     len--;
-    l = stream_read_char(s);
+    l = p ? *p++ : stream_read_char(s);
     if (l & 0x80)
         value = -1;
     value = (value << 8) | l;
     while (len--)
-        value = (value << 8) | stream_read_char(s);
+        value = (value << 8) | (p ? *p++ : stream_read_char(s));
 
     return value;
 }
@@ -303,7 +324,7 @@ uint32_t ebml_read_master(stream_t *s, uint64_t *length)
 struct generic;
 #define generic_struct struct generic
 
-static uint32_t ebml_parse_id(uint8_t *data, int *length)
+uint32_t ebml_parse_id(uint8_t *data, int *length)
 {
     int len = 1;
     uint32_t id = *data++;
@@ -352,12 +373,12 @@ static uint64_t parse_vlen(uint8_t *data, int *length, bool is_length)
     return r;
 }
 
-static uint64_t ebml_parse_length(uint8_t *data, int *length)
+uint64_t ebml_parse_length(uint8_t *data, int *length)
 {
     return parse_vlen(data, length, true);
 }
 
-static uint64_t ebml_parse_uint(uint8_t *data, int length)
+uint64_t ebml_parse_uint(uint8_t *data, int length)
 {
     assert(length >= 1 && length <= 8);
     uint64_t r = 0;
@@ -366,7 +387,7 @@ static uint64_t ebml_parse_uint(uint8_t *data, int length)
     return r;
 }
 
-static int64_t ebml_parse_sint(uint8_t *data, int length)
+int64_t ebml_parse_sint(uint8_t *data, int length)
 {
     assert(length >=1 && length <= 8);
     int64_t r = 0;
@@ -101,6 +101,13 @@ char *ebml_read_utf8 (stream_t *s, uint64_t *length);
 int ebml_read_skip (stream_t *s, uint64_t *length);
 uint32_t ebml_read_master (stream_t *s, uint64_t *length);
 
+/* Parse data already in memory. The ID and length functions set *length
+ * to -1 on invalid data; the int functions expect 1 to 8 bytes. */
+uint32_t ebml_parse_id(uint8_t *data, int *length);
+uint64_t ebml_parse_length(uint8_t *data, int *length);
+uint64_t ebml_parse_uint(uint8_t *data, int length);
+int64_t ebml_parse_sint(uint8_t *data, int length);
+
 int ebml_read_element(struct stream *s, struct ebml_parse_ctx *ctx,
                       void *target, const struct ebml_elem_desc *desc);
 
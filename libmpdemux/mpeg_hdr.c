@@ -26,6 +26,8 @@
 #include "config.h"
 #include "mpeg_hdr.h"
 #include "libavutil/attributes.h"
+#include "libavutil/common.h"
+#include "libavutil/intreadwrite.h"
 #include "mp_msg.h"
 
 static float frameratecode2framerate[16] = {
@@ -537,3 +539,85 @@ int mp_vc1_decode_sequence_header(mp_mpeg_header_t * picture, unsigned char * bu
   //free(dest);
   return 1;
 }
+
+int64_t mp_pes_pts(const unsigned char *buf, int len)
+{
+    const unsigned char *end = buf + len;
+    int id;
+
+    if (len < 9 || buf[0] || buf[1] || buf[2] != 1)
+        return -1;
+    id = buf[3];
+    // only audio, video and private stream 1 packets have timestamps
+    if (id != 0xBD && (id < 0xC0 || id > 0xEF))
+        return -1;
+    buf += 6;
+    if ((buf[0] & 0xC0) == 0x80) { // MPEG-2 PES header
+        if (!(buf[1] & 0x80))
+            return -1;
+        buf += 3;
+    } else { // MPEG-1 packet header
+        while (buf < end && *buf == 0xFF)
+            buf++;
+        if (buf < end && (*buf & 0xC0) == 0x40)
+            buf += 2;
+        if (buf >= end || (*buf & 0xE0) != 0x20)
+            return -1;
+    }
+    if (end - buf < 5 || !(buf[0] & buf[2] & buf[4] & 1))
+        return -1;
+    return ((int64_t)(buf[0] & 0x0E) << 29) | (buf[1] << 22)
+           | ((buf[2] >> 1) << 15) | (buf[3] << 7) | (buf[4] >> 1);
+}
+
+// true if any byte of x is 0 (may also flag a 1 byte above a 0 byte)
+#if HAVE_FAST_64BIT
+#define WORD_SIZE 8
+#define READ_WORD AV_RN64
+#define HAS_ZERO_BYTE(x) \
+    (((x) - 0x0101010101010101ULL) & ~(x) & 0x8080808080808080ULL)
+#else
+#define WORD_SIZE 4
+#define READ_WORD AV_RN32
+#define HAS_ZERO_BYTE(x) (((x) - 0x01010101U) & ~(x) & 0x80808080U)
+#endif
+
+int mp_find_start_code(const unsigned char *buf, int len, uint32_t *state)
+{
+    uint32_t st = *state;
+    int i;
+
+    // start codes overlapping the previous buffer
+    for (i = 0; i < len && i < 3; i++) {
+        st = (st << 8) | buf[i];
+        if ((st & 0xffffff) == 1)
+            goto found;
+    }
+    if (len <= 3) {
+        *state = st & 0xffffff;
+        return len;
+    }
+    // Skip whole words without a zero byte, the first byte of a start
+    // code; check the others byte by byte.
+    for (i = 0; i + WORD_SIZE + 2 < len; i += WORD_SIZE) {
+        if (HAS_ZERO_BYTE(READ_WORD(buf + i))) {
+            for (int j = i; j < i + WORD_SIZE; j++) {
+                if (!buf[j] && !buf[j + 1] && buf[j + 2] == 1) {
+                    i = j + 2;
+                    goto found;
+                }
+            }
+        }
+    }
+    for (i = FFMAX(i, 2); i < len; i++) {
+        if (buf[i] == 1 && !buf[i - 1] && !buf[i - 2])
+            goto found;
+    }
+    *state = buf[len - 3] << 16 | buf[len - 2] << 8 | buf[len - 1];
+    return len;
+
+found:
+    i++;
+    *state = 1;
+    return i;
+}
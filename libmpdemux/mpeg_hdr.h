@@ -19,6 +19,8 @@
 #ifndef MPLAYER_MPEG_HDR_H
 #define MPLAYER_MPEG_HDR_H
 
+#include <stdint.h>
+
 typedef struct {
     // video info:
     int mpeg1; // 0=mpeg2  1=mpeg1
@@ -52,4 +54,14 @@ int mp_vc1_decode_sequence_header(mp_mpeg_header_t * picture, unsigned char * bu
 
 unsigned char mp_getbits(unsigned char *buffer, unsigned int from, unsigned char len);
 
+/// PTS (90 kHz) of the PES packet starting at buf, or -1 if it has none.
+int64_t mp_pes_pts(const unsigned char *buf, int len);
+/**
+ * Find the first 00 00 01 start code in buf. *state holds the last bytes of
+ * the previous buffer (0xffffff initially) and is updated to the last three
+ * bytes scanned, so (*state & 0xffffff) == 1 when a start code was found.
+ * \return number of bytes up to and including the start code, len if none
+ */
+int mp_find_start_code(const unsigned char *buf, int len, uint32_t *state);
+
 #endif /* MPLAYER_MPEG_HDR_H */
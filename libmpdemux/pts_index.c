@@ -0,0 +1,159 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Seeking by bisecting the file on timestamps, for formats without an
+ * index (MPEG-PS, MPEG-TS, Ogg without -idx). Every probed point is kept,
+ * so later seeks start from a narrower interval.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <libavutil/common.h>
+
+#include "mp_msg.h"
+#include "stream/stream.h"
+#include "demuxer.h"
+#include "pts_index.h"
+
+// 33 bit MPEG timestamps wrap around after about 26.5 hours
+#define PTS_WRAP (8589934592.0 / 90000)
+// timestamps may go back this much (B-frames, interleaving) without
+// being treated as a discontinuity
+#define PTS_SLACK 1.0
+#define MAX_PROBES 64
+
+static double unwrap_pts(struct pts_index *index, double pts)
+{
+    if (index->num_entries && pts + 60 < index->entries[0].pts)
+        pts += PTS_WRAP;
+    return pts;
+}
+
+static void add_entry(struct pts_index *index, off_t pos, double pts)
+{
+    int i = index->num_entries;
+    while (i > 0 && index->entries[i - 1].pos >= pos) {
+        if (index->entries[i - 1].pos == pos)
+            return;
+        i--;
+    }
+    if (!(index->num_entries & 31))
+        index->entries = realloc(index->entries, (index->num_entries + 32)
+                                 * sizeof(*index->entries));
+    memmove(index->entries + i + 1, index->entries + i,
+            (index->num_entries - i) * sizeof(*index->entries));
+    index->entries[i].pos = pos;
+    index->entries[i].pts = pts;
+    index->num_entries++;
+}
+
+bool pts_index_init(struct demuxer *demuxer, struct pts_index *index,
+                    pts_reader read_pts)
+{
+    off_t found;
+    double pts;
+
+    if (index->failed)
+        return false;
+    if (index->num_entries >= 2)
+        return true;
+    index->failed = true;
+    if (!demuxer->seekable || demuxer->movi_end <= demuxer->movi_start
+        + 2 * PTS_PROBE_SIZE)
+        return false;
+    pts = read_pts(demuxer, demuxer->movi_start, &found);
+    if (pts == MP_NOPTS_VALUE)
+        return false;
+    add_entry(index, found, pts);
+    pts = read_pts(demuxer, demuxer->movi_end - PTS_PROBE_SIZE, &found);
+    if (pts == MP_NOPTS_VALUE)
+        return false;
+    pts = unwrap_pts(index, pts);
+    if (pts <= index->entries[0].pts || found <= index->entries[0].pos)
+        return false;
+    add_entry(index, found, pts);
+    index->failed = false;
+    mp_msg(MSGT_DEMUX, MSGL_V, "Timestamps from %.3f to %.3f, bisection "
+           "seeking enabled.\n", index->entries[0].pts, pts);
+    return true;
+}
+
+double pts_index_start(struct pts_index *index)
+{
+    return index->entries[0].pts;
+}
+
+off_t pts_index_seek(struct demuxer *demuxer, struct pts_index *index,
+                     double target, double tolerance, pts_reader read_pts)
+{
+    struct pts_index_entry lo, hi;
+    int i, probes = 0;
+
+    if (!pts_index_init(demuxer, index, read_pts))
+        return -1;
+    target = unwrap_pts(index, target);
+
+    // narrowest known interval around the target
+    for (i = 0; i < index->num_entries - 1; i++)
+        if (index->entries[i + 1].pts > target)
+            break;
+    lo = index->entries[i];
+    if (lo.pts > target || i == index->num_entries - 1)
+        return lo.pos; // before the first or after the last timestamp
+    hi = index->entries[i + 1];
+
+    while (lo.pts < target - tolerance && hi.pos - lo.pos > PTS_PROBE_SIZE
+           && probes++ < MAX_PROBES) {
+        // interpolate, but stay away from the ends to keep converging
+        // when the bitrate is far from constant
+        double f = (target - lo.pts) / (hi.pts - lo.pts);
+        f = FFMIN(FFMAX(f, 0.1), 0.9);
+        off_t pos = lo.pos + f * (hi.pos - lo.pos);
+        off_t found;
+        double pts = read_pts(demuxer, pos, &found);
+        if (pts == MP_NOPTS_VALUE || found >= hi.pos) {
+            // no timestamp between pos and hi
+            hi.pos = pos;
+            continue;
+        }
+        pts = unwrap_pts(index, pts);
+        if (pts < lo.pts - PTS_SLACK || pts > hi.pts + PTS_SLACK) {
+            mp_msg(MSGT_DEMUX, MSGL_V, "Timestamp discontinuity at %"PRId64
+                   ", not seeking by timestamps.\n", (int64_t)found);
+            index->failed = true;
+            return -1;
+        }
+        add_entry(index, found, pts);
+        if (pts <= target)
+            lo = (struct pts_index_entry){found, pts};
+        else
+            hi = (struct pts_index_entry){found, pts};
+    }
+    mp_msg(MSGT_DEMUX, MSGL_DBG2, "Seek to %.3f: %.3f at %"PRId64" after %d "
+           "probes\n", target, lo.pts, (int64_t)lo.pos, probes);
+    return lo.pos;
+}
+
+void pts_index_free(struct pts_index *index)
+{
+    free(index->entries);
+    index->entries = NULL;
+    index->num_entries = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MPLAYER_PTS_INDEX_H
+#define MPLAYER_PTS_INDEX_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct demuxer;
+
+// bytes a pts_reader may read for one probe
+#define PTS_PROBE_SIZE (16 * 1024)
+
+/**
+ * Return the first timestamp (in seconds) at or after file position pos,
+ * reading at most PTS_PROBE_SIZE bytes, and set *found to the position of
+ * the packet it belongs to. Return MP_NOPTS_VALUE if there is none.
+ */
+typedef double (*pts_reader)(struct demuxer *demuxer, off_t pos, off_t *found);
+
+/// Timestamps probed while seeking, sorted by file position.
+struct pts_index {
+    struct pts_index_entry {
+        off_t pos;
+        double pts;
+    } *entries;
+    int num_entries;
+    bool failed;        // no usable timestamps at start or end of the file
+};
+
+/// Probe the start and end of the file. Return false if that failed.
+bool pts_index_init(struct demuxer *demuxer, struct pts_index *index,
+                    pts_reader read_pts);
+/// First timestamp of the file, after pts_index_init() succeeded.
+double pts_index_start(struct pts_index *index);
+/**
+ * Bisect the file for the position of target, starting from the already
+ * known points. The result is the position of a timestamp at most
+ * tolerance seconds before target, or the closest found before it.
+ * \return file position, -1 if the timestamps are not usable for this
+ */
+off_t pts_index_seek(struct demuxer *demuxer, struct pts_index *index,
+                     double target, double tolerance, pts_reader read_pts);
+void pts_index_free(struct pts_index *index);
+
+#endif /* MPLAYER_PTS_INDEX_H */
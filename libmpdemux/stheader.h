@@ -96,6 +96,8 @@ typedef struct sh_video {
     double i_pts;   // PTS for the _next_ I/P frame (internal mpeg demuxing)
     float next_frame_time;
     double last_pts;
+    // pts bookkeeping of decode_video(), owned by the decoding thread if
+    // there is one; others may only touch it while that thread is paused
     double buffered_pts[32];
     int num_buffered_pts;
     double codec_reordered_pts;
@@ -112,6 +114,7 @@ typedef struct sh_video {
     float stream_aspect;  // aspect ratio in media headers (DVD IFO files)
     int i_bps;            // == bitrate  (compressed bytes/sec)
     int disp_w, disp_h;   // display size (filled by demuxer)
+    int lowres;           // disp_w/h are reduced by 2^lowres by the decoder
     // output driver/filters: (set by libmpcodecs core)
     unsigned int outfmt;
     unsigned int outfmtidx;
@@ -119,6 +122,7 @@ typedef struct sh_video {
     int output_flags;       // query_format() results for output filters+vo
     const struct vd_functions *vd_driver;
     int vf_initialized;   // -1 failed, 0 not done, 1 done
+    struct video_thread *thread;  // decoding thread (-decode-thread) or NULL
     // win32-compatible codec parameters:
     AVIStreamHeader video;
     BITMAPINFOHEADER *bih;
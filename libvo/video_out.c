@@ -476,11 +476,20 @@ int vo_config(struct vo *vo, uint32_t width, uint32_t height,
                      uint32_t format)
 {
     struct MPOpts *opts = vo->opts;
+    /* If only the video size changed, e.g. because the decoder switched to
+     * a different lowres level, keep the window as the user left it. */
+    bool keep_window = vo->config_ok && !vo_fs
+                       && (width != vo->aspdat.orgw || height != vo->aspdat.orgh)
+                       && d_width == vo->aspdat.prew
+                       && d_height == vo->aspdat.preh;
     panscan_init(vo);
     aspect_save_orig(vo, width, height);
     aspect_save_prescale(vo, d_width, d_height);
 
-    if (vo_control(vo, VOCTRL_UPDATE_SCREENINFO, NULL) == VO_TRUE) {
+    if (keep_window) {
+        d_width = vo->dwidth;
+        d_height = vo->dheight;
+    } else if (vo_control(vo, VOCTRL_UPDATE_SCREENINFO, NULL) == VO_TRUE) {
         aspect(vo, &d_width, &d_height, A_NOZOOM);
         vo->dx = (int)(opts->vo_screenwidth - d_width) / 2;
         vo->dy = (int)(opts->vo_screenheight - d_height) / 2;
@@ -109,6 +109,7 @@ typedef struct MPContext {
 
     struct content_source *sources;
     int num_sources;
+    bool fonts_added; // embedded fonts of the sources were passed to libass
     struct timeline_part *timeline;
     int num_timeline_parts;
     int timeline_part;
@@ -216,6 +217,18 @@ typedef struct MPContext {
     // playback rate. Used to avoid showing it multiple times.
     bool drop_message_shown;
 
+    /* Current decoding quality degradation level (0 = full quality), as
+     * changed by -decode-degrade. It is decided from video lateness summed
+     * over a window of frames, and after how many windows in a row video
+     * has kept up well enough to try the next better level. */
+    int decode_degrade;
+    double degrade_lateness;
+    int degrade_frames;
+    int degrade_headroom;
+
+    // size the whole video frame was last shown at, see update_display_size()
+    int display_w, display_h;
+
     struct screenshot_ctx *screenshot_ctx;
 
 #ifdef CONFIG_DVDNAV
@@ -242,6 +255,7 @@ int reinit_video_chain(struct MPContext *mpctx);
 void pause_player(struct MPContext *mpctx);
 void unpause_player(struct MPContext *mpctx);
 void add_step_frame(struct MPContext *mpctx);
+void set_decode_degrade(struct MPContext *mpctx, int level);
 void queue_seek(struct MPContext *mpctx, enum seek_type type, double amount,
                 int exact);
 int seek_chapter(struct MPContext *mpctx, int chapter, double *seek_pts);
@@ -254,6 +268,7 @@ char *chapter_name(struct MPContext *mpctx, int chapter);
 double chapter_start_time(struct MPContext *mpctx, int chapter);
 int get_chapter_count(struct MPContext *mpctx);
 void update_subtitles(struct MPContext *mpctx, double refpts, bool reset);
+void add_embedded_fonts(struct MPContext *mpctx);
 
 
 // timeline/tl_matroska.c
@@ -132,6 +132,7 @@ char *heartbeat_cmd;
 #include "stream/dvbin.h"
 #endif
 #include "stream/cache2.h"
+#include "stream/timeshift.h"
 
 //**************************************************************************//
 //             Playtree
@@ -397,9 +398,12 @@ static int is_valid_metadata_type(struct MPContext *mpctx, metadata_t type)
 
 static char *get_demuxer_info(struct MPContext *mpctx, char *tag)
 {
-    char **info = mpctx->demuxer->info;
+    char **info;
     int n;
 
+    demux_info_load(mpctx->demuxer);
+    info = mpctx->demuxer->info;
+
     if (!info || !tag)
         return talloc_strdup(NULL, "");
 
@@ -2120,6 +2124,56 @@ static void update_teletext(sh_video_t *sh_video, demuxer_t *demuxer, int reset)
     teletext_control(demuxer->teletext, TV_VBI_CONTROL_MARK_UNCHANGED, NULL);
 }
 
+// frames per window over which video lateness is averaged
+#define DEGRADE_WINDOW 16
+// lower quality if video was later than this on average (seconds)
+#define DEGRADE_LATE 0.040
+// raise it again after so many windows in a row with less lateness than
+#define DEGRADE_HEADROOM 0.010
+#define DEGRADE_HEADROOM_WINDOWS 4
+
+void set_decode_degrade(struct MPContext *mpctx, int level)
+{
+    mpctx->degrade_lateness = 0;
+    mpctx->degrade_frames = 0;
+    mpctx->degrade_headroom = 0;
+    // level 0 is always passed on, as it also resets a new decoder
+    if ((level && level == mpctx->decode_degrade) || !mpctx->sh_video)
+        return;
+    if (!set_video_degrade(mpctx->sh_video, level) && level) {
+        mp_msg(MSGT_AUTOQ, MSGL_DBG2,
+               "Decoder can not lower its quality.\n");
+        return;
+    }
+    if (level != mpctx->decode_degrade)
+        mp_msg(MSGT_AUTOQ, MSGL_V, "Decoding quality degradation level %d.\n",
+               level);
+    mpctx->decode_degrade = level;
+}
+
+/* Step through the decoder's quality degradation levels depending on how
+ * late video is, so that a slow system shows every frame at lower quality
+ * rather than dropping frames in bursts. */
+static void update_decode_degrade(struct MPContext *mpctx, double lateness)
+{
+    mpctx->degrade_lateness += lateness;
+    if (++mpctx->degrade_frames < DEGRADE_WINDOW)
+        return;
+    double average = mpctx->degrade_lateness / mpctx->degrade_frames;
+    int level = mpctx->decode_degrade;
+    mpctx->degrade_lateness = 0;
+    mpctx->degrade_frames = 0;
+    if (average > DEGRADE_LATE) {
+        if (level < mpctx->opts.decode_degrade)
+            set_decode_degrade(mpctx, level + 1);
+        mpctx->degrade_headroom = 0;
+    } else if (average < DEGRADE_HEADROOM && level > 0) {
+        if (++mpctx->degrade_headroom >= DEGRADE_HEADROOM_WINDOWS)
+            set_decode_degrade(mpctx, level - 1);
+    } else
+        mpctx->degrade_headroom = 0;
+}
+
 static int check_framedrop(struct MPContext *mpctx, double frame_time)
 {
     struct MPOpts *opts = &mpctx->opts;
@@ -2130,6 +2184,9 @@ static int check_framedrop(struct MPContext *mpctx, double frame_time)
         float delay = opts->playback_speed * ao_get_delay(mpctx->ao);
         float d = delay - mpctx->delay;
         ++total_frame_cnt;
+        if (opts->decode_degrade && !mpctx->paused
+            && !mpctx->restart_playback)
+            update_decode_degrade(mpctx, -d);
         // we should avoid dropping too many frames in sequence unless we
         // are too late. and we allow 100ms A-V delay here:
         if (d < -dropped_frames * frame_time - 0.100 && !mpctx->paused
@@ -2614,6 +2671,53 @@ static int fill_audio_out_buffers(struct MPContext *mpctx, double endpts)
     return -partial_fill;
 }
 
+#ifdef CONFIG_ASS
+static bool attachment_is_font(struct demux_attachment *att)
+{
+    if (!att->name || !att->type || !att->data_size)
+        return false;
+    // match against MIME types
+    if (strcmp(att->type, "application/x-truetype-font") == 0
+        || strcmp(att->type, "application/x-font") == 0)
+        return true;
+    // fallback: match against file extension
+    if (strlen(att->name) > 4) {
+        char *ext = att->name + strlen(att->name) - 4;
+        if (strcasecmp(ext, ".ttf") == 0 || strcasecmp(ext, ".ttc") == 0
+            || strcasecmp(ext, ".otf") == 0)
+            return true;
+    }
+    return false;
+}
+
+#endif
+
+/* Embedded fonts are only read once an ASS track is selected, whether at
+ * startup or later. libass keeps its own copy of the font data, so the
+ * attachment data is freed again right away. */
+void add_embedded_fonts(struct MPContext *mpctx)
+{
+#ifdef CONFIG_ASS
+    if (mpctx->fonts_added || !mpctx->opts.use_embedded_fonts
+        || !mpctx->ass_library || !mpctx->osd->ass_track)
+        return;
+    mpctx->fonts_added = true;
+    for (int j = 0; j < mpctx->num_sources; j++) {
+        struct demuxer *d = mpctx->sources[j].demuxer;
+        for (int i = 0; i < d->num_attachments; i++) {
+            struct demux_attachment *att = d->attachments + i;
+            if (attachment_is_font(att) && demuxer_attachment_data(d, att)) {
+                ass_add_font(mpctx->ass_library, att->name, att->data,
+                             att->data_size);
+                demuxer_attachment_free_data(att);
+                // renderers set up before only know the fonts they had
+                mpctx->osd->ass_fonts_changed = true;
+            }
+        }
+    }
+#endif
+}
+
 int reinit_video_chain(struct MPContext *mpctx)
 {
     struct MPOpts *opts = &mpctx->opts;
@@ -2650,6 +2754,28 @@ int reinit_video_chain(struct MPContext *mpctx)
         sh_video->vfilter = vf_open_filter(opts, NULL, "vo", vf_arg);
     }
 
+    if (opts->thumbnails) {
+        // scale the frames down and tile them into one image
+        int num = opts->thumbnails;
+        int cols = ceil(sqrt(num));
+        char tile_args[50], width[20];
+        snprintf(tile_args, sizeof(tile_args), "%d:%d:%d", cols,
+                 (num + cols - 1) / cols, num);
+        snprintf(width, sizeof(width), "%d", opts->thumbnail_width);
+        char *tile_arg[] = {"_oldargs_", tile_args, NULL};
+        char *scale_arg[] = {"w", width, "h", "-2", NULL};
+        struct vf_instance *vf = vf_open_filter(opts, sh_video->vfilter,
+                                                "tile", tile_arg);
+        if (vf)
+            vf = vf_open_filter(opts, sh_video->vfilter = vf, "scale",
+                                scale_arg);
+        if (vf)
+            sh_video->vfilter = vf;
+        else
+            mp_msg(MSGT_CPLAYER, MSGL_ERR,
+                   "Cannot add video filters for -thumbnails.\n");
+    }
+
 #ifdef CONFIG_ASS
     if (opts->ass_enabled) {
         int i;
@@ -2687,9 +2813,10 @@ int reinit_video_chain(struct MPContext *mpctx)
     sh_video->vfilter = append_filters(sh_video->vfilter, opts->vf_settings);
 
 #ifdef CONFIG_ASS
-    if (opts->ass_enabled)
+    if (opts->ass_enabled) {
         sh_video->vfilter->control(sh_video->vfilter, VFCTRL_INIT_EOSD,
                                    mpctx->ass_library);
+    }
 #endif
 
     current_module = "init_video_codec";
@@ -2728,6 +2855,13 @@ int reinit_video_chain(struct MPContext *mpctx)
         set_video_quality(sh_video, output_quality);
     }
 
+    // the new decoder starts at full quality
+    set_decode_degrade(mpctx, 0);
+    mpctx->display_w = mpctx->display_h = 0;
+
+    // only if the demuxer thread is running already, i.e. on stream switches
+    start_video_thread(sh_video);
+
     // ========== Init display (sh_video->disp_w*sh_video->disp_h/out_fmt) ============
 
     current_module = "init_vo";
@@ -2803,35 +2937,25 @@ static double update_video_nocorrect_pts(struct MPContext *mpctx)
     return frame_time;
 }
 
-static void determine_frame_pts(struct MPContext *mpctx)
+/* Tell the decoder how big the video is shown after window resizes,
+ * fullscreen switches or panscan changes, so that with lowres=auto it can
+ * decode at a lower resolution that is still sufficient. */
+static void update_display_size(struct MPContext *mpctx)
 {
-    struct sh_video *sh_video = mpctx->sh_video;
-    struct MPOpts *opts = &mpctx->opts;
-
-    if (opts->user_pts_assoc_mode)
-        sh_video->pts_assoc_mode = opts->user_pts_assoc_mode;
-    else if (sh_video->pts_assoc_mode == 0) {
-        if (mpctx->d_video->demuxer->timestamp_type == TIMESTAMP_TYPE_PTS
-            && sh_video->codec_reordered_pts != MP_NOPTS_VALUE)
-            sh_video->pts_assoc_mode = 1;
-        else
-            sh_video->pts_assoc_mode = 2;
-    } else {
-        int probcount1 = sh_video->num_reordered_pts_problems;
-        int probcount2 = sh_video->num_sorted_pts_problems;
-        if (sh_video->pts_assoc_mode == 2) {
-            int tmp = probcount1;
-            probcount1 = probcount2;
-            probcount2 = tmp;
-        }
-        if (probcount1 >= probcount2 * 1.5 + 2) {
-            sh_video->pts_assoc_mode = 3 - sh_video->pts_assoc_mode;
-            mp_msg(MSGT_CPLAYER, MSGL_V, "Switching to pts association mode "
-                   "%d.\n", sh_video->pts_assoc_mode);
-        }
-    }
-    sh_video->pts = sh_video->pts_assoc_mode == 1 ?
-                    sh_video->codec_reordered_pts : sh_video->sorted_pts;
+    struct vo *vo = mpctx->video_out;
+    if (!vo->config_ok)
+        return;
+    struct vo_rect src, dst;
+    calc_src_dst_rects(vo, vo->aspdat.orgw, vo->aspdat.orgh, &src, &dst,
+                       NULL, NULL);
+    // panscan shows only part of the frame, the rest is scaled the same way
+    int w = (int64_t)dst.width * vo->aspdat.orgw / src.width;
+    int h = (int64_t)dst.height * vo->aspdat.orgh / src.height;
+    if (w == mpctx->display_w && h == mpctx->display_h)
+        return;
+    mpctx->display_w = w;
+    mpctx->display_h = h;
+    set_video_display_size(mpctx->sh_video, w, h);
 }
 
 static double update_video(struct MPContext *mpctx)
@@ -2840,6 +2964,7 @@ static double update_video(struct MPContext *mpctx)
     struct vo *video_out = mpctx->video_out;
     sh_video->vfilter->control(sh_video->vfilter, VFCTRL_SET_OSD_OBJ,
                                mpctx->osd); // hack for vf_expand
+    update_display_size(mpctx);
     if (!mpctx->opts.correct_pts)
         return update_video_nocorrect_pts(mpctx);
 
@@ -2853,6 +2978,25 @@ static double update_video(struct MPContext *mpctx)
         // timer now
         if (vf_output_queued_frame(sh_video->vfilter))
             break;
+        if (sh_video->thread) {
+            current_module = "decode video";
+            void *decoded_frame = video_thread_read(sh_video, &pts);
+            if (!decoded_frame) {
+                if (vo_get_buffered_frame(video_out, true) < 0)
+                    return -1;
+                break;
+            }
+            if (pts >= mpctx->hrseek_pts - .005)
+                mpctx->hrseek_framedrop = false;
+            // the frame is already decoded, dropping it saves filtering
+            if (mpctx->hrseek_framedrop
+                || check_framedrop(mpctx, sh_video->frametime))
+                break;
+            sh_video->pts = pts;
+            current_module = "filter video";
+            filter_video(sh_video, decoded_frame, sh_video->pts);
+            break;
+        }
         int in_size = 0;
         unsigned char *buf = NULL;
         pts = MP_NOPTS_VALUE;
@@ -2882,7 +3026,7 @@ static double update_video(struct MPContext *mpctx)
         void *decoded_frame = decode_video(sh_video, pkt, buf, in_size,
                                            framedrop_type, pts);
         if (decoded_frame) {
-            determine_frame_pts(mpctx);
+            sh_video->pts = determine_frame_pts(sh_video);
             current_module = "filter video";
             filter_video(sh_video, decoded_frame, sh_video->pts);
         } else if (!pkt) {
@@ -3045,7 +3189,6 @@ static void seek_reset(struct MPContext *mpctx, bool reset_ao, bool reset_ac)
         mpctx->sh_video->timer = 0;
         vo_seek_reset(mpctx->video_out);
         mpctx->sh_video->timer = 0;
-        mpctx->sh_video->num_buffered_pts = 0;
         mpctx->sh_video->last_pts = MP_NOPTS_VALUE;
         mpctx->delay = 0;
         mpctx->time_frame = 0;
@@ -3153,6 +3296,16 @@ static int seek(MPContext *mpctx, struct seek_params seek,
         seek.type = MPSEEK_ABSOLUTE;
         seek.direction = seek.amount > 0 ? 1 : -1;
         seek.amount += get_current_time(mpctx);
+    } else if (mpctx->demuxer->thread && seek.type == MPSEEK_RELATIVE) {
+        /* Relative seeks in demuxers count from the demuxer position,
+         * which the demuxer thread keeps ahead of playback. Not converted
+         * to absolute since some demuxers (TS, MPEG-PS) take absolute
+         * positions relative to the start of the file, not as pts. */
+        struct demux_queue_state state;
+        demux_get_queue_state(mpctx->demuxer, &state);
+        if (!seek.direction)
+            seek.direction = seek.amount > 0 ? 1 : -1;
+        seek.amount -= FFMAX(state.duration, 0);
     }
 
     /* At least the liba52 decoder wants to read from the input stream
@@ -3193,6 +3346,9 @@ static int seek(MPContext *mpctx, struct seek_params seek,
 
     if (hr_seek)
         demuxer_amount -= opts->hr_seek_demuxer_offset;
+    // the decoding thread must not take packets while the demuxer seeks
+    if (mpctx->sh_video)
+        video_thread_pause(mpctx->sh_video);
     int seekresult = demux_seek(mpctx->demuxer, demuxer_amount, audio_delay,
                                 demuxer_style);
     if (seekresult == 0) {
@@ -3200,6 +3356,8 @@ static int seek(MPContext *mpctx, struct seek_params seek,
             reinit_audio_chain(mpctx);
             seek_reset(mpctx, !timeline_fallthrough, false);
         }
+        if (mpctx->sh_video)
+            video_thread_unpause(mpctx->sh_video);
         return -1;
     }
 
@@ -3208,6 +3366,8 @@ static int seek(MPContext *mpctx, struct seek_params seek,
     /* If we just reinitialized audio it doesn't need to be reset,
      * and resetting could lose audio some decoders produce during init. */
     seek_reset(mpctx, !timeline_fallthrough, !need_reset);
+    if (mpctx->sh_video)
+        video_thread_unpause(mpctx->sh_video);
 
     /* Use the target time as "current position" for further relative
      * seeks etc until a new video frame has been decoded */
@@ -3415,6 +3575,73 @@ int seek_chapter(struct MPContext *mpctx, int chapter, double *seek_pts)
 }
 
 
+// packets read after each seek while looking for a keyframe
+#define THUMBNAIL_MAX_PACKETS 1000
+
+static void show_thumbnails(struct vo *vo)
+{
+    while (vo_get_buffered_frame(vo, true) >= 0) {
+        vo_new_frame_imminent(vo);
+        vo_flip_page(vo, 0, -1);
+    }
+}
+
+/* -thumbnails: instead of playing the file, seek to evenly spaced positions
+ * and decode only the keyframe found at each of them. The filters added in
+ * reinit_video_chain() scale these down and tile them into one image, which
+ * the VO (e.g. -vo png) then writes out. */
+static void make_thumbnails(struct MPContext *mpctx)
+{
+    struct MPOpts *opts = &mpctx->opts;
+    struct sh_video *sh_video = mpctx->sh_video;
+    int num = opts->thumbnails;
+    int done = 0;
+
+    // frames are decoded one at a time right here
+    stop_video_thread(sh_video);
+    // let lowres=auto decode at no more than about the thumbnail size
+    set_video_display_size(sh_video, opts->thumbnail_width,
+                           (int64_t)opts->thumbnail_width * sh_video->disp_h
+                           / FFMAX(sh_video->disp_w, 1));
+
+    for (int i = 0; i < num && !mpctx->stop_play; i++) {
+        current_module = "thumbnails";
+        queue_seek(mpctx, MPSEEK_FACTOR, (i + 0.5) / num, -1);
+        int r = seek(mpctx, mpctx->seek, false);
+        mpctx->seek = (struct seek_params){ 0 };
+        if (r < 0)
+            continue;
+        struct mp_image *mpi = NULL;
+        double pts = MP_NOPTS_VALUE;
+        for (int n = 0; !mpi && n < THUMBNAIL_MAX_PACKETS; n++) {
+            struct demux_packet *pkt = ds_get_packet2(mpctx->d_video, false);
+            if (!pkt)
+                break;
+            if (!pkt->len)
+                continue;
+            pts = pkt->pts;
+            mpi = decode_video(sh_video, pkt, pkt->buffer, pkt->len, 0, pts);
+        }
+        // decoders with delay may still hold the frame
+        if (!mpi)
+            mpi = decode_video(sh_video, NULL, NULL, 0, 0, MP_NOPTS_VALUE);
+        if (!mpi) {
+            mp_msg(MSGT_CPLAYER, MSGL_WARN,
+                   "No keyframe found for thumbnail %d.\n", i + 1);
+            continue;
+        }
+        filter_video(sh_video, mpi, pts);
+        show_thumbnails(mpctx->video_out);
+        done++;
+        mp_msg(MSGT_CPLAYER, MSGL_STATUS, "Thumbnail %d/%d\r", i + 1, num);
+    }
+    // vf_tile holds back the image if fewer frames than expected were found
+    sh_video->vfilter->control(sh_video->vfilter, VFCTRL_FLUSH_FRAMES, NULL);
+    show_thumbnails(mpctx->video_out);
+    mp_msg(MSGT_CPLAYER, MSGL_INFO, "\nMade %d of %d thumbnails.\n",
+           done, num);
+}
+
 static void run_playloop(struct MPContext *mpctx)
 {
     struct MPOpts *opts = &mpctx->opts;
@@ -3811,24 +4038,6 @@ static int read_keys(void *ctx, int fd)
     return MP_INPUT_DEAD;
 }
 
-static bool attachment_is_font(struct demux_attachment *att)
-{
-    if (!att->name || !att->type || !att->data || !att->data_size)
-        return false;
-    // match against MIME types
-    if (strcmp(att->type, "application/x-truetype-font") == 0
-        || strcmp(att->type, "application/x-font") == 0)
-        return true;
-    // fallback: match against file extension
-    if (strlen(att->name) > 4) {
-        char *ext = att->name + strlen(att->name) - 4;
-        if (strcasecmp(ext, ".ttf") == 0 || strcasecmp(ext, ".ttc") == 0
-            || strcasecmp(ext, ".otf") == 0)
-            return true;
-    }
-    return false;
-}
-
 static int select_audio(demuxer_t *demuxer, int audio_id, char **audio_lang)
 {
     if (audio_id == -1)
@@ -3957,6 +4166,9 @@ int main(int argc, char *argv[])
     parse_cfgfiles(mpctx, mpctx->mconfig);
 
     mpctx->playtree = m_config_parse_mp_command_line(mpctx->mconfig, argc, argv);
+    // -thumbnails only looks at the video
+    if (opts->thumbnails)
+        opts->audio_id = -2;
     if (mpctx->playtree == NULL)
         opt_exit = 1;
     else {
@@ -4477,8 +4689,22 @@ play_next_file:
     }
 #endif
 
-    // CACHE2: initial prefill: 20%  later: 5%  (should be set by -cacheopts)
 goto_enable_cache:
+    /* The time-shift file takes the place of the cache for live streams
+     * and for files, which may still be growing. The recorder reads network
+     * streams as fast as they deliver, so those of known size would overrun
+     * the ring file long before playback gets there. */
+    if (opts->timeshift_size > 0 && !mpctx->stream->sector_size &&
+        (mpctx->stream->type == STREAMTYPE_DVB ||
+         mpctx->stream->type == STREAMTYPE_FILE ||
+         (mpctx->stream->type == STREAMTYPE_STREAM &&
+          !mpctx->stream->end_pos)) &&
+        stream_enable_timeshift(mpctx->stream,
+                                (off_t)opts->timeshift_size << 20,
+                                opts->timeshift_dir))
+        goto goto_open_demuxer;
+
+    // CACHE2: initial prefill: 20%  later: 5%  (should be set by -cacheopts)
     if (stream_cache_size > 0) {
         int res;
         float stream_cache_min_percent = opts->stream_cache_min_percent;
@@ -4493,6 +4719,7 @@ goto_enable_cache:
     }
 
     //============ Open DEMUXERS --- DETECT file type =======================
+goto_open_demuxer:
     current_module = "demux_open";
 
     mpctx->demuxer = demux_open(opts, mpctx->stream, mpctx->file_format,
@@ -4606,19 +4833,7 @@ goto_enable_cache:
 
     mpctx->initialized_flags |= INITIALIZED_DEMUXER;
 
-#ifdef CONFIG_ASS
-    if (opts->ass_enabled && mpctx->ass_library) {
-        for (int j = 0; j < mpctx->num_sources; j++) {
-            struct demuxer *d = mpctx->sources[j].demuxer;
-            for (int i = 0; i < d->num_attachments; i++) {
-                struct demux_attachment *att = d->attachments + i;
-                if (opts->use_embedded_fonts && attachment_is_font(att))
-                    ass_add_font(mpctx->ass_library, att->name, att->data,
-                                 att->data_size);
-            }
-        }
-    }
-#endif
+    mpctx->fonts_added = false;
 
     current_module = "demux_open2";
 
@@ -4909,6 +5124,12 @@ goto_enable_cache:
     mpctx->total_avsync_change = 0;
     mpctx->last_chapter_seek = -2;
 
+    // timeline playback switches between demuxers, keep it synchronous
+    if (!mpctx->timeline)
+        demux_start_thread(mpctx->demuxer);
+    if (mpctx->sh_video)
+        start_video_thread(mpctx->sh_video);
+
     // If there's a timeline force an absolute seek to initialize state
     if (opts->seek_to_sec || mpctx->timeline) {
         queue_seek(mpctx, MPSEEK_ABSOLUTE, opts->seek_to_sec, 0);
@@ -4945,6 +5166,12 @@ goto_enable_cache:
         vo_control(mpctx->video_out,
                    mpctx->paused ? VOCTRL_PAUSE : VOCTRL_RESUME, NULL);
 
+    if (opts->thumbnails && mpctx->sh_video) {
+        make_thumbnails(mpctx);
+        if (!mpctx->stop_play)
+            mpctx->stop_play = PT_NEXT_ENTRY;
+    }
+
     while (!mpctx->stop_play)
         run_playloop(mpctx);
 
@@ -4955,6 +5182,7 @@ goto_enable_cache:
         mpctx->stop_play = 0;
         uninit_player(mpctx, INITIALIZED_ALL - (INITIALIZED_STREAM | INITIALIZED_GETCH2 | (opts->fixed_vo ? INITIALIZED_VO : 0)));
         cache_uninit(mpctx->stream);
+        timeshift_uninit(mpctx->stream);
         mpctx->dvbin_reopen = 0;
         goto goto_enable_cache;
     }
@@ -52,6 +52,12 @@ typedef struct MPOpts {
     int noconfig;
     float stream_cache_min_percent;
     float stream_cache_seek_min_percent;
+    char *stream_cache_disk_dir;
+    int stream_cache_disk_keep;
+    int stream_cache_disk_max;
+    int timeshift_size;
+    char *timeshift_dir;
+    int stream_mmap;
     int chapterrange[2];
     int edition_id;
     int correct_pts;
@@ -86,6 +92,14 @@ typedef struct MPOpts {
     char *audio_demuxer_name;
     char *sub_demuxer_name;
     int extension_parsing;
+    int demuxer_thread;
+    int demuxer_readahead;
+    float demuxer_max_seconds;
+    int demuxer_probesize;
+    int mkv_index_cache;
+    int mkv_background_index;
+    float seek_tolerance;
+    int demuxer_max_kbytes;
 
     int audio_output_channels;
     int audio_output_format;
@@ -97,6 +111,11 @@ typedef struct MPOpts {
     float screen_size_xy;
     int flip;
     int vd_use_slices;
+    int decode_thread;
+    int decode_queue;
+    int decode_degrade;
+    int thumbnails;
+    int thumbnail_width;
     char **sub_name;
     char **sub_paths;
     int sub_auto;
@@ -131,6 +150,7 @@ typedef struct MPOpts {
         char *skip_frame_str;
         int threads;
         int bitexact;
+        int pool;
         char *avopt;
     } lavc_param;
 
@@ -18,618 +18,948 @@
 
 #include "config.h"
 
-// Initial draft of my new cache system...
-// Note it runs in 2 processes (using fork()), but doesn't require locking!!
-// TODO: seeking, data consistency checking
-
-#define READ_SLEEP_TIME 10
-// These defines are used to reduce the cost of many successive
-// seeks (e.g. when a file has no index) by spinning quickly at first.
-#define INITIAL_FILL_USLEEP_TIME 1000
-#define INITIAL_FILL_USLEEP_COUNT 10
-#define FILL_USLEEP_TIME 50000
-#define PREFILL_SLEEP_TIME 200
-#define CONTROL_SLEEP_TIME 0
+// The cache runs in a separate thread which owns a private copy of the
+// stream. The buffer is split into fixed-size blocks, each holding the data
+// of one block-aligned file position. Blocks are looked up through an index
+// sorted by file position, so several disjoint ranges of the file can stay
+// cached at the same time. Blocks near the read position are protected,
+// everything else is evicted least-recently-used first.
+// The reader and the cache thread wake each other with condition variables
+// instead of polling.
+// Optionally, complete blocks of network streams are also written to a file
+// on disk (see -cache-disk). Blocks missing from memory are then loaded from
+// that file instead of the stream.
+
+// Time (in ms) between checks for user interruption while waiting.
+#define READ_WAIT_TIME 10
+#define PREFILL_WAIT_TIME 200
+#define CONTROL_WAIT_TIME 10
+
+// Preferred size of a cache block, rounded down to the sector size.
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define CACHE_MIN_BLOCKS 16
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <signal.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "libavutil/avutil.h"
-#include "osdep/shmem.h"
+#include "libavutil/common.h"
 #include "osdep/timer.h"
-#if defined(__MINGW32__)
-#include <windows.h>
-static void ThreadProc( void *s );
-#elif defined(PTHREAD_CACHE)
-#include <pthread.h>
-static void *ThreadProc(void *s);
-#else
-#include <sys/wait.h>
-#define FORKED_CACHE 1
-#endif
-#ifndef FORKED_CACHE
-#define FORKED_CACHE 0
-#endif
 
+#include "talloc.h"
 #include "mp_msg.h"
+#include "options.h"
 
 #include "stream.h"
 #include "cache2.h"
 #include "mpcommon.h"
 
+struct cache_block {
+    off_t pos;      // file position of the first byte, -1 if unused
+    int len;        // number of valid bytes
+    uint64_t age;   // last access, for LRU eviction
+};
+
+struct cache_disk {
+    int fd;
+    char *filename;
+    char *mapname;          // NULL if the file is removed on close
+    char *url;
+    int block_size;
+    off_t size;             // total stream size, -1 if unknown
+    off_t end_pos;          // stream size reported on open, 0 if unknown
+    off_t max_size;         // blocks past this are not stored, 0 = no limit
+    uint8_t *map;           // one bit per block, set if the block is on disk
+    int map_size;
+};
+
 typedef struct {
-  // constats:
-  unsigned char *buffer;      // base pointer of the allocated buffer memory
-  int buffer_size; // size of the allocated buffer memory
-  int sector_size; // size of a single sector (2048/2324)
-  int back_size;   // we should keep back_size amount of old bytes for backward seek
-  int fill_limit;  // we should fill buffer only if space>=fill_limit
-  int seek_limit;  // keep filling cache if distance is less that seek limit
-  // filler's pointers:
-  int eof;
-  off_t min_filepos; // buffer contain only a part of the file, from min-max pos
-  off_t max_filepos;
-  off_t offset;      // filepos <-> bufferpos  offset value (filepos of the buffer's first byte)
-  // reader's pointers:
-  off_t read_filepos;
-  // commands/locking:
-//  int seek_lock;   // 1 if we will seek/reset buffer, 2 if we are ready for cmd
-//  int fifo_flag;  // 1 if we should use FIFO to notice cache about buffer reads.
-  // callback
-  stream_t* stream;
-  volatile int control;
-  volatile unsigned control_uint_arg;
-  volatile double control_double_arg;
-  volatile int control_res;
-  volatile off_t control_new_pos;
-  volatile double stream_time_length;
-  volatile double stream_time_pos;
+    // constants:
+    unsigned char *buffer;  // base pointer of the allocated buffer memory
+    int buffer_size;        // size of the allocated buffer memory
+    int sector_size;        // size of a single sector (2048/2324)
+    int block_size;         // multiple of sector_size
+    int num_blocks;
+    int readahead;          // bytes to keep cached ahead of the read position
+    int seek_limit;         // read through gaps smaller than this instead of seeking
+    stream_t *stream;       // private copy owned by the cache thread
+    struct cache_disk *disk; // only accessed by the cache thread
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;      // signals the cache thread
+    pthread_cond_t data_cond;   // signals the reader
+
+    // everything below is protected by mutex
+    struct cache_block *blocks;
+    int *index;             // slots of used blocks, sorted by file position
+    int num_used;
+    uint64_t age;
+    off_t read_filepos;     // reader's position
+    off_t stream_pos;       // position of the cache thread's stream
+    off_t eof_pos;          // no data at or after this position, -1 if unknown
+    int quit;
+    unsigned last_time_update;
+
+    int control;
+    unsigned control_uint_arg;
+    double control_double_arg;
+    int control_res;
+    off_t control_new_pos;
+    double stream_time_length;
+    double stream_time_pos;
 } cache_vars_t;
 
-static int min_fill=0;
+static int min_fill = 0;
 
-static void cache_wakeup(stream_t *s)
+// Return the slot of the block containing pos, or -1 if it is not cached.
+static int find_block(cache_vars_t *s, off_t pos)
 {
-#if FORKED_CACHE
-  // signal process to wake up immediately
-  kill(s->cache_pid, SIGUSR1);
-#endif
+    off_t start = pos - pos % s->block_size;
+    int lo = 0, hi = s->num_used;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        off_t mpos = s->blocks[s->index[mid]].pos;
+        if (mpos == start)
+            return s->index[mid];
+        if (mpos < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
 }
 
-static int cache_read(cache_vars_t *s, unsigned char *buf, int size)
+static void index_remove(cache_vars_t *s, int slot)
 {
-  int total=0;
-  int sleep_count = 0;
-  int last_max = s->max_filepos;
-  while(size>0){
-    int pos,newb,len;
-
-  //printf("CACHE2_READ: 0x%X <= 0x%X <= 0x%X  \n",s->min_filepos,s->read_filepos,s->max_filepos);
-
-    if(s->read_filepos>=s->max_filepos || s->read_filepos<s->min_filepos){
-	// eof?
-	if(s->eof) break;
-	if (s->max_filepos == last_max) {
-	    if (sleep_count++ == 10)
-	        mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not filling, consider increasing -cache and/or -cache-min!\n");
-	} else {
-	    last_max = s->max_filepos;
-	    sleep_count = 0;
-	}
-	// waiting for buffer fill...
-	if (stream_check_interrupt(READ_SLEEP_TIME)) {
-	    s->eof = 1;
-	    break;
-	}
-	continue; // try again...
-    }
-    sleep_count = 0;
-
-    newb=s->max_filepos-s->read_filepos; // new bytes in the buffer
-    if(newb<min_fill) min_fill=newb; // statistics...
-
-//    printf("*** newb: %d bytes ***\n",newb);
-
-    pos=s->read_filepos - s->offset;
-    if(pos<0) pos+=s->buffer_size; else
-    if(pos>=s->buffer_size) pos-=s->buffer_size;
-
-    if(newb>s->buffer_size-pos) newb=s->buffer_size-pos; // handle wrap...
-    if(newb>size) newb=size;
-
-    // check:
-    if(s->read_filepos<s->min_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"Ehh. s->read_filepos<s->min_filepos !!! Report bug...\n");
-
-    // len=write(mem,newb)
-    //printf("Buffer read: %d bytes\n",newb);
-    memcpy(buf,&s->buffer[pos],newb);
-    buf+=newb;
-    len=newb;
-    // ...
-
-    s->read_filepos+=len;
-    size-=len;
-    total+=len;
-
-  }
-  return total;
+    for (int i = 0; i < s->num_used; i++) {
+        if (s->index[i] == slot) {
+            memmove(&s->index[i], &s->index[i + 1],
+                    (s->num_used - i - 1) * sizeof(int));
+            s->num_used--;
+            return;
+        }
+    }
 }
 
-static int cache_fill(cache_vars_t *s)
+static void index_insert(cache_vars_t *s, int slot)
 {
-  int back,back2,newb,space,len,pos;
-  off_t read=s->read_filepos;
-  int read_chunk;
-  int wraparound_copy = 0;
-
-  if(read<s->min_filepos || read>s->max_filepos){
-      // seek...
-      mp_msg(MSGT_CACHE,MSGL_DBG2,"Out of boundaries... seeking to 0x%"PRIX64"  \n",(int64_t)read);
-      // drop cache contents only if seeking backward or too much fwd.
-      // This is also done for on-disk files, since it loses the backseek cache.
-      // That in turn can cause major bandwidth increase and performance
-      // issues with e.g. mov or badly interleaved files
-      if(read<s->min_filepos || read>=s->max_filepos+s->seek_limit)
-      {
-        s->offset= // FIXME!?
-        s->min_filepos=s->max_filepos=read; // drop cache content :(
-        if(s->stream->eof) stream_reset(s->stream);
-        stream_seek_internal(s->stream,read);
-        mp_msg(MSGT_CACHE,MSGL_DBG2,"Seek done. new pos: 0x%"PRIX64"  \n",(int64_t)stream_tell(s->stream));
-      }
-  }
-
-  // calc number of back-bytes:
-  back=read - s->min_filepos;
-  if(back<0) back=0; // strange...
-  if(back>s->back_size) back=s->back_size;
-
-  // calc number of new bytes:
-  newb=s->max_filepos - read;
-  if(newb<0) newb=0; // strange...
-
-  // calc free buffer space:
-  space=s->buffer_size - (newb+back);
-
-  // calc bufferpos:
-  pos=s->max_filepos - s->offset;
-  if(pos>=s->buffer_size) pos-=s->buffer_size; // wrap-around
-
-  if(space<s->fill_limit){
-//    printf("Buffer is full (%d bytes free, limit: %d)\n",space,s->fill_limit);
-    return 0; // no fill...
-  }
-
-//  printf("### read=0x%X  back=%d  newb=%d  space=%d  pos=%d\n",read,back,newb,space,pos);
-
-  // try to avoid wrap-around. If not possible due to sector size
-  // do an extra copy.
-  if(space>s->buffer_size-pos) {
-    if (s->buffer_size-pos >= s->sector_size) {
-      space=s->buffer_size-pos;
-    } else {
-      space = s->sector_size;
-      wraparound_copy = 1;
-    }
-  }
-
-  // limit one-time block size
-  read_chunk = s->stream->read_chunk;
-  if (!read_chunk) read_chunk = 4*s->sector_size;
-  space = FFMIN(space, read_chunk);
-
-#if 1
-  // back+newb+space <= buffer_size
-  back2=s->buffer_size-(space+newb); // max back size
-  if(s->min_filepos<(read-back2)) s->min_filepos=read-back2;
-#else
-  s->min_filepos=read-back; // avoid seeking-back to temp area...
-#endif
-
-  if (wraparound_copy) {
-    int to_copy;
-    len = stream_read_internal(s->stream, s->stream->buffer, space);
-    to_copy = FFMIN(len, s->buffer_size-pos);
-    memcpy(s->buffer + pos, s->stream->buffer, to_copy);
-    memcpy(s->buffer, s->stream->buffer + to_copy, len - to_copy);
-  } else
-  len = stream_read_internal(s->stream, &s->buffer[pos], space);
-  s->eof= !len;
-
-  s->max_filepos+=len;
-  if(pos+len>=s->buffer_size){
-      // wrap...
-      s->offset+=s->buffer_size;
-  }
-
-  return len;
+    off_t pos = s->blocks[slot].pos;
+    int i = s->num_used;
+    while (i > 0 && s->blocks[s->index[i - 1]].pos > pos)
+        i--;
+    memmove(&s->index[i + 1], &s->index[i], (s->num_used - i) * sizeof(int));
+    s->index[i] = slot;
+    s->num_used++;
+}
 
+static void drop_blocks(cache_vars_t *s)
+{
+    for (int n = 0; n < s->num_blocks; n++)
+        s->blocks[n].pos = -1;
+    s->num_used = 0;
 }
 
-static int cache_execute_control(cache_vars_t *s) {
-  double double_res;
-  unsigned uint_res;
-  static unsigned last;
-  int quit = s->control == -2;
-  if (quit || !s->stream->control) {
-    s->stream_time_length = 0;
-    s->stream_time_pos = MP_NOPTS_VALUE;
-    s->control_new_pos = 0;
-    s->control_res = STREAM_UNSUPPORTED;
-    s->control = -1;
-    return !quit;
-  }
-  if (GetTimerMS() - last > 99) {
-    double len, pos;
-    if (s->stream->control(s->stream, STREAM_CTRL_GET_TIME_LENGTH, &len) == STREAM_OK)
-      s->stream_time_length = len;
-    else
-      s->stream_time_length = 0;
-    if (s->stream->control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pos) == STREAM_OK)
-      s->stream_time_pos = pos;
-    else
-      s->stream_time_pos = MP_NOPTS_VALUE;
-    last = GetTimerMS();
-  }
-  if (s->control == -1) return 1;
-  switch (s->control) {
-    case STREAM_CTRL_SEEK_TO_TIME:
-      double_res = s->control_double_arg;
-    case STREAM_CTRL_GET_CURRENT_TIME:
-    case STREAM_CTRL_GET_ASPECT_RATIO:
-      s->control_res = s->stream->control(s->stream, s->control, &double_res);
-      s->control_double_arg = double_res;
-      break;
-    case STREAM_CTRL_SEEK_TO_CHAPTER:
-    case STREAM_CTRL_SET_ANGLE:
-      uint_res = s->control_uint_arg;
-    case STREAM_CTRL_GET_NUM_CHAPTERS:
-    case STREAM_CTRL_GET_CURRENT_CHAPTER:
-    case STREAM_CTRL_GET_NUM_ANGLES:
-    case STREAM_CTRL_GET_ANGLE:
-      s->control_res = s->stream->control(s->stream, s->control, &uint_res);
-      s->control_uint_arg = uint_res;
-      break;
-    default:
-      s->control_res = STREAM_UNSUPPORTED;
-      break;
-  }
-  s->control_new_pos = s->stream->pos;
-  s->control = -1;
-  return 1;
+/**
+ * Allocate a block for the block-aligned position pos, evicting the least
+ * recently used block outside the range around the read position.
+ * \return slot of the block, -1 if the cache is full
+ */
+static int alloc_block(cache_vars_t *s, off_t pos)
+{
+    off_t keep_start = s->read_filepos - s->read_filepos % s->block_size;
+    off_t keep_end = s->read_filepos + s->readahead;
+    int slot = -1;
+    for (int n = 0; n < s->num_blocks; n++) {
+        struct cache_block *b = &s->blocks[n];
+        if (b->pos < 0) {
+            slot = n;
+            break;
+        }
+        if (b->pos >= keep_start && b->pos < keep_end)
+            continue;
+        if (slot < 0 || b->age < s->blocks[slot].age)
+            slot = n;
+    }
+    if (slot < 0)
+        return -1;
+    if (s->blocks[slot].pos >= 0)
+        index_remove(s, slot);
+    s->blocks[slot].pos = pos;
+    s->blocks[slot].len = 0;
+    s->blocks[slot].age = ++s->age;
+    index_insert(s, slot);
+    return slot;
 }
 
-static void *shared_alloc(int size) {
-#if FORKED_CACHE
-    return shmem_alloc(size);
-#else
-    return malloc(size);
-#endif
+// Number of bytes available without interruption starting at pos.
+static off_t cached_bytes(cache_vars_t *s, off_t pos, off_t max)
+{
+    off_t start = pos;
+    while (pos - start < max) {
+        int slot = find_block(s, pos);
+        if (slot < 0)
+            break;
+        off_t end = s->blocks[slot].pos + s->blocks[slot].len;
+        if (end <= pos)
+            break;
+        pos = end;
+        if (s->blocks[slot].len < s->block_size)
+            break;
+    }
+    return pos - start;
 }
 
-static void shared_free(void *ptr, int size) {
-#if FORKED_CACHE
-    shmem_free(ptr, size);
-#else
-    free(ptr);
-#endif
+// Position of the first missing byte in the readahead range, -1 if none.
+static off_t next_fill_pos(cache_vars_t *s)
+{
+    off_t end = s->read_filepos + s->readahead;
+    if (s->eof_pos >= 0)
+        end = FFMIN(end, s->eof_pos);
+    off_t pos = s->read_filepos + cached_bytes(s, s->read_filepos,
+                                                 s->readahead);
+    return pos < end ? pos : -1;
 }
 
-static cache_vars_t* cache_init(int size,int sector){
-  int num;
-  cache_vars_t* s=shared_alloc(sizeof(cache_vars_t));
-  if(s==NULL) return NULL;
-
-  memset(s,0,sizeof(cache_vars_t));
-  num=size/sector;
-  if(num < 16){
-     num = 16;
-  }//32kb min_size
-  s->buffer_size=num*sector;
-  s->sector_size=sector;
-  s->buffer=shared_alloc(s->buffer_size);
-
-  if(s->buffer == NULL){
-    shared_free(s, sizeof(cache_vars_t));
-    return NULL;
-  }
+static void cache_wakeup(cache_vars_t *s)
+{
+    pthread_cond_signal(&s->wakeup);
+}
 
-  s->fill_limit=8*sector;
-  s->back_size=s->buffer_size/2;
-  return s;
+/**
+ * Wait with the mutex held until the cache thread signals progress or
+ * time ms have passed, then check for user interruption.
+ * \return 1 if the user wants to abort
+ */
+static int cache_wait(cache_vars_t *s, int time)
+{
+    struct timeval now;
+    struct timespec ts;
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec + time / 1000;
+    ts.tv_nsec = (now.tv_usec + (time % 1000) * 1000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&s->data_cond, &s->mutex, &ts);
+    pthread_mutex_unlock(&s->mutex);
+    int res = stream_check_interrupt(0);
+    pthread_mutex_lock(&s->mutex);
+    return res;
 }
 
-void cache_uninit(stream_t *s) {
-  cache_vars_t* c = s->cache_data;
-  if(s->cache_pid) {
-#if !FORKED_CACHE
-    cache_do_control(s, -2, NULL);
-#else
-    kill(s->cache_pid,SIGKILL);
-    waitpid(s->cache_pid,NULL,0);
-#endif
-    s->cache_pid = 0;
-  }
-  if(!c) return;
-  shared_free(c->buffer, c->buffer_size);
-  c->buffer = NULL;
-  c->stream = NULL;
-  shared_free(s->cache_data, sizeof(cache_vars_t));
-  s->cache_data = NULL;
+/**
+ * Copy data at the read position out of the cache, waiting until at least
+ * min bytes are available or EOF is reached.
+ * \return number of bytes read, at most size
+ */
+static int cache_read(cache_vars_t *s, unsigned char *buf, int min, int size)
+{
+    int total = 0;
+    int wait_count = 0;
+    pthread_mutex_lock(&s->mutex);
+    while (size > 0) {
+        off_t pos = s->read_filepos;
+        int slot = find_block(s, pos);
+        int offset = pos % s->block_size;
+        int newb = slot < 0 ? 0 : s->blocks[slot].len - offset;
+
+        if (newb <= 0) {
+            if (total >= min || (s->eof_pos >= 0 && pos >= s->eof_pos))
+                break;
+            cache_wakeup(s);
+            if (wait_count++ == 100)
+                mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not filling, consider "
+                       "increasing -cache and/or -cache-min!\n");
+            if (cache_wait(s, READ_WAIT_TIME))
+                break;
+            continue;
+        }
+
+        if (newb < min_fill)
+            min_fill = newb; // statistics...
+        if (newb > size)
+            newb = size;
+        memcpy(buf, s->buffer + (off_t)slot * s->block_size + offset, newb);
+        s->blocks[slot].age = ++s->age;
+        s->read_filepos += newb;
+        buf += newb;
+        size -= newb;
+        total += newb;
+    }
+    // the read position moved, the cache thread might have work now
+    cache_wakeup(s);
+    pthread_mutex_unlock(&s->mutex);
+    return total;
 }
 
-#if FORKED_CACHE
-static void exit_sighandler(int x){
-  // close stream
-  exit(0);
+static uint64_t hash_url(const char *url)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*url)
+        hash = (hash ^ (uint8_t)*url++) * 0x100000001b3ULL;
+    return hash;
+}
+
+static int disk_has_block(struct cache_disk *d, off_t pos)
+{
+    int64_t n = pos / d->block_size;
+    return n / 8 < d->map_size && d->map[n / 8] & (1 << (n & 7));
+}
+
+static void disk_close(struct cache_disk *d)
+{
+    if (!d)
+        return;
+    if (d->fd >= 0)
+        close(d->fd);
+    if (!d->mapname) {
+        unlink(d->filename);
+    } else {
+        FILE *f = fopen(d->mapname, "wb");
+        if (f) {
+            fprintf(f, "MPCACHE2 %d %"PRId64" %"PRId64" %d\n%s\n",
+                    d->block_size, (int64_t)d->size, (int64_t)d->end_pos,
+                    d->map_size, d->url);
+            fwrite(d->map, 1, d->map_size, f);
+            fclose(f);
+        }
+    }
+    talloc_free(d);
 }
 
-static void dummy_sighandler(int x) {
+// Load the block map of a file kept by a previous instance of the stream.
+// A file whose recorded size differs from the current stream is stale.
+static void disk_load_map(struct cache_disk *d)
+{
+    int block_size, map_size;
+    int64_t size, end_pos;
+    FILE *f = fopen(d->mapname, "rb");
+    if (!f)
+        return;
+    char *url = talloc_size(NULL, strlen(d->url) + 2);
+    if (fscanf(f, "MPCACHE2 %d %"SCNd64" %"SCNd64" %d", &block_size, &size,
+               &end_pos, &map_size) == 4 && fgetc(f) == '\n'
+        && fgets(url, strlen(d->url) + 2, f)
+        && block_size == d->block_size && map_size > 0
+        && end_pos == d->end_pos
+        && (!d->end_pos || size < 0 || size == d->end_pos)
+        && strcmp(url, talloc_asprintf(url, "%s\n", d->url)) == 0) {
+        d->map = talloc_zero_size(d, map_size);
+        d->map_size = fread(d->map, 1, map_size, f);
+        d->size = size;
+    }
+    talloc_free(url);
+    fclose(f);
+}
+
+static struct cache_disk *disk_open(const char *dir, int keep,
+                                    const char *url, int block_size,
+                                    off_t end_pos, off_t max_size)
+{
+    struct cache_disk *d = talloc_zero(NULL, struct cache_disk);
+    d->block_size = block_size;
+    d->size = -1;
+    d->end_pos = end_pos;
+    d->max_size = max_size;
+    d->url = talloc_strdup(d, url);
+    if (keep) {
+        uint64_t hash = hash_url(url);
+        d->filename = talloc_asprintf(d, "%s/mplayer-%016"PRIx64".cache",
+                                      dir, hash);
+        d->mapname = talloc_asprintf(d, "%s/mplayer-%016"PRIx64".map",
+                                     dir, hash);
+        disk_load_map(d);
+        d->fd = open(d->filename, O_RDWR | O_CREAT | O_BINARY, 0600);
+    } else {
+        d->filename = talloc_asprintf(d, "%s/mplayer-cache-XXXXXX", dir);
+        d->fd = mkstemp(d->filename);
+    }
+    if (d->fd < 0) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Cannot open disk cache file %s: %s\n",
+               d->filename, strerror(errno));
+        d->mapname = NULL;
+        talloc_free(d);
+        return NULL;
+    }
+    if (!d->map_size) {
+        if (ftruncate(d->fd, 0) < 0) {
+            disk_close(d);
+            return NULL;
+        }
+        d->size = -1;
+    }
+    mp_msg(MSGT_CACHE, MSGL_V, "Disk cache: %s\n", d->filename);
+    return d;
 }
-#endif
 
 /**
- * Main loop of the cache process or thread.
+ * Read the block at pos from the disk cache.
+ * \return number of bytes read, 0 on error
  */
-static void cache_mainloop(cache_vars_t *s) {
-    int sleep_count = 0;
-#if FORKED_CACHE
-    struct sigaction sa = { .sa_handler = SIG_IGN };
-    sigaction(SIGUSR1, &sa, NULL);
-#endif
-    do {
-        if (!cache_fill(s)) {
-#if FORKED_CACHE
-            // Let signal wake us up, we cannot leave this
-            // enabled since we do not handle EINTR in most places.
-            // This might need extra code to work on BSD.
-            sa.sa_handler = dummy_sighandler;
-            sigaction(SIGUSR1, &sa, NULL);
-#endif
-            if (sleep_count < INITIAL_FILL_USLEEP_COUNT) {
-                sleep_count++;
-                usec_sleep(INITIAL_FILL_USLEEP_TIME);
-            } else
-                usec_sleep(FILL_USLEEP_TIME); // idle
-#if FORKED_CACHE
-            sa.sa_handler = SIG_IGN;
-            sigaction(SIGUSR1, &sa, NULL);
-#endif
-        } else
-            sleep_count = 0;
-    } while (cache_execute_control(s));
+static int disk_load(struct cache_disk *d, off_t pos, unsigned char *dst)
+{
+    int len = d->block_size;
+    if (d->size >= 0 && pos + len > d->size)
+        len = d->size - pos;
+    if (len <= 0 || lseek(d->fd, pos, SEEK_SET) != pos ||
+        read(d->fd, dst, len) != len)
+        return 0;
+    return len;
+}
+
+// Write a complete block to the disk cache.
+static int disk_store(struct cache_disk *d, off_t pos, unsigned char *src,
+                      int len)
+{
+    int64_t n = pos / d->block_size;
+    if (lseek(d->fd, pos, SEEK_SET) != pos || write(d->fd, src, len) != len) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Writing disk cache failed: %s\n",
+               strerror(errno));
+        return 0;
+    }
+    if (n / 8 >= d->map_size) {
+        int size = FFMAX(n / 8 + 1, d->map_size * 2);
+        d->map = talloc_realloc_size(d, d->map, size);
+        memset(d->map + d->map_size, 0, size - d->map_size);
+        d->map_size = size;
+    }
+    d->map[n / 8] |= 1 << (n & 7);
+    return 1;
 }
 
 /**
- * \return 1 on success, 0 if the function was interrupted and -1 on error
+ * Move the cache thread's stream to pos. Data is skipped if the stream
+ * cannot seek forward.
+ * Called with the mutex unlocked.
  */
-int stream_enable_cache(stream_t *stream,int size,int min,int seek_limit){
-  int ss = stream->sector_size ? stream->sector_size : STREAM_BUFFER_SIZE;
-  int res = -1;
-  cache_vars_t* s;
+static void cache_seek_stream(cache_vars_t *s, off_t pos)
+{
+    stream_t *stream = s->stream;
+    mp_msg(MSGT_CACHE, MSGL_DBG2, "Out of boundaries... seeking to 0x%"PRIX64"  \n",
+           (int64_t)pos);
+    if (stream->eof)
+        stream_reset(stream);
+    stream_seek_internal(stream, pos);
+    while (stream->pos < pos) {
+        unsigned char buf[STREAM_MAX_SECTOR_SIZE];
+        int len = FFMIN(pos - stream->pos, (off_t)sizeof(buf));
+        if (stream_read_internal(stream, buf, len) <= 0)
+            break;
+    }
+    mp_msg(MSGT_CACHE, MSGL_DBG2, "Seek done. new pos: 0x%"PRIX64"  \n",
+           (int64_t)stream->pos);
+}
 
-  if (stream->flags & STREAM_NON_CACHEABLE) {
-    mp_msg(MSGT_CACHE,MSGL_STATUS,"\rThis stream is non-cacheable\n");
-    return 1;
-  }
-
-  s=cache_init(size,ss);
-  if(s == NULL) return -1;
-  stream->cache_data=s;
-  s->stream=stream; // callback
-  s->seek_limit=seek_limit;
-
-
-  //make sure that we won't wait from cache_fill
-  //more data than it is allowed to fill
-  if (s->seek_limit > s->buffer_size - s->fill_limit ){
-     s->seek_limit = s->buffer_size - s->fill_limit;
-  }
-  if (min > s->buffer_size - s->fill_limit) {
-     min = s->buffer_size - s->fill_limit;
-  }
-  // to make sure we wait for the cache process/thread to be active
-  // before continuing
-  if (min <= 0)
-    min = 1;
-
-#if FORKED_CACHE
-  if((stream->cache_pid=fork())){
-    if ((pid_t)stream->cache_pid == -1)
-      stream->cache_pid = 0;
-#else
-  {
-    stream_t* stream2=malloc(sizeof(stream_t));
-    memcpy(stream2,s->stream,sizeof(stream_t));
-    s->stream=stream2;
-#if defined(__MINGW32__)
-    stream->cache_pid = _beginthread( ThreadProc, 0, s );
-#else
-    {
-    pthread_t tid;
-    pthread_create(&tid, NULL, ThreadProc, s);
-    stream->cache_pid = 1;
+/**
+ * Read the next missing piece of data ahead of the read position.
+ * Called with the mutex locked, which is released while reading.
+ * \return 0 if there was nothing to do
+ */
+static int cache_fill(cache_vars_t *s)
+{
+    off_t pos = next_fill_pos(s);
+    if (pos < 0)
+        return 0;
+
+    // Reading through a small gap is cheaper than a seek on most streams.
+    if (pos > s->stream_pos && pos - s->stream_pos < s->seek_limit) {
+        int slot = find_block(s, s->stream_pos);
+        if (slot < 0 ? s->stream_pos % s->block_size == 0 :
+            s->blocks[slot].pos + s->blocks[slot].len == s->stream_pos)
+            pos = s->stream_pos;
     }
-#endif
-#endif
-    if (!stream->cache_pid) {
-        mp_msg(MSGT_CACHE, MSGL_ERR,
-               "Starting cache process/thread failed: %s.\n", strerror(errno));
-        goto err_out;
+
+    // Blocks are always filled from their start without holes.
+    off_t start = pos - pos % s->block_size;
+    int slot = find_block(s, start);
+    if (slot < 0) {
+        slot = alloc_block(s, start);
+        if (slot < 0)
+            return 0; // cache full
     }
-    // wait until cache is filled at least prefill_init %
-    mp_msg(MSGT_CACHE,MSGL_V,"CACHE_PRE_INIT: %"PRId64" [%"PRId64"] %"PRId64"  pre:%d  eof:%d  \n",
-	(int64_t)s->min_filepos,(int64_t)s->read_filepos,(int64_t)s->max_filepos,min,s->eof);
-    while(s->read_filepos<s->min_filepos || s->max_filepos-s->read_filepos<min){
-	mp_tmsg(MSGT_CACHE,MSGL_STATUS,"\rCache fill: %5.2f%% (%"PRId64" bytes)   ",
-	    100.0*(float)(s->max_filepos-s->read_filepos)/(float)(s->buffer_size),
-	    (int64_t)s->max_filepos-s->read_filepos
-	);
-	if(s->eof) break; // file is smaller than prefill size
-	if(stream_check_interrupt(PREFILL_SLEEP_TIME)) {
-	  res = 0;
-	  goto err_out;
+    struct cache_block *b = &s->blocks[slot];
+    pos = start + b->len;
+    unsigned char *block = s->buffer + (off_t)slot * s->block_size;
+
+    // The block cannot be evicted while unlocked since only this thread
+    // allocates blocks, and the reader only accesses the first b->len bytes.
+    if (!b->len && s->disk && disk_has_block(s->disk, start)) {
+        pthread_mutex_unlock(&s->mutex);
+        int len = disk_load(s->disk, start, block);
+        pthread_mutex_lock(&s->mutex);
+        if (len > 0) {
+            b->len = len;
+            b->age = ++s->age;
+            pthread_cond_broadcast(&s->data_cond);
+            return 1;
         }
     }
-    mp_msg(MSGT_CACHE,MSGL_STATUS,"\n");
-    return 1; // parent exits
 
-err_out:
-    cache_uninit(stream);
-    return res;
-  }
-
-#if FORKED_CACHE
-  signal(SIGTERM,exit_sighandler); // kill
-  cache_mainloop(s);
-  // make sure forked code never leaves this function
-  exit(0);
-#endif
+    if (pos != s->stream_pos) {
+        pthread_mutex_unlock(&s->mutex);
+        cache_seek_stream(s, pos);
+        pthread_mutex_lock(&s->mutex);
+        s->stream_pos = s->stream->pos;
+        if (s->stream_pos != pos) {
+            // Unseekable stream that is already past pos.
+            s->eof_pos = pos;
+            pthread_cond_broadcast(&s->data_cond);
+            return 1;
+        }
+    }
+
+    int read_chunk = s->stream->read_chunk;
+    if (!read_chunk)
+        read_chunk = 4 * s->sector_size;
+    int space = FFMIN(s->block_size - b->len, read_chunk);
+
+    pthread_mutex_unlock(&s->mutex);
+    int len = stream_read_internal(s->stream, block + b->len, space);
+    if (s->disk) {
+        // the size is saved and trusted later, so a failed read must not
+        // pass for the end of the stream
+        if (len == 0 && s->stream->eof
+            && (!s->stream->end_pos || pos == s->stream->end_pos))
+            s->disk->size = pos;
+        if (((len > 0 && b->len + len == s->block_size) ||
+             (len <= 0 && b->len > 0))
+            && (!s->disk->max_size || start < s->disk->max_size)) {
+            if (!disk_store(s->disk, start, block, FFMAX(len, 0) + b->len)) {
+                disk_close(s->disk);
+                s->disk = NULL;
+            }
+        }
+    }
+    pthread_mutex_lock(&s->mutex);
+
+    if (len > 0) {
+        b->len += len;
+        b->age = ++s->age;
+        if (s->eof_pos >= 0 && s->eof_pos < pos + len)
+            s->eof_pos = -1;
+    } else
+        s->eof_pos = pos;
+    s->stream_pos = s->stream->pos;
+    pthread_cond_broadcast(&s->data_cond);
+    return 1;
 }
 
-#if !FORKED_CACHE
-#if defined(__MINGW32__)
-static void ThreadProc( void *s ){
-  cache_mainloop(s);
-  _endthread();
+// Called with the mutex locked, which is released around stream calls.
+static void cache_update_times(cache_vars_t *s)
+{
+    double len, pos;
+    if (!s->stream->control || GetTimerMS() - s->last_time_update < 100)
+        return;
+    pthread_mutex_unlock(&s->mutex);
+    if (s->stream->control(s->stream, STREAM_CTRL_GET_TIME_LENGTH, &len) != STREAM_OK)
+        len = 0;
+    if (s->stream->control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pos) != STREAM_OK)
+        pos = MP_NOPTS_VALUE;
+    pthread_mutex_lock(&s->mutex);
+    s->stream_time_length = len;
+    s->stream_time_pos = pos;
+    s->last_time_update = GetTimerMS();
 }
-#else
-static void *ThreadProc( void *s ){
-  cache_mainloop(s);
-  return NULL;
+
+// Called with the mutex locked, which is released around stream calls.
+static void cache_execute_control(cache_vars_t *s)
+{
+    int cmd = s->control;
+    double double_res = s->control_double_arg;
+    unsigned uint_res = s->control_uint_arg;
+    int res = STREAM_UNSUPPORTED;
+
+    pthread_mutex_unlock(&s->mutex);
+    if (s->stream->control) {
+        switch (cmd) {
+        case STREAM_CTRL_SEEK_TO_TIME:
+        case STREAM_CTRL_GET_CURRENT_TIME:
+        case STREAM_CTRL_GET_ASPECT_RATIO:
+            res = s->stream->control(s->stream, cmd, &double_res);
+            break;
+        case STREAM_CTRL_SEEK_TO_CHAPTER:
+        case STREAM_CTRL_SET_ANGLE:
+        case STREAM_CTRL_GET_NUM_CHAPTERS:
+        case STREAM_CTRL_GET_CURRENT_CHAPTER:
+        case STREAM_CTRL_GET_NUM_ANGLES:
+        case STREAM_CTRL_GET_ANGLE:
+            res = s->stream->control(s->stream, cmd, &uint_res);
+            break;
+        }
+    }
+    pthread_mutex_lock(&s->mutex);
+
+    switch (cmd) {
+    case STREAM_CTRL_SEEK_TO_TIME:
+    case STREAM_CTRL_SEEK_TO_CHAPTER:
+    case STREAM_CTRL_SET_ANGLE:
+        // Byte positions do not necessarily map to the same data anymore.
+        if (res == STREAM_OK) {
+            drop_blocks(s);
+            s->eof_pos = -1;
+            disk_close(s->disk);
+            s->disk = NULL;
+        }
+        break;
+    }
+    s->stream_pos = s->stream->pos;
+    s->control_double_arg = double_res;
+    s->control_uint_arg = uint_res;
+    s->control_res = res;
+    s->control_new_pos = s->stream->pos;
+    s->control = -1;
+    s->last_time_update = 0;
+    cache_update_times(s);
+    pthread_cond_broadcast(&s->data_cond);
 }
-#endif
-#endif
-
-int cache_stream_fill_buffer(stream_t *s){
-  int len;
-  int sector_size;
-  if(!s->cache_pid) return stream_fill_buffer(s);
-
-  if(s->pos!=((cache_vars_t*)s->cache_data)->read_filepos) mp_msg(MSGT_CACHE,MSGL_ERR,"!!! read_filepos differs!!! report this bug...\n");
-  sector_size = ((cache_vars_t*)s->cache_data)->sector_size;
-  if (sector_size > STREAM_MAX_SECTOR_SIZE) {
-    mp_msg(MSGT_CACHE, MSGL_ERR, "Sector size %i larger than maximum %i\n", sector_size, STREAM_MAX_SECTOR_SIZE);
-    sector_size = STREAM_MAX_SECTOR_SIZE;
-  }
-
-  len=cache_read(s->cache_data,s->buffer, sector_size);
-  //printf("cache_stream_fill_buffer->read -> %d\n",len);
-
-  if(len<=0){ s->eof=1; s->buf_pos=s->buf_len=0; return 0; }
-  s->eof=0;
-  s->buf_pos=0;
-  s->buf_len=len;
-  s->pos+=len;
-//  printf("[%d]",len);fflush(stdout);
-  if (s->capture_file)
-    stream_capture_do(s);
-  return len;
 
+/**
+ * Main loop of the cache thread.
+ */
+static void *cache_thread(void *arg)
+{
+    cache_vars_t *s = arg;
+    pthread_mutex_lock(&s->mutex);
+    while (!s->quit) {
+        if (s->control != -1) {
+            cache_execute_control(s);
+            continue;
+        }
+        if (cache_fill(s)) {
+            cache_update_times(s);
+            continue;
+        }
+        // Nothing to do until the reader moves or sends a command.
+        pthread_cond_wait(&s->wakeup, &s->mutex);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
 }
 
-int cache_fill_status(stream_t *s) {
-  cache_vars_t *cv;
-  if (!s || !s->cache_data)
-    return -1;
-  cv = s->cache_data;
-  return (cv->max_filepos-cv->read_filepos)/(cv->buffer_size / 100);
+static cache_vars_t *cache_init(int size, int sector)
+{
+    cache_vars_t *s = calloc(1, sizeof(cache_vars_t));
+    if (!s)
+        return NULL;
+
+    int sectors = FFMIN(CACHE_BLOCK_SIZE, size / CACHE_MIN_BLOCKS) / sector;
+    s->sector_size = sector;
+    s->block_size = FFMAX(sectors, 1) * sector;
+    s->num_blocks = FFMAX(size / s->block_size, CACHE_MIN_BLOCKS);
+    s->buffer_size = s->num_blocks * s->block_size;
+    // keep a quarter of the cache for data behind the read position
+    // and other ranges of the file
+    s->readahead = s->buffer_size - s->buffer_size / 4;
+    s->buffer = malloc(s->buffer_size);
+    s->blocks = malloc(s->num_blocks * sizeof(struct cache_block));
+    s->index = malloc(s->num_blocks * sizeof(int));
+    if (!s->buffer || !s->blocks || !s->index) {
+        free(s->buffer);
+        free(s->blocks);
+        free(s->index);
+        free(s);
+        return NULL;
+    }
+    drop_blocks(s);
+    s->eof_pos = -1;
+    s->control = -1;
+    s->stream_time_pos = MP_NOPTS_VALUE;
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->wakeup, NULL);
+    pthread_cond_init(&s->data_cond, NULL);
+    return s;
 }
 
-int cache_stream_seek_long(stream_t *stream,off_t pos){
-  cache_vars_t* s;
-  off_t newpos;
-  if(!stream->cache_pid) return stream_seek_long(stream,pos);
+void cache_uninit(stream_t *s)
+{
+    cache_vars_t *c = s->cache_data;
+    if (!c)
+        return;
+    if (s->cache_pid) {
+        pthread_mutex_lock(&c->mutex);
+        c->quit = 1;
+        cache_wakeup(c);
+        pthread_mutex_unlock(&c->mutex);
+        pthread_join(c->thread, NULL);
+        s->cache_pid = 0;
+    }
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->wakeup);
+    pthread_cond_destroy(&c->data_cond);
+    free(c->buffer);
+    free(c->blocks);
+    free(c->index);
+    disk_close(c->disk);
+    if (c->stream != s) {
+        free(c->stream->buffer);
+        free(c->stream);
+    }
+    free(c);
+    s->cache_data = NULL;
+}
 
-  s=stream->cache_data;
-//  s->seek_lock=1;
+/**
+ * \return 1 on success, 0 if the function was interrupted and -1 on error
+ */
+int stream_enable_cache(stream_t *stream, int size, int min, int seek_limit)
+{
+    int ss = stream->sector_size ? stream->sector_size : STREAM_BUFFER_SIZE;
+    int res = -1;
+    cache_vars_t *s;
 
-  mp_msg(MSGT_CACHE,MSGL_DBG2,"CACHE2_SEEK: 0x%"PRIX64" <= 0x%"PRIX64" (0x%"PRIX64") <= 0x%"PRIX64"  \n",s->min_filepos,pos,s->read_filepos,s->max_filepos);
+    if (stream->flags & STREAM_NON_CACHEABLE) {
+        mp_msg(MSGT_CACHE, MSGL_STATUS, "\rThis stream is non-cacheable\n");
+        return 1;
+    }
 
-  newpos=pos/s->sector_size; newpos*=s->sector_size; // align
-  stream->pos=s->read_filepos=newpos;
-  s->eof=0; // !!!!!!!
-  cache_wakeup(stream);
+    s = cache_init(size, ss);
+    if (s == NULL)
+        return -1;
+    stream->cache_data = s;
+    s->seek_limit = FFMIN(seek_limit, s->readahead);
+    s->read_filepos = s->stream_pos = stream->pos;
+    // to make sure we wait for the cache thread to be active
+    // before continuing
+    min = av_clip(min, 1, s->readahead);
+
+    struct MPOpts *opts = stream->opts;
+    if (opts && opts->stream_cache_disk_dir && stream->url &&
+        !stream->sector_size && strstr(stream->url, "://") &&
+        strncmp(stream->url, "file://", 7)) {
+        s->disk = disk_open(opts->stream_cache_disk_dir,
+                            opts->stream_cache_disk_keep, stream->url,
+                            s->block_size, stream->end_pos,
+                            (off_t)opts->stream_cache_disk_max * 1024 * 1024);
+        if (s->disk && s->disk->size >= 0)
+            s->eof_pos = s->disk->size;
+    }
 
-  cache_stream_fill_buffer(stream);
+    s->stream = malloc(sizeof(stream_t));
+    if (!s->stream) {
+        s->stream = stream;
+        goto err_out;
+    }
+    memcpy(s->stream, stream, sizeof(stream_t));
+    // the thread's copy must not share the buffer with the reader
+    s->stream->buffer = malloc(stream->buffer_size);
+    if (!s->stream->buffer)
+        goto err_out;
+    if (pthread_create(&s->thread, NULL, cache_thread, s)) {
+        mp_msg(MSGT_CACHE, MSGL_ERR,
+               "Starting cache thread failed: %s.\n", strerror(errno));
+        goto err_out;
+    }
+    stream->cache_pid = 1;
 
-  pos-=newpos;
-  if(pos>=0 && pos<=stream->buf_len){
-    stream->buf_pos=pos; // byte position in sector
+    // wait until cache is filled at least prefill_init %
+    mp_msg(MSGT_CACHE, MSGL_V, "CACHE_PRE_INIT: %"PRId64"  pre:%d  blocks:%d*%d\n",
+           (int64_t)s->read_filepos, min, s->num_blocks, s->block_size);
+    pthread_mutex_lock(&s->mutex);
+    while (1) {
+        off_t fill = cached_bytes(s, s->read_filepos, min);
+        if (fill >= min)
+            break;
+        mp_tmsg(MSGT_CACHE, MSGL_STATUS, "\rCache fill: %5.2f%% (%"PRId64" bytes)   ",
+                100.0 * fill / s->readahead, (int64_t)fill);
+        if (s->eof_pos >= 0)
+            break; // file is smaller than prefill size
+        if (cache_wait(s, PREFILL_WAIT_TIME)) {
+            pthread_mutex_unlock(&s->mutex);
+            res = 0;
+            goto err_out;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    mp_msg(MSGT_CACHE, MSGL_STATUS, "\n");
     return 1;
-  }
 
-//  stream->buf_pos=stream->buf_len=0;
-//  return 1;
+err_out:
+    cache_uninit(stream);
+    return res;
+}
 
-  mp_msg(MSGT_CACHE,MSGL_V,"cache_stream_seek: WARNING! Can't seek to 0x%"PRIX64" !\n",(int64_t)(pos+newpos));
-  return 0;
+/**
+ * Read at least min and at most len bytes at the stream position directly
+ * from the cache, bypassing the stream buffer.
+ */
+int cache_stream_read(stream_t *s, unsigned char *buf, int min, int len)
+{
+    cache_vars_t *c = s->cache_data;
+    if (s->pos != c->read_filepos)
+        mp_msg(MSGT_CACHE, MSGL_ERR, "!!! read_filepos differs!!! report this bug...\n");
+    len = cache_read(c, buf, min, len);
+    if (len <= 0) {
+        s->eof = 1;
+        return 0;
+    }
+    s->eof = 0;
+    s->pos += len;
+    return len;
+}
+
+int cache_stream_fill_buffer(stream_t *s)
+{
+    int len;
+    int sector_size;
+    cache_vars_t *c = s->cache_data;
+    if (!s->cache_pid)
+        return stream_fill_buffer(s);
+    len = stream_fill_probe_buffer(s);
+    if (len >= 0)
+        return len;
+
+    sector_size = c->sector_size;
+    if (sector_size > STREAM_MAX_SECTOR_SIZE) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Sector size %i larger than maximum %i\n",
+               sector_size, STREAM_MAX_SECTOR_SIZE);
+        sector_size = STREAM_MAX_SECTOR_SIZE;
+    }
+
+    // wait for a sector only, but take whatever else is already cached
+    len = cache_stream_read(s, s->buffer, sector_size,
+                            FFMAX(sector_size, s->read_size));
+
+    if (len <= 0) {
+        s->buf_pos = s->buf_len = 0;
+        return 0;
+    }
+    s->buf_pos = 0;
+    s->buf_len = len;
+    if (s->capture_file)
+        stream_capture_do(s, s->buffer, len);
+    stream_update_read_size(s);
+    return len;
+}
+
+int cache_fill_status(stream_t *s)
+{
+    cache_vars_t *cv;
+    int res;
+    if (!s || !s->cache_data)
+        return -1;
+    cv = s->cache_data;
+    pthread_mutex_lock(&cv->mutex);
+    res = cached_bytes(cv, cv->read_filepos, cv->readahead) * 100 / cv->readahead;
+    pthread_mutex_unlock(&cv->mutex);
+    return res;
 }
 
-int cache_do_control(stream_t *stream, int cmd, void *arg) {
-  int sleep_count = 0;
-  cache_vars_t* s = stream->cache_data;
-  switch (cmd) {
+int cache_stream_seek_long(stream_t *stream, off_t pos)
+{
+    cache_vars_t *s;
+    off_t newpos;
+    if (!stream->cache_pid)
+        return stream_seek_long(stream, pos);
+    if (stream_seek_probe(stream, pos))
+        return 1;
+
+    s = stream->cache_data;
+
+    newpos = pos / s->sector_size;
+    newpos *= s->sector_size; // align
+
+    pthread_mutex_lock(&s->mutex);
+    mp_msg(MSGT_CACHE, MSGL_DBG2, "CACHE2_SEEK: 0x%"PRIX64" -> 0x%"PRIX64"  \n",
+           (int64_t)s->read_filepos, (int64_t)pos);
+    stream->pos = s->read_filepos = newpos;
+    stream->read_size = STREAM_BUFFER_SIZE;
+    // retry reading at the end, the file might have grown
+    if (s->eof_pos >= 0 && newpos >= s->eof_pos)
+        s->eof_pos = -1;
+    cache_wakeup(s);
+    pthread_mutex_unlock(&s->mutex);
+
+    stream->buf_pos = stream->buf_len = 0;
+    cache_stream_fill_buffer(stream);
+
+    pos -= newpos;
+    if (pos >= 0 && pos <= stream->buf_len) {
+        stream->buf_pos = pos; // byte position in sector
+        return 1;
+    }
+
+    mp_msg(MSGT_CACHE, MSGL_V, "cache_stream_seek: WARNING! Can't seek to 0x%"PRIX64" !\n",
+           (int64_t)(pos + newpos));
+    return 0;
+}
+
+int cache_do_control(stream_t *stream, int cmd, void *arg)
+{
+    int wait_count = 0;
+    int res;
+    cache_vars_t *s = stream->cache_data;
+    pthread_mutex_lock(&s->mutex);
+    switch (cmd) {
     case STREAM_CTRL_SEEK_TO_TIME:
-      s->control_double_arg = *(double *)arg;
-      s->control = cmd;
-      break;
+        s->control_double_arg = *(double *)arg;
+        s->control = cmd;
+        break;
     case STREAM_CTRL_SEEK_TO_CHAPTER:
     case STREAM_CTRL_SET_ANGLE:
-      s->control_uint_arg = *(unsigned *)arg;
-      s->control = cmd;
-      break;
+        s->control_uint_arg = *(unsigned *)arg;
+        s->control = cmd;
+        break;
     // the core might call these every frame, so cache them...
     case STREAM_CTRL_GET_TIME_LENGTH:
-      *(double *)arg = s->stream_time_length;
-      return s->stream_time_length ? STREAM_OK : STREAM_UNSUPPORTED;
+        *(double *)arg = s->stream_time_length;
+        res = s->stream_time_length ? STREAM_OK : STREAM_UNSUPPORTED;
+        pthread_mutex_unlock(&s->mutex);
+        return res;
     case STREAM_CTRL_GET_CURRENT_TIME:
-      *(double *)arg = s->stream_time_pos;
-      return s->stream_time_pos != MP_NOPTS_VALUE ? STREAM_OK : STREAM_UNSUPPORTED;
+        *(double *)arg = s->stream_time_pos;
+        res = s->stream_time_pos != MP_NOPTS_VALUE ? STREAM_OK : STREAM_UNSUPPORTED;
+        pthread_mutex_unlock(&s->mutex);
+        return res;
     case STREAM_CTRL_GET_NUM_CHAPTERS:
     case STREAM_CTRL_GET_CURRENT_CHAPTER:
     case STREAM_CTRL_GET_ASPECT_RATIO:
     case STREAM_CTRL_GET_NUM_ANGLES:
     case STREAM_CTRL_GET_ANGLE:
-    case -2:
-      s->control = cmd;
-      break;
+        s->control = cmd;
+        break;
     default:
-      return STREAM_UNSUPPORTED;
-  }
-  cache_wakeup(stream);
-  while (s->control != -1) {
-    if (sleep_count++ == 1000)
-      mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not responding!\n");
-    if (stream_check_interrupt(CONTROL_SLEEP_TIME)) {
-      s->eof = 1;
-      return STREAM_UNSUPPORTED;
-    }
-  }
-  if (s->control_res != STREAM_OK)
-    return s->control_res;
-  switch (cmd) {
-    case STREAM_CTRL_GET_TIME_LENGTH:
-    case STREAM_CTRL_GET_CURRENT_TIME:
-    case STREAM_CTRL_GET_ASPECT_RATIO:
-      *(double *)arg = s->control_double_arg;
-      break;
-    case STREAM_CTRL_GET_NUM_CHAPTERS:
-    case STREAM_CTRL_GET_CURRENT_CHAPTER:
-    case STREAM_CTRL_GET_NUM_ANGLES:
-    case STREAM_CTRL_GET_ANGLE:
-      *(unsigned *)arg = s->control_uint_arg;
-      break;
-    case STREAM_CTRL_SEEK_TO_CHAPTER:
-    case STREAM_CTRL_SEEK_TO_TIME:
-    case STREAM_CTRL_SET_ANGLE:
-      stream->pos = s->read_filepos = s->control_new_pos;
-      break;
-  }
-  return s->control_res;
+        pthread_mutex_unlock(&s->mutex);
+        return STREAM_UNSUPPORTED;
+    }
+    cache_wakeup(s);
+    while (s->control != -1) {
+        if (wait_count++ == 100)
+            mp_msg(MSGT_CACHE, MSGL_WARN, "Cache not responding!\n");
+        if (cache_wait(s, CONTROL_WAIT_TIME)) {
+            pthread_mutex_unlock(&s->mutex);
+            return STREAM_UNSUPPORTED;
+        }
+    }
+    res = s->control_res;
+    if (res == STREAM_OK) {
+        switch (cmd) {
+        case STREAM_CTRL_GET_TIME_LENGTH:
+        case STREAM_CTRL_GET_CURRENT_TIME:
+        case STREAM_CTRL_GET_ASPECT_RATIO:
+            *(double *)arg = s->control_double_arg;
+            break;
+        case STREAM_CTRL_GET_NUM_CHAPTERS:
+        case STREAM_CTRL_GET_CURRENT_CHAPTER:
+        case STREAM_CTRL_GET_NUM_ANGLES:
+        case STREAM_CTRL_GET_ANGLE:
+            *(unsigned *)arg = s->control_uint_arg;
+            break;
+        case STREAM_CTRL_SEEK_TO_CHAPTER:
+        case STREAM_CTRL_SEEK_TO_TIME:
+        case STREAM_CTRL_SET_ANGLE:
+            stream->pos = s->read_filepos = s->control_new_pos;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return res;
 }
@@ -37,6 +37,14 @@
 
 #include "config.h"
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #if HAVE_WINSOCK2_H
 #include <winsock2.h>
 #endif
@@ -52,6 +60,7 @@
 #include "m_struct.h"
 
 #include "cache2.h"
+#include "timeshift.h"
 
 struct input_ctx;
 static int (*stream_check_interrupt_cb)(struct input_ctx *ctx, int time);
@@ -188,6 +197,7 @@ static stream_t *open_stream_plugin(const stream_info_t *sinfo,
     streaming_ctrl_free(s->streaming_ctrl);
 #endif
     free(s->url);
+    free(s->buffer);
     free(s);
     return NULL;
   }
@@ -200,6 +210,14 @@ static stream_t *open_stream_plugin(const stream_info_t *sinfo,
 
   s->mode = mode;
 
+  // sector based streams always read a single sector
+  if (!s->sector_size) {
+    if (s->type == STREAMTYPE_FILE)
+      s->max_read_size = STREAM_MAX_READ_SIZE_FILE;
+    else if (s->type == STREAMTYPE_STREAM)
+      s->max_read_size = STREAM_MAX_READ_SIZE_NET;
+  }
+
   mp_msg(MSGT_OPEN,MSGL_V, "STREAM: [%s] %s\n",sinfo->name,filename);
   mp_msg(MSGT_OPEN,MSGL_V, "STREAM: Description: %s\n",sinfo->info);
   mp_msg(MSGT_OPEN,MSGL_V, "STREAM: Author: %s\n", sinfo->author);
@@ -266,9 +284,9 @@ stream_t *open_output_stream(const char *filename, struct MPOpts *options)
 
 //=================== STREAMER =========================
 
-void stream_capture_do(stream_t *s)
+void stream_capture_do(stream_t *s, const unsigned char *buf, int len)
 {
-  if (fwrite(s->buffer, s->buf_len, 1, s->capture_file) < 1) {
+  if (fwrite(buf, len, 1, s->capture_file) < 1) {
     mp_tmsg(MSGT_GLOBAL, MSGL_ERR, "Error writing capture file: %s\n",
             strerror(errno));
     fclose(s->capture_file);
@@ -279,6 +297,11 @@ void stream_capture_do(stream_t *s)
 int stream_read_internal(stream_t *s, void *buf, int len)
 {
   int orig_len = len;
+#ifdef CONFIG_STREAM_CACHE
+  if (s->timeshift)
+    len = timeshift_read(s, buf, len);
+  else
+#endif
   // we will retry even if we already reached EOF previously.
   switch(s->type){
   case STREAMTYPE_STREAM:
@@ -336,18 +359,128 @@ eof_out:
   return len;
 }
 
+static int stream_resize_buffer(stream_t *s, int size)
+{
+  unsigned char *buf;
+  if (size <= s->buffer_size)
+    return 1;
+  buf = realloc(s->buffer, size);
+  if (!buf)
+    return 0;
+  s->buffer = buf;
+  s->buffer_size = size;
+  return 1;
+}
+
+void stream_update_read_size(stream_t *s)
+{
+  // Reading sequentially, double the read size up to the per stream limit.
+  // A seek resets it, so random access stays cheap.
+  int size = FFMIN(2 * s->read_size, s->max_read_size);
+  if (size > s->read_size && stream_resize_buffer(s, size))
+    s->read_size = size;
+}
+
 int stream_fill_buffer(stream_t *s){
-  int len = stream_read_internal(s, s->buffer, STREAM_BUFFER_SIZE);
+  int len = stream_fill_probe_buffer(s);
+  if (len >= 0)
+    return len;
+  len = stream_read_internal(s, s->buffer, s->read_size);
   if (len <= 0)
     return 0;
   s->buf_pos=0;
   s->buf_len=len;
 //  printf("[%d]",len);fflush(stdout);
   if (s->capture_file)
-    stream_capture_do(s);
+    stream_capture_do(s, s->buffer, len);
+  stream_update_read_size(s);
   return len;
 }
 
+/// Whether the buffer starts with the data at probe_start and keeps growing.
+static int probe_buffered(stream_t *s)
+{
+  return s->probe_size && s->pos - s->buf_len == s->probe_start
+         && s->buf_len < s->probe_size;
+}
+
+unsigned char *stream_peek(stream_t *s, int len)
+{
+  int avail = s->buf_len - s->buf_pos;
+  if (len < 0)
+    return NULL;
+  if (avail >= len)
+    return s->buffer + s->buf_pos;
+  // memory streams have all their data in the buffer already
+  if (s->type == STREAMTYPE_MEMORY || s->mode == STREAM_WRITE)
+    return NULL;
+  // Move the unread data to the start of the buffer and append to it,
+  // unless the already read part is probe data that must be kept.
+  if (s->buf_pos && !probe_buffered(s)) {
+    memmove(s->buffer, s->buffer + s->buf_pos, avail);
+    s->buf_pos = 0;
+    s->buf_len = avail;
+  }
+  len += s->buf_pos;
+  // Keep room for a whole sector so sector based streams can be read.
+  if (!stream_resize_buffer(s, len + STREAM_MAX_SECTOR_SIZE))
+    return NULL;
+  while (s->buf_len < len) {
+    unsigned char *buf = s->buffer + s->buf_len;
+    int size = FFMAX(len - s->buf_len, FFMAX(s->read_size, s->sector_size));
+    size = FFMIN(size, s->buffer_size - s->buf_len);
+#ifdef CONFIG_STREAM_CACHE
+    if (s->cache_pid)
+      size = cache_stream_read(s, buf, 1, size);
+    else
+#endif
+    size = stream_read_internal(s, buf, size);
+    if (size <= 0)
+      return NULL;
+    if (s->capture_file)
+      stream_capture_do(s, buf, size);
+    s->buf_len += size;
+  }
+  return s->buffer + s->buf_pos;
+}
+
+void stream_set_probe(stream_t *s, int size)
+{
+  // memory streams hold everything in the buffer anyway, and sector
+  // based streams are local media where rereading is cheap
+  if (s->type == STREAMTYPE_MEMORY || s->mode == STREAM_WRITE
+      || s->sector_size)
+    size = 0;
+  s->probe_size = size;
+  s->probe_start = s->start_pos;
+}
+
+int stream_seek_probe(stream_t *s, off_t pos)
+{
+  off_t start = s->pos - s->buf_len;
+  if (!probe_buffered(s) || pos < s->pos
+      || pos >= s->probe_start + s->probe_size)
+    return 0;
+  s->buf_pos = s->buf_len;
+  if (!stream_peek(s, pos - s->pos + 1))
+    return 0;
+  s->buf_pos = pos - start;
+  s->eof = 0;
+  return 1;
+}
+
+int stream_fill_probe_buffer(stream_t *s)
+{
+  if (!probe_buffered(s))
+    return -1;
+  // like stream_fill_buffer(), drop the unread data, but keep the old data
+  s->buf_pos = s->buf_len;
+  if (!stream_peek(s, 1))
+    return 0;
+  stream_update_read_size(s);
+  return s->buf_len - s->buf_pos;
+}
+
 int stream_write_buffer(stream_t *s, unsigned char *buf, int len) {
   int rd;
   if(!s->write_buffer)
@@ -362,6 +495,10 @@ int stream_write_buffer(stream_t *s, unsigned char *buf, int len) {
 
 int stream_seek_internal(stream_t *s, off_t newpos)
 {
+#ifdef CONFIG_STREAM_CACHE
+  if (s->timeshift)
+    return timeshift_seek(s, newpos) ? -1 : 0;
+#endif
 if(newpos==0 || newpos!=s->pos){
   switch(s->type){
   case STREAMTYPE_STREAM:
@@ -415,7 +552,11 @@ off_t newpos=0;
 
 //  if( mp_msg_test(MSGT_STREAM,MSGL_DBG3) ) printf("seek_long to 0x%X\n",(unsigned int)pos);
 
+  if (stream_seek_probe(s, pos))
+    return 1;
+
   s->buf_pos=s->buf_len=0;
+  s->read_size = STREAM_BUFFER_SIZE;
 
   if(s->mode == STREAM_WRITE) {
     if(!s->seek || !s->seek(s,pos))
@@ -443,12 +584,13 @@ if( mp_msg_test(MSGT_STREAM,MSGL_DBG3) ){
   }
 
 s->eof = 0; // EOF reset when seek succeeds.
-while (stream_fill_buffer(s) > 0) {
-  if(pos<=s->buf_len){
-    s->buf_pos=pos; // byte position in sector
+// buf_pos is 0 after a fill, unless it appended to the probe buffer
+while ((res = stream_fill_buffer(s)) > 0) {
+  if(pos<=res){
+    s->buf_pos+=pos; // byte position in sector
     return 1;
   }
-  pos -= s->buf_len;
+  pos -= res;
 }
 // Fill failed, but seek still is a success.
 s->pos += pos;
@@ -462,7 +604,10 @@ return 1;
 
 
 void stream_reset(stream_t *s){
-  if(s->eof){
+  if (s->eof && probe_buffered(s)) {
+    // the probe data is still valid, stream_seek() can go back into it
+    s->eof = 0;
+  } else if(s->eof){
     s->pos=0;
     s->buf_pos=s->buf_len=0;
     s->eof=0;
@@ -472,6 +617,10 @@ void stream_reset(stream_t *s){
 }
 
 int stream_control(stream_t *s, int cmd, void *arg){
+#ifdef CONFIG_STREAM_CACHE
+  if (s->timeshift)
+    return timeshift_control(s, cmd, arg);
+#endif
   if(!s->control) return STREAM_UNSUPPORTED;
 #ifdef CONFIG_STREAM_CACHE
   if (s->cache_pid)
@@ -485,11 +634,19 @@ stream_t* new_memory_stream(unsigned char* data,int len){
 
   if(len < 0)
     return NULL;
-  s=calloc(1, sizeof(stream_t)+len);
+  s=calloc(1, sizeof(stream_t));
+  if(s==NULL) return NULL;
+  s->buffer_size = FFMAX(len, 1);
+  s->buffer = malloc(s->buffer_size);
+  if (!s->buffer) {
+    free(s);
+    return NULL;
+  }
   s->fd=-1;
   s->type=STREAMTYPE_MEMORY;
   s->buf_pos=0; s->buf_len=len;
   s->start_pos=0; s->end_pos=len;
+  s->read_size = s->max_read_size = STREAM_BUFFER_SIZE;
   stream_reset(s);
   s->pos=len;
   memcpy(s->buffer,data,len);
@@ -499,6 +656,12 @@ stream_t* new_memory_stream(unsigned char* data,int len){
 stream_t* new_stream(int fd,int type){
   stream_t *s=calloc(1, sizeof(stream_t));
   if(s==NULL) return NULL;
+  s->buffer_size = STREAM_MAX_SECTOR_SIZE;
+  s->buffer = malloc(s->buffer_size);
+  if (!s->buffer) {
+    free(s);
+    return NULL;
+  }
 
 #if HAVE_WINSOCK2_H
   {
@@ -512,6 +675,7 @@ stream_t* new_stream(int fd,int type){
   s->type=type;
   s->buf_pos=s->buf_len=0;
   s->start_pos=s->end_pos=0;
+  s->read_size = s->max_read_size = STREAM_BUFFER_SIZE;
   s->priv=NULL;
   s->url=NULL;
   s->cache_pid=0;
@@ -523,7 +687,12 @@ void free_stream(stream_t *s){
 //  printf("\n*** free_stream() called ***\n");
 #ifdef CONFIG_STREAM_CACHE
     cache_uninit(s);
+    timeshift_uninit(s);
 #endif
+  if (s->mapping) {
+    stream_mapping_unref(s->mapping);
+    s->mapping = NULL;
+  }
   if (s->capture_file) {
     fclose(s->capture_file);
     s->capture_file = NULL;
@@ -546,9 +715,48 @@ void free_stream(stream_t *s){
   // streams should destroy their priv on close
   //free(s->priv);
   free(s->url);
+  free(s->buffer);
   free(s);
 }
 
+unsigned char *stream_get_mapped(stream_t *s, off_t pos, int len)
+{
+  struct stream_mapping *m = s->mapping;
+  if (!m || pos < 0 || len < 0 || pos + len > m->size)
+    return NULL;
+  return m->data + pos;
+}
+
+#ifdef HAVE_PTHREADS
+// packets referencing a mapping may be freed from any thread
+static pthread_mutex_t mapping_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void mapping_lock(void)   { pthread_mutex_lock(&mapping_mutex); }
+static void mapping_unlock(void) { pthread_mutex_unlock(&mapping_mutex); }
+#else
+static void mapping_lock(void)   {}
+static void mapping_unlock(void) {}
+#endif
+
+void stream_mapping_ref(struct stream_mapping *m)
+{
+  mapping_lock();
+  m->refcount++;
+  mapping_unlock();
+}
+
+void stream_mapping_unref(struct stream_mapping *m)
+{
+  mapping_lock();
+  int refcount = --m->refcount;
+  mapping_unlock();
+  if (refcount)
+    return;
+#ifdef HAVE_SYS_MMAN_H
+  munmap(m->data, m->size);
+#endif
+  free(m);
+}
+
 stream_t* new_ds_stream(demux_stream_t *ds) {
   stream_t* s = new_stream(-1,STREAMTYPE_DS);
   s->priv = ds;
@@ -562,7 +770,37 @@ void stream_set_interrupt_callback(int (*cb)(struct input_ctx *, int),
     stream_check_interrupt_ctx = ctx;
 }
 
+#ifdef HAVE_PTHREADS
+static pthread_key_t thread_interrupt_key;
+static pthread_once_t thread_interrupt_once = PTHREAD_ONCE_INIT;
+
+static void thread_interrupt_init(void)
+{
+    pthread_key_create(&thread_interrupt_key, NULL);
+}
+#endif
+
+/**
+ * Make stream_check_interrupt() in the calling thread poll *flag instead of
+ * the input callback, which must only be used by the main thread.
+ */
+void stream_set_thread_interrupt(int *flag)
+{
+#ifdef HAVE_PTHREADS
+    pthread_once(&thread_interrupt_once, thread_interrupt_init);
+    pthread_setspecific(thread_interrupt_key, flag);
+#endif
+}
+
 int stream_check_interrupt(int time) {
+#ifdef HAVE_PTHREADS
+    pthread_once(&thread_interrupt_once, thread_interrupt_init);
+    int *flag = pthread_getspecific(thread_interrupt_key);
+    if (flag) {
+        usec_sleep(time * 1000);
+        return *flag;
+    }
+#endif
     if(!stream_check_interrupt_cb) {
         usec_sleep(time * 1000);
         return 0;
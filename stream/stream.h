@@ -57,6 +57,9 @@
 
 #define STREAM_BUFFER_SIZE 2048
 #define STREAM_MAX_SECTOR_SIZE (8*1024)
+// limits for the adaptive read size, see stream_t.max_read_size
+#define STREAM_MAX_READ_SIZE_FILE (1024*1024)
+#define STREAM_MAX_READ_SIZE_NET (64*1024)
 
 #define VCD_SECTOR_SIZE 2352
 #define VCD_SECTOR_OFFS 24
@@ -98,6 +101,13 @@
 #define STREAM_CTRL_GET_NUM_ANGLES 9
 #define STREAM_CTRL_GET_ANGLE 10
 #define STREAM_CTRL_SET_ANGLE 11
+#define STREAM_CTRL_GET_TIME_WINDOW 12
+
+/// Range of times a stream can seek to with STREAM_CTRL_SEEK_TO_TIME, in
+/// the time base of the stream contents (e.g. MPEG PCR).
+struct stream_time_window {
+  double start, end;
+};
 
 
 typedef enum {
@@ -122,6 +132,15 @@ typedef struct streaming_control {
     int *video_id_ptr;
 } streaming_ctrl_t;
 
+/// Memory mapping of a whole file, shared by the stream and by demux packets
+/// pointing into it. Freed when the last reference is dropped; references
+/// may be taken and dropped from any thread.
+struct stream_mapping {
+  unsigned char *data;
+  off_t size;
+  int refcount;
+};
+
 struct stream;
 typedef struct stream_info_st {
   const char *info;
@@ -164,6 +183,8 @@ typedef struct stream {
   int mode; //STREAM_READ or STREAM_WRITE
   unsigned int cache_pid;
   void* cache_data;
+  struct timeshift *timeshift; // NULL unless -timeshift is used
+  struct stream_mapping *mapping; // NULL if the stream is not memory mapped
   void* priv; // used for DVD, TV, RTSP etc
   char* url;  // strdup() of filename/url
   char *lavf_type; // name of expected demuxer type for lavf
@@ -171,7 +192,12 @@ typedef struct stream {
 #ifdef CONFIG_NETWORKING
   streaming_ctrl_t *streaming_ctrl;
 #endif
-  unsigned char buffer[STREAM_BUFFER_SIZE>STREAM_MAX_SECTOR_SIZE?STREAM_BUFFER_SIZE:STREAM_MAX_SECTOR_SIZE];
+  unsigned char *buffer;
+  int buffer_size; // allocated size of buffer, at least STREAM_MAX_SECTOR_SIZE
+  int read_size; // amount of data stream_fill_buffer() asks for
+  int max_read_size; // read_size grows up to this while reading sequentially
+  int probe_size; // while probing, keep up to this much data from probe_start
+  off_t probe_start; // in the buffer so seeking back to it is free
   FILE *capture_file;
 } stream_t;
 
@@ -181,17 +207,40 @@ typedef struct stream {
 
 int stream_fill_buffer(stream_t *s);
 int stream_seek_long(stream_t *s, off_t pos);
-void stream_capture_do(stream_t *s);
+void stream_capture_do(stream_t *s, const unsigned char *buf, int len);
+/// Use larger reads after a sequential buffer fill, up to s->max_read_size.
+void stream_update_read_size(stream_t *s);
+/// Return a pointer to len bytes at the current position without consuming
+/// them, or NULL if the stream ends before. The pointer is valid until the
+/// next read or seek on the stream.
+unsigned char *stream_peek(stream_t *s, int len);
+/// Keep the first size bytes read from the stream start in the buffer, so
+/// demuxer file checks do not have to seek and reread. 0 ends probing.
+void stream_set_probe(stream_t *s, int size);
+/// Append to the probe buffer, returns -1 if this is not a probing read.
+int stream_fill_probe_buffer(stream_t *s);
+/// Seek forward by reading into the probe buffer, returns 0 if not possible.
+int stream_seek_probe(stream_t *s, off_t pos);
+/// Return a pointer to len bytes at pos in the memory mapping of the stream,
+/// or NULL if the stream is not mapped or the range is outside the mapping.
+unsigned char *stream_get_mapped(stream_t *s, off_t pos, int len);
+void stream_mapping_ref(struct stream_mapping *m);
+void stream_mapping_unref(struct stream_mapping *m);
 
 #ifdef CONFIG_STREAM_CACHE
 int stream_enable_cache(stream_t *stream,int size,int min,int prefill);
 int cache_stream_fill_buffer(stream_t *s);
 int cache_stream_seek_long(stream_t *s,off_t pos);
+int cache_stream_read(stream_t *s, unsigned char *buf, int min, int len);
+/// Record the stream into a ring file of size bytes in dir (TMPDIR if
+/// NULL) from a separate thread, and read from that. Returns 0 on error.
+int stream_enable_timeshift(stream_t *stream, off_t size, const char *dir);
 #else
 // no cache, define wrappers:
 #define cache_stream_fill_buffer(x) stream_fill_buffer(x)
 #define cache_stream_seek_long(x,y) stream_seek_long(x,y)
 #define stream_enable_cache(x,y,z,w) 1
+#define stream_enable_timeshift(x,y,z) 0
 #endif
 int stream_write_buffer(stream_t *s, unsigned char *buf, int len);
 
@@ -317,8 +366,9 @@ inline static int stream_seek(stream_t *s,off_t pos){
 }
 
 inline static int stream_skip(stream_t *s,off_t len){
-  if( len<0 || (len>2*STREAM_BUFFER_SIZE && (s->flags & MP_STREAM_SEEK_FW)) ) {
-    // negative or big skip!
+  if( len<0 || (len>2*STREAM_BUFFER_SIZE && len>s->buf_len-s->buf_pos &&
+                 (s->flags & MP_STREAM_SEEK_FW)) ) {
+    // negative or big skip past the buffered data!
     return stream_seek(s,stream_tell(s)+len);
   }
   while(len>0){
@@ -364,6 +414,7 @@ void stream_set_interrupt_callback(int (*cb)(struct input_ctx*, int),
 /// Call the interrupt checking callback if there is one and
 /// wait for time milliseconds
 int stream_check_interrupt(int time);
+void stream_set_thread_interrupt(int *flag);
 /// Internal read function bypassing the stream buffer
 int stream_read_internal(stream_t *s, void *buf, int len);
 /// Internal seek function bypassing the stream buffer
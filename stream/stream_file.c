@@ -19,14 +19,19 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "osdep/io.h"
 
 #include "mp_msg.h"
+#include "options.h"
 #include "stream.h"
 #include "m_option.h"
 #include "m_struct.h"
@@ -57,6 +62,48 @@ static int fill_buffer(stream_t *s, char* buffer, int max_len){
   return (r <= 0) ? -1 : r;
 }
 
+static int fill_buffer_mapped(stream_t *s, char* buffer, int max_len){
+  struct stream_mapping *m = s->mapping;
+  if (s->pos >= m->size) {
+    // the file might have grown after it was mapped
+    if (lseek(s->fd, s->pos, SEEK_SET) < 0)
+      return -1;
+    return fill_buffer(s, buffer, max_len);
+  }
+  if (max_len > m->size - s->pos)
+    max_len = m->size - s->pos;
+  memcpy(buffer, m->data + s->pos, max_len);
+  return max_len;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static void map_file(stream_t *stream, off_t len)
+{
+  struct stream_mapping *m;
+  void *data;
+  if (len <= 0 || len != (size_t)len)
+    return;
+  // Writable private mapping, so demuxers may modify packet data in place
+  // without touching the file.
+  data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, stream->fd, 0);
+  if (data == MAP_FAILED) {
+    mp_msg(MSGT_OPEN, MSGL_V, "[file] mmap failed, using read()\n");
+    return;
+  }
+  m = malloc(sizeof(*m));
+  if (!m) {
+    munmap(data, len);
+    return;
+  }
+  m->data = data;
+  m->size = len;
+  m->refcount = 1;
+  stream->mapping = m;
+  stream->fill_buffer = fill_buffer_mapped;
+  mp_msg(MSGT_OPEN, MSGL_V, "[file] File is memory mapped\n");
+}
+#endif
+
 static int write_buffer(stream_t *s, char* buffer, int len) {
   int r;
   int wr = 0;
@@ -199,6 +246,12 @@ static int open_f(stream_t *stream,int mode, void* opts, int* file_format) {
   stream->control = control;
   stream->read_chunk = 64*1024;
 
+#ifdef HAVE_SYS_MMAN_H
+  if (mode == STREAM_READ && stream->type == STREAMTYPE_FILE &&
+      stream->opts && stream->opts->stream_mmap)
+    map_file(stream, len);
+#endif
+
   m_struct_free(&stream_opts,opts);
   return STREAM_OK;
 }
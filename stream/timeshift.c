@@ -0,0 +1,416 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+// Time-shifting for live streams: a thread keeps reading the source into a
+// fixed-size ring file on disk, whether the player reads or not, so playback
+// can pause and jump back within the recorded window without losing data.
+// For MPEG-TS the positions of the PCRs written are indexed, which lets
+// demux_ts seek to a time inside the window directly.
+// Plain files (e.g. recordings still being written) are read up to their
+// current end and then polled for more. Unlike live sources they lose
+// nothing by waiting, so their recording is held back to keep the ring file
+// from overwriting what playback has not read yet.
+
+// Time (in ms) between checks for user interruption while waiting.
+#define READ_WAIT_TIME 50
+// A source that gives no data for this long (in ms) has ended.
+#define SOURCE_EOF_TIME 5000
+#define CHUNK_SIZE (64 * 1024)
+// minimum distance between index entries, in seconds
+#define INDEX_INTERVAL 0.25
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libavutil/common.h"
+#include "osdep/timer.h"
+
+#include "talloc.h"
+#include "mp_msg.h"
+#include "stream.h"
+#include "timeshift.h"
+
+struct timeshift_entry {
+    off_t pos;      // position of the TS packet carrying the PCR
+    double time;
+};
+
+struct timeshift {
+    // constants:
+    int fd;
+    char *filename;
+    off_t size;             // size of the ring file
+    int stream_flags;       // flags of the stream before time-shift
+    int throttle;           // source can wait for the reader (plain file)
+    stream_t *source;       // private copy owned by the thread
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t data_cond;   // signals the reader
+
+    // only accessed by the thread
+    unsigned char pkt[188]; // TS packet split between two reads
+    int pkt_len;
+    int pcr_pid;
+    double last_pcr;
+    int interrupt;          // makes blocking reads of the source give up
+
+    // everything below is protected by mutex
+    off_t start;            // oldest position still in the ring file
+    off_t end;              // position after the last byte written
+    off_t read_pos;         // position of the reader
+    int ended;              // source eof or write error
+    int quit;
+    struct timeshift_entry *index;
+    int num_index;
+};
+
+// Drop index entries for data that was overwritten.
+static void trim_index(struct timeshift *ts)
+{
+    int n = 0;
+    while (n < ts->num_index && ts->index[n].pos < ts->start)
+        n++;
+    if (n) {
+        memmove(ts->index, ts->index + n,
+                (ts->num_index - n) * sizeof(*ts->index));
+        ts->num_index -= n;
+    }
+}
+
+static void add_pcr(struct timeshift *ts, off_t pos, double time)
+{
+    if (ts->last_pcr != MP_NOPTS_VALUE) {
+        if (time < ts->last_pcr - 1 || time > ts->last_pcr + 60) {
+            // Discontinuity or wraparound, the times before cannot be
+            // compared to the ones after it anymore.
+            mp_msg(MSGT_CACHE, MSGL_V, "Time-shift: PCR discontinuity at "
+                   "%"PRId64", index restarted.\n", (int64_t)pos);
+            pthread_mutex_lock(&ts->mutex);
+            ts->num_index = 0;
+            pthread_mutex_unlock(&ts->mutex);
+        } else if (time < ts->last_pcr + INDEX_INTERVAL)
+            return;
+    }
+    ts->last_pcr = time;
+    pthread_mutex_lock(&ts->mutex);
+    if (!(ts->num_index & 255))
+        ts->index = talloc_realloc(ts, ts->index, struct timeshift_entry,
+                                   ts->num_index + 256);
+    ts->index[ts->num_index++] = (struct timeshift_entry){pos, time};
+    pthread_mutex_unlock(&ts->mutex);
+}
+
+// Look for PCRs in the TS packets of newly written data at pos.
+static void scan_pcr(struct timeshift *ts, unsigned char *buf, int len,
+                     off_t pos)
+{
+    int i = 0;
+    while (i < len) {
+        int n = FFMIN(188 - ts->pkt_len, len - i);
+        memcpy(ts->pkt + ts->pkt_len, buf + i, n);
+        ts->pkt_len += n;
+        i += n;
+        if (ts->pkt_len < 188)
+            break;
+        unsigned char *p = ts->pkt;
+        if (p[0] != 0x47) {
+            unsigned char *sync = memchr(p + 1, 0x47, 187);
+            int skip = sync ? sync - p : 188;
+            memmove(p, p + skip, 188 - skip);
+            ts->pkt_len -= skip;
+            continue;
+        }
+        ts->pkt_len = 0;
+        int pid = ((p[1] & 0x1F) << 8) | p[2];
+        // adaptation field with PCR
+        if (!(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+            continue;
+        if (ts->pcr_pid < 0)
+            ts->pcr_pid = pid;
+        if (pid != ts->pcr_pid)
+            continue;
+        uint64_t pcr = ((uint64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9)
+                       | (p[9] << 1) | (p[10] >> 7);
+        add_pcr(ts, pos + i - 188, pcr / 90000.0);
+    }
+}
+
+// Write len bytes at the ring position of pos, wrapping around.
+static int ring_write(struct timeshift *ts, unsigned char *buf, int len,
+                      off_t pos)
+{
+    while (len > 0) {
+        off_t offset = pos % ts->size;
+        int n = FFMIN(len, ts->size - offset);
+        if (pwrite(ts->fd, buf, n, offset) != n)
+            return 0;
+        buf += n;
+        pos += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static void *timeshift_thread(void *arg)
+{
+    struct timeshift *ts = arg;
+    unsigned char *buf = malloc(CHUNK_SIZE);
+    unsigned idle_since = GetTimerMS();
+
+    stream_set_thread_interrupt(&ts->interrupt);
+    while (buf) {
+        pthread_mutex_lock(&ts->mutex);
+        int quit = ts->quit;
+        off_t end = ts->end;
+        int full = ts->throttle && end + CHUNK_SIZE - ts->read_pos > ts->size;
+        pthread_mutex_unlock(&ts->mutex);
+        if (quit)
+            break;
+        if (full) {
+            usec_sleep(READ_WAIT_TIME * 1000);
+            idle_since = GetTimerMS();
+            continue;
+        }
+
+        int len = stream_read_internal(ts->source, buf, CHUNK_SIZE);
+        if (len <= 0) {
+            // live sources and growing files may only be late
+            if (GetTimerMS() - idle_since > SOURCE_EOF_TIME)
+                break;
+            ts->source->eof = 0;
+            usec_sleep(READ_WAIT_TIME * 1000);
+            continue;
+        }
+        idle_since = GetTimerMS();
+
+        // The reader must not copy data that is being overwritten.
+        pthread_mutex_lock(&ts->mutex);
+        ts->start = FFMAX(ts->start, end + len - ts->size);
+        trim_index(ts);
+        pthread_mutex_unlock(&ts->mutex);
+
+        if (!ring_write(ts, buf, len, end)) {
+            mp_msg(MSGT_CACHE, MSGL_ERR, "Writing time-shift file failed: "
+                   "%s\n", strerror(errno));
+            break;
+        }
+        scan_pcr(ts, buf, len, end);
+
+        pthread_mutex_lock(&ts->mutex);
+        ts->end = end + len;
+        pthread_cond_broadcast(&ts->data_cond);
+        pthread_mutex_unlock(&ts->mutex);
+    }
+
+    free(buf);
+    pthread_mutex_lock(&ts->mutex);
+    ts->ended = 1;
+    pthread_cond_broadcast(&ts->data_cond);
+    pthread_mutex_unlock(&ts->mutex);
+    return NULL;
+}
+
+// Wait with the mutex held for new data. Return 1 if the user wants to abort.
+static int timeshift_wait(struct timeshift *ts)
+{
+    struct timeval now;
+    struct timespec t;
+    gettimeofday(&now, NULL);
+    t.tv_sec = now.tv_sec;
+    t.tv_nsec = (now.tv_usec + READ_WAIT_TIME * 1000) * 1000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&ts->data_cond, &ts->mutex, &t);
+    pthread_mutex_unlock(&ts->mutex);
+    int res = stream_check_interrupt(0);
+    pthread_mutex_lock(&ts->mutex);
+    return res;
+}
+
+int timeshift_read(stream_t *s, unsigned char *buf, int len)
+{
+    struct timeshift *ts = s->timeshift;
+    int total = 0;
+
+    pthread_mutex_lock(&ts->mutex);
+    if (s->pos < ts->start) {
+        mp_msg(MSGT_CACHE, MSGL_WARN, "Time-shift buffer overrun, skipping "
+               "%"PRId64" bytes.\n", (int64_t)(ts->start - s->pos));
+        s->pos = ts->start;
+    }
+    while (ts->end <= s->pos) {
+        if (ts->ended || timeshift_wait(ts)) {
+            pthread_mutex_unlock(&ts->mutex);
+            s->eof = 1;
+            return 0;
+        }
+    }
+    // Read under the lock, the thread advances start before overwriting.
+    len = FFMIN(len, ts->end - s->pos);
+    while (total < len) {
+        off_t offset = (s->pos + total) % ts->size;
+        int n = FFMIN(len - total, ts->size - offset);
+        n = pread(ts->fd, buf + total, n, offset);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    ts->read_pos = s->pos + total;
+    pthread_mutex_unlock(&ts->mutex);
+    return total;
+}
+
+int timeshift_seek(stream_t *s, off_t pos)
+{
+    struct timeshift *ts = s->timeshift;
+    pthread_mutex_lock(&ts->mutex);
+    s->pos = FFMIN(FFMAX(pos, ts->start), ts->end);
+    ts->read_pos = s->pos;
+    pthread_mutex_unlock(&ts->mutex);
+    return 1;
+}
+
+// Index entry at or before time, the first one if there is none.
+static struct timeshift_entry *find_time(struct timeshift *ts, double time)
+{
+    int lo = 0, hi = ts->num_index;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (ts->index[mid].time <= time)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &ts->index[lo];
+}
+
+int timeshift_control(stream_t *s, int cmd, void *arg)
+{
+    struct timeshift *ts = s->timeshift;
+    int res = STREAM_UNSUPPORTED;
+
+    pthread_mutex_lock(&ts->mutex);
+    trim_index(ts);
+    if (ts->num_index) {
+        switch (cmd) {
+        case STREAM_CTRL_GET_TIME_WINDOW: {
+            struct stream_time_window *w = arg;
+            w->start = ts->index[0].time;
+            w->end = ts->index[ts->num_index - 1].time;
+            res = STREAM_OK;
+            break;
+        }
+        case STREAM_CTRL_SEEK_TO_TIME:
+            s->pos = ts->read_pos = find_time(ts, *(double *)arg)->pos;
+            s->buf_pos = s->buf_len = 0;
+            s->eof = 0;
+            res = STREAM_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ts->mutex);
+    return res;
+}
+
+void timeshift_uninit(stream_t *s)
+{
+    struct timeshift *ts = s->timeshift;
+    if (!ts)
+        return;
+    pthread_mutex_lock(&ts->mutex);
+    ts->quit = 1;
+    ts->interrupt = 1;
+    pthread_mutex_unlock(&ts->mutex);
+    pthread_join(ts->thread, NULL);
+    pthread_mutex_destroy(&ts->mutex);
+    pthread_cond_destroy(&ts->data_cond);
+    close(ts->fd);
+    unlink(ts->filename);
+    free(ts->source->buffer);
+    free(ts->source);
+    s->flags = ts->stream_flags;
+    talloc_free(ts);
+    s->timeshift = NULL;
+}
+
+int stream_enable_timeshift(stream_t *stream, off_t size, const char *dir)
+{
+    struct timeshift *ts = talloc_zero(NULL, struct timeshift);
+
+    if (!dir)
+        dir = getenv("TMPDIR");
+    ts->filename = talloc_asprintf(ts, "%s/mplayer-timeshift-XXXXXX",
+                                   dir ? dir : "/tmp");
+    ts->fd = mkstemp(ts->filename);
+    if (ts->fd < 0) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Cannot open time-shift file %s: %s\n",
+               ts->filename, strerror(errno));
+        talloc_free(ts);
+        return 0;
+    }
+    ts->size = size;
+    ts->start = ts->end = ts->read_pos = stream->pos;
+    ts->throttle = stream->type == STREAMTYPE_FILE;
+    ts->pcr_pid = -1;
+    ts->last_pcr = MP_NOPTS_VALUE;
+
+    ts->source = malloc(sizeof(stream_t));
+    if (ts->source) {
+        memcpy(ts->source, stream, sizeof(stream_t));
+        // the thread's copy must not share the buffer with the reader
+        ts->source->buffer = malloc(stream->buffer_size);
+    }
+    if (!ts->source || !ts->source->buffer) {
+        free(ts->source);
+        close(ts->fd);
+        unlink(ts->filename);
+        talloc_free(ts);
+        return 0;
+    }
+    pthread_mutex_init(&ts->mutex, NULL);
+    pthread_cond_init(&ts->data_cond, NULL);
+    if (pthread_create(&ts->thread, NULL, timeshift_thread, ts)) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Starting time-shift thread failed: "
+               "%s.\n", strerror(errno));
+        pthread_mutex_destroy(&ts->mutex);
+        pthread_cond_destroy(&ts->data_cond);
+        close(ts->fd);
+        unlink(ts->filename);
+        free(ts->source->buffer);
+        free(ts->source);
+        talloc_free(ts);
+        return 0;
+    }
+    stream->timeshift = ts;
+    // anything in the window can be reached now
+    ts->stream_flags = stream->flags;
+    stream->flags |= MP_STREAM_SEEK;
+    mp_msg(MSGT_CACHE, MSGL_V, "Time-shift: %"PRId64" MB in %s\n",
+           (int64_t)(size >> 20), ts->filename);
+    return 1;
+}
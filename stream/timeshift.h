@@ -0,0 +1,29 @@
+/*
+ * This file is part of MPlayer.
+ *
+ * MPlayer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * MPlayer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with MPlayer; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MPLAYER_TIMESHIFT_H
+#define MPLAYER_TIMESHIFT_H
+
+#include "stream.h"
+
+int timeshift_read(stream_t *s, unsigned char *buf, int len);
+int timeshift_seek(stream_t *s, off_t pos);
+int timeshift_control(stream_t *s, int cmd, void *arg);
+void timeshift_uninit(stream_t *s);
+
+#endif /* MPLAYER_TIMESHIFT_H */
@@ -72,6 +72,8 @@ struct osd_state {
     struct ass_library *ass_library;
     // flag to signal reinitialization due to ass-related option changes
     bool ass_force_reload;
+    // fonts were added to ass_library after the renderer was set up
+    bool ass_fonts_changed;
     char *osd_text;
     struct font_desc *sub_font;
     struct ass_track *ass_track;
@@ -17,15 +17,26 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <assert.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <libavutil/common.h>
 
+#include "config.h"
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "osdep/io.h"
 
 #include "talloc.h"
+#include "options.h"
 
 #include "mp_core.h"
 #include "mp_msg.h"
@@ -87,6 +98,252 @@ static char **find_files(const char *original_file, const char *suffix)
     return results;
 }
 
+/* Segment UIDs of the candidate files are read from the start of each file
+ * only, several files at a time, and cached per directory in
+ * ~/.mplayer/mkv_uids/ together with the size and mtime of each file. */
+
+#define UID_PROBE_SIZE (64 * 1024)
+#define UID_SCAN_THREADS 8
+#define UID_CACHE_MAGIC "MPMKVUID1"
+
+struct uid_entry {
+    char *filename;
+    int64_t size, mtime;
+    unsigned char uid[16];
+    int res;            // result of demux_mkv_read_segment_uid()
+    bool from_cache;    // uid/res loaded from the cache, not checked yet
+};
+
+struct uid_scan {
+    struct uid_entry *entries;
+    int num_entries;
+    int next;
+    unsigned char (*wanted)[16];
+    bool *found;
+    int num_wanted, num_left;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+static int probe_segment_uid(const char *filename, unsigned char uid[16])
+{
+    int fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return -1;
+    unsigned char *buf = malloc(UID_PROBE_SIZE);
+    int len = 0, r;
+    while (buf && len < UID_PROBE_SIZE
+           && (r = read(fd, buf + len, UID_PROBE_SIZE - len)) > 0)
+        len += r;
+    close(fd);
+    struct stream *s = buf ? new_memory_stream(buf, len) : NULL;
+    free(buf);
+    if (!s)
+        return -1;
+    int res = demux_mkv_read_segment_uid(s, uid);
+    free_stream(s);
+    return res;
+}
+
+static void check_uid_entry(struct uid_entry *e)
+{
+    struct stat st;
+    if (stat(e->filename, &st)) {
+        e->res = -1;
+        e->from_cache = false;
+        return;
+    }
+    if (e->from_cache && e->size == st.st_size && e->mtime == st.st_mtime)
+        return;
+    e->from_cache = false;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->res = probe_segment_uid(e->filename, e->uid);
+}
+
+static void scan_lock(struct uid_scan *scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+}
+
+static void scan_unlock(struct uid_scan *scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_mutex_unlock(&scan->lock);
+#endif
+}
+
+static void *uid_scan_thread(void *arg)
+{
+    struct uid_scan *scan = arg;
+    while (1) {
+        scan_lock(scan);
+        int i = scan->next++;
+        bool done = i >= scan->num_entries || !scan->num_left;
+        scan_unlock(scan);
+        if (done)
+            break;
+        struct uid_entry *e = &scan->entries[i];
+        check_uid_entry(e);
+        if (e->res <= 0)
+            continue;
+        // stop scanning once every wanted segment has been found
+        scan_lock(scan);
+        for (int n = 0; n < scan->num_wanted; n++)
+            if (!scan->found[n] && !memcmp(e->uid, scan->wanted[n], 16)) {
+                scan->found[n] = true;
+                scan->num_left--;
+                break;
+            }
+        scan_unlock(scan);
+    }
+    return NULL;
+}
+
+static void scan_uids(struct uid_scan *scan)
+{
+#ifdef HAVE_PTHREADS
+    pthread_t threads[UID_SCAN_THREADS - 1];
+    int num_threads = 0;
+    pthread_mutex_init(&scan->lock, NULL);
+    while (num_threads < FFMIN(scan->num_entries, UID_SCAN_THREADS) - 1
+           && !pthread_create(&threads[num_threads], NULL, uid_scan_thread,
+                              scan))
+        num_threads++;
+    uid_scan_thread(scan);
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&scan->lock);
+#else
+    uid_scan_thread(scan);
+#endif
+}
+
+static char *uid_cache_name(struct bstr directory)
+{
+    // FNV-1a hash of the directory name
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < directory.len; i++)
+        hash = (hash ^ directory.start[i]) * 1099511628211ULL;
+    char name[40];
+    snprintf(name, sizeof(name), "mkv_uids/%016"PRIx64, hash);
+    return get_path(name);
+}
+
+static void load_uid_cache(const char *cachename, struct uid_entry *entries,
+                           int num_entries)
+{
+    FILE *fp = fopen(cachename, "r");
+    char line[1024];
+    if (!fp)
+        return;
+    if (!fgets(line, sizeof(line), fp)
+        || strcmp(line, UID_CACHE_MAGIC "\n"))
+        goto out;
+    while (fgets(line, sizeof(line), fp)) {
+        int64_t size, mtime;
+        int res, pos;
+        char uid[33];
+        if (sscanf(line, "%"SCNx64" %"SCNx64" %d %32s %n", &size, &mtime,
+                   &res, uid, &pos) != 4 || strlen(uid) != 32)
+            continue;
+        char *name = line + pos;
+        name[strcspn(name, "\n")] = '\0';
+        for (int i = 0; i < num_entries; i++) {
+            struct uid_entry *e = &entries[i];
+            if (strcmp(mp_basename(e->filename), name))
+                continue;
+            for (int n = 0; n < 16; n++)
+                sscanf(uid + 2 * n, "%2hhx", &e->uid[n]);
+            e->size = size;
+            e->mtime = mtime;
+            e->res = res;
+            e->from_cache = true;
+            break;
+        }
+    }
+ out:
+    fclose(fp);
+}
+
+static void save_uid_cache(const char *cachename, struct uid_entry *entries,
+                           int num_entries)
+{
+    bool changed = false;
+    for (int i = 0; i < num_entries; i++)
+        changed |= !entries[i].from_cache && entries[i].res >= 0;
+    if (!changed)
+        return;
+    char *dir = get_path("mkv_uids");
+    if (dir)
+        mkdir(dir, 0777);
+    free(dir);
+    // write to a temporary file so readers never see a partial cache
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", cachename);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        mp_msg(MSGT_CPLAYER, MSGL_V, "Can't write segment UID cache %s\n",
+               tmp);
+        goto out;
+    }
+    fprintf(fp, "%s\n", UID_CACHE_MAGIC);
+    for (int i = 0; i < num_entries; i++) {
+        struct uid_entry *e = &entries[i];
+        if (e->res < 0)
+            continue;
+        fprintf(fp, "%"PRIx64" %"PRIx64" %d ", e->size, e->mtime, e->res);
+        for (int n = 0; n < 16; n++)
+            fprintf(fp, "%02x", e->uid[n]);
+        fprintf(fp, " %s\n", mp_basename(e->filename));
+    }
+    if (fclose(fp) || rename(tmp, cachename))
+        remove(tmp);
+ out:
+    talloc_free(tmp);
+}
+
+/* Find the segment UIDs of the files, from the cache where it is still
+ * valid and by reading the file headers otherwise. */
+static struct uid_entry *get_segment_uids(struct MPContext *mpctx,
+                                          char **filenames, int num_filenames,
+                                          unsigned char uid_map[][16],
+                                          int num_sources)
+{
+    struct uid_entry *entries = talloc_zero_array(NULL, struct uid_entry,
+                                                  num_filenames);
+    for (int i = 0; i < num_filenames; i++) {
+        entries[i].filename = filenames[i];
+        entries[i].res = -1;
+    }
+    char *cachename = NULL;
+    if (mpctx->opts.mkv_index_cache && num_filenames) {
+        cachename = uid_cache_name(mp_dirname(filenames[0]));
+        if (cachename)
+            load_uid_cache(cachename, entries, num_filenames);
+    }
+
+    struct uid_scan scan = {
+        .entries = entries,
+        .num_entries = num_filenames,
+        .wanted = uid_map + 1,
+        .found = talloc_zero_array(entries, bool, num_sources - 1),
+        .num_wanted = num_sources - 1,
+        .num_left = num_sources - 1,
+    };
+    scan_uids(&scan);
+    // entries not reached because everything was found already
+    for (int i = scan.next; i < num_filenames; i++)
+        entries[i].from_cache = true;
+
+    if (cachename)
+        save_uid_cache(cachename, entries, num_filenames);
+    free(cachename);
+    return entries;
+}
+
 static int find_ordered_chapter_sources(struct MPContext *mpctx,
                                         struct content_source *sources,
                                         int num_sources,
@@ -108,8 +365,22 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
         }
     }
 
+    struct uid_entry *uids = get_segment_uids(mpctx, filenames, num_filenames,
+                                              uid_map, num_sources);
     int num_left = num_sources - 1;
     for (int i = 0; i < num_filenames && num_left > 0; i++) {
+        // only open files whose UID is wanted, or couldn't be determined
+        if (uids[i].res == 0)
+            continue;
+        if (uids[i].res > 0) {
+            int j;
+            for (j = 1; j < num_sources; j++)
+                if (!sources[j].demuxer
+                    && !memcmp(uid_map[j], uids[i].uid, 16))
+                    break;
+            if (j == num_sources)
+                continue;
+        }
         mp_msg(MSGT_CPLAYER, MSGL_INFO, "Checking file %s\n",
                filename_recode(filenames[i]));
         int format = 0;
@@ -146,6 +417,7 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
     match:
         ;
     }
+    talloc_free(uids);
     talloc_free(filenames);
     if (num_left) {
         mp_msg(MSGT_CPLAYER, MSGL_ERR, "Failed to find ordered chapter part!\n"